@@ -0,0 +1,428 @@
+#include "../bucket_storage.hpp"
+#include "harness.hpp"
+
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iterator>
+#include <list>
+#include <string>
+#include <vector>
+
+namespace
+{
+	template< size_t Bytes >
+	struct Payload
+	{
+		std::uint64_t key;
+		std::array< std::uint8_t, Bytes - sizeof(std::uint64_t) > pad;
+	};
+
+	template< typename T >
+	T make_value(size_t i)
+	{
+		if constexpr (std::is_integral_v< T >)
+		{
+			return static_cast< T >(i);
+		}
+		else
+		{
+			T value{};
+			value.key = i;
+			return value;
+		}
+	}
+
+	template< typename T >
+	std::uint64_t key_of(const T& value)
+	{
+		if constexpr (std::is_integral_v< T >)
+		{
+			return value;
+		}
+		else
+		{
+			return value.key;
+		}
+	}
+
+	// std::vector plus an index free list: the usual hand-rolled stable-handle pool.
+	template< typename T >
+	class FreeListVector
+	{
+	  public:
+		using handle = std::uint32_t;
+
+		handle insert(const T& x)
+		{
+			if (m_free_head != npos)
+			{
+				handle h = m_free_head;
+				m_free_head = m_slots[h].next_free;
+				m_slots[h].value = x;
+				m_slots[h].live = true;
+				return h;
+			}
+			m_slots.push_back(Slot{ x, npos, true });
+			return static_cast< handle >(m_slots.size() - 1);
+		}
+
+		void erase(handle h)
+		{
+			m_slots[h].live = false;
+			m_slots[h].next_free = m_free_head;
+			m_free_head = h;
+		}
+
+		template< typename F >
+		void for_each(F&& f) const
+		{
+			for (const Slot& slot : m_slots)
+				if (slot.live)
+					f(slot.value);
+		}
+
+		handle advance(size_t dist) const
+		{
+			handle h = 0;
+			while (!m_slots[h].live)
+				++h;
+			for (; dist > 0; --dist)
+			{
+				++h;
+				while (!m_slots[h].live)
+					++h;
+			}
+			return h;
+		}
+
+		void shrink_to_fit()
+		{
+			std::vector< Slot > dense;
+			dense.reserve(m_slots.size());
+			for (Slot& slot : m_slots)
+				if (slot.live)
+					dense.push_back(slot);
+			m_slots.swap(dense);
+			m_free_head = npos;
+		}
+
+		const T& get(handle h) const { return m_slots[h].value; }
+
+	  private:
+		static constexpr handle npos = UINT32_MAX;
+
+		struct Slot
+		{
+			T value;
+			handle next_free;
+			bool live;
+		};
+
+		std::vector< Slot > m_slots;
+		handle m_free_head = npos;
+	};
+
+	template< typename T >
+	struct BucketAdapter
+	{
+		using container = BucketStorage< T >;
+		using handle = typename container::iterator;
+		static constexpr bool random_erase = true;
+		static constexpr bool shrinks = true;
+
+		static const char* name() { return "BucketStorage"; }
+		static container make(size_t block_capacity) { return container(block_capacity); }
+		static handle insert(container& c, const T& x) { return c.insert(x); }
+		static void erase(container& c, handle h) { c.erase(h); }
+		static void pop_front(container& c) { c.erase(c.begin()); }
+		static void shrink(container& c) { c.shrink_to_fit(); }
+		static std::uint64_t advance(container& c, size_t dist) { return key_of(*c.get_to_distance(c.begin(), dist)); }
+
+		template< typename F >
+		static void for_each(const container& c, F&& f)
+		{
+			for (const T& x : c)
+				f(x);
+		}
+	};
+
+	template< typename T >
+	struct ListAdapter
+	{
+		using container = std::list< T >;
+		using handle = typename container::iterator;
+		static constexpr bool random_erase = true;
+		static constexpr bool shrinks = false;
+
+		static const char* name() { return "std::list"; }
+		static container make(size_t) { return container(); }
+		static handle insert(container& c, const T& x) { return c.insert(c.end(), x); }
+		static void erase(container& c, handle h) { c.erase(h); }
+		static void pop_front(container& c) { c.pop_front(); }
+		static void shrink(container&) {}
+		static std::uint64_t advance(container& c, size_t dist) { return key_of(*std::next(c.begin(), dist)); }
+
+		template< typename F >
+		static void for_each(const container& c, F&& f)
+		{
+			for (const T& x : c)
+				f(x);
+		}
+	};
+
+	template< typename T >
+	struct DequeAdapter
+	{
+		using container = std::deque< T >;
+		using handle = size_t;
+		static constexpr bool random_erase = false;
+		static constexpr bool shrinks = true;
+
+		static const char* name() { return "std::deque"; }
+		static container make(size_t) { return container(); }
+		static handle insert(container& c, const T& x)
+		{
+			c.push_back(x);
+			return c.size() - 1;
+		}
+		static void erase(container&, handle) {}
+		static void pop_front(container& c) { c.pop_front(); }
+		static void shrink(container& c) { c.shrink_to_fit(); }
+		static std::uint64_t advance(container& c, size_t dist) { return key_of(*std::next(c.begin(), dist)); }
+
+		template< typename F >
+		static void for_each(const container& c, F&& f)
+		{
+			for (const T& x : c)
+				f(x);
+		}
+	};
+
+	template< typename T >
+	struct FreeListAdapter
+	{
+		using container = FreeListVector< T >;
+		using handle = typename container::handle;
+		static constexpr bool random_erase = true;
+		static constexpr bool shrinks = true;
+
+		static const char* name() { return "vector+free-list"; }
+		static container make(size_t) { return container(); }
+		static handle insert(container& c, const T& x) { return c.insert(x); }
+		static void erase(container& c, handle h) { c.erase(h); }
+		static void pop_front(container&) {}
+		static void shrink(container& c) { c.shrink_to_fit(); }
+		static std::uint64_t advance(container& c, size_t dist) { return key_of(c.get(c.advance(dist))); }
+
+		template< typename F >
+		static void for_each(const container& c, F&& f)
+		{
+			c.for_each(f);
+		}
+	};
+
+	struct Config
+	{
+		std::vector< size_t > sizes = { 1000, 100000 };
+		std::vector< size_t > block_capacities = { 16, 64, 256 };
+		size_t repeats = 3;
+	};
+
+	template< typename Adapter, typename T >
+	struct Filled
+	{
+		typename Adapter::container c;
+		std::vector< typename Adapter::handle > handles;
+	};
+
+	template< typename Adapter, typename T >
+	Filled< Adapter, T > fill(size_t n, size_t block_capacity)
+	{
+		Filled< Adapter, T > f{ Adapter::make(block_capacity), {} };
+		f.handles.reserve(n);
+		for (size_t i = 0; i < n; ++i)
+			f.handles.push_back(Adapter::insert(f.c, make_value< T >(i)));
+		return f;
+	}
+
+	template< typename Adapter, typename T >
+	void run_container(bench::Reporter& reporter, const Config& config, size_t n, size_t block_capacity)
+	{
+		using container = typename Adapter::container;
+		auto emit = [&](const char* operation, size_t iterations, std::uint64_t ns)
+		{ reporter.report({ Adapter::name(), operation, sizeof(T), block_capacity, n, iterations, ns }); };
+
+		emit("insert",
+			 n,
+			 bench::measure(
+				 config.repeats,
+				 [&] { return Adapter::make(block_capacity); },
+				 [&](container& c)
+				 {
+					 for (size_t i = 0; i < n; ++i)
+						 Adapter::insert(c, make_value< T >(i));
+				 }));
+
+		if constexpr (Adapter::random_erase)
+		{
+			emit("erase_random",
+				 n,
+				 bench::measure(
+					 config.repeats,
+					 [&]
+					 {
+						 auto f = fill< Adapter, T >(n, block_capacity);
+						 bench::Rng(n).shuffle(f.handles.begin(), f.handles.end());
+						 return f;
+					 },
+					 [&](Filled< Adapter, T >& f)
+					 {
+						 for (auto& h : f.handles)
+							 Adapter::erase(f.c, h);
+					 }));
+		}
+
+		if constexpr (!std::is_same_v< Adapter, FreeListAdapter< T > >)
+		{
+			emit("erase_fifo",
+				 n,
+				 bench::measure(
+					 config.repeats,
+					 [&] { return fill< Adapter, T >(n, block_capacity); },
+					 [&](Filled< Adapter, T >& f)
+					 {
+						 for (size_t i = 0; i < n; ++i)
+							 Adapter::pop_front(f.c);
+					 }));
+		}
+
+		emit("scan",
+			 n,
+			 bench::measure(
+				 config.repeats,
+				 [&] { return fill< Adapter, T >(n, block_capacity); },
+				 [&](Filled< Adapter, T >& f)
+				 {
+					 std::uint64_t sum = 0;
+					 Adapter::for_each(f.c, [&](const T& x) { sum += key_of(x); });
+					 bench::do_not_optimize(sum);
+				 }));
+
+		emit("copy",
+			 n,
+			 bench::measure(
+				 config.repeats,
+				 [&] { return fill< Adapter, T >(n, block_capacity); },
+				 [&](Filled< Adapter, T >& f)
+				 {
+					 container copy(f.c);
+					 bench::do_not_optimize(copy);
+				 }));
+
+		if constexpr (Adapter::shrinks)
+		{
+			emit("shrink_to_fit",
+				 n / 2,
+				 bench::measure(
+					 config.repeats,
+					 [&]
+					 {
+						 auto f = fill< Adapter, T >(n, block_capacity);
+						 if constexpr (Adapter::random_erase)
+						 {
+							 bench::Rng(n + 1).shuffle(f.handles.begin(), f.handles.end());
+							 for (size_t i = 0; i < n / 2; ++i)
+								 Adapter::erase(f.c, f.handles[i]);
+						 }
+						 else
+						 {
+							 for (size_t i = 0; i < n / 2; ++i)
+								 Adapter::pop_front(f.c);
+						 }
+						 return f;
+					 },
+					 [&](Filled< Adapter, T >& f) { Adapter::shrink(f.c); }));
+		}
+
+		constexpr size_t lookups = 16;
+		emit("get_to_distance",
+			 lookups * (n / 2),
+			 bench::measure(
+				 config.repeats,
+				 [&] { return fill< Adapter, T >(n, block_capacity); },
+				 [&](Filled< Adapter, T >& f)
+				 {
+					 std::uint64_t sum = 0;
+					 for (size_t i = 0; i < lookups; ++i)
+						 sum += Adapter::advance(f.c, n / 2);
+					 bench::do_not_optimize(sum);
+				 }));
+
+		emit("teardown",
+			 n,
+			 bench::measure(
+				 config.repeats,
+				 [&] { return new container(fill< Adapter, T >(n, block_capacity).c); },
+				 [&](container*& c)
+				 {
+					 delete c;
+					 c = nullptr;
+				 }));
+	}
+
+	template< typename T >
+	void run_element(bench::Reporter& reporter, const Config& config)
+	{
+		for (size_t n : config.sizes)
+		{
+			for (size_t block_capacity : config.block_capacities)
+				run_container< BucketAdapter< T >, T >(reporter, config, n, block_capacity);
+			run_container< ListAdapter< T >, T >(reporter, config, n, 0);
+			run_container< DequeAdapter< T >, T >(reporter, config, n, 0);
+			run_container< FreeListAdapter< T >, T >(reporter, config, n, 0);
+		}
+	}
+
+	std::vector< size_t > parse_list(const char* text)
+	{
+		std::vector< size_t > values;
+		while (*text != '\0')
+		{
+			char* end = nullptr;
+			values.push_back(std::strtoull(text, &end, 10));
+			if (*end != ',')
+				break;
+			text = end + 1;
+		}
+		return values;
+	}
+}	 // namespace
+
+// Usage: bench [--sizes=1000,100000] [--blocks=16,64,256] [--repeats=3] > results.csv
+int main(int argc, char** argv)
+{
+	Config config;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (std::strncmp(argv[i], "--sizes=", 8) == 0)
+			config.sizes = parse_list(argv[i] + 8);
+		else if (std::strncmp(argv[i], "--blocks=", 9) == 0)
+			config.block_capacities = parse_list(argv[i] + 9);
+		else if (std::strncmp(argv[i], "--repeats=", 10) == 0)
+			config.repeats = std::strtoull(argv[i] + 10, nullptr, 10);
+		else
+		{
+			std::fprintf(stderr, "usage: %s [--sizes=N,...] [--blocks=N,...] [--repeats=N]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	bench::Reporter reporter(stdout);
+	run_element< std::uint32_t >(reporter, config);
+	run_element< Payload< 32 > >(reporter, config);
+	run_element< Payload< 128 > >(reporter, config);
+	return 0;
+}
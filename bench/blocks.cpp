@@ -0,0 +1,149 @@
+#include "../bucket_storage.hpp"
+#include "harness.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+namespace
+{
+	using fixed = BucketStorage< std::uint64_t >;
+	using geometric = BucketStorage< std::uint64_t, geometric_blocks< 65536 > >;
+
+	struct Config
+	{
+		std::vector< size_t > sizes = { 10, 1000, 100000, 10000000 };
+		size_t repeats = 3;
+	};
+
+	template< typename Storage >
+	struct Filled
+	{
+		Storage c;
+		std::vector< typename Storage::iterator > its;
+	};
+
+	template< typename Storage >
+	Filled< Storage > fill(size_t n, size_t block_capacity)
+	{
+		Filled< Storage > f{ Storage(block_capacity), {} };
+		f.its.reserve(n);
+		for (size_t i = 0; i < n; ++i)
+			f.its.push_back(f.c.insert(i));
+		return f;
+	}
+
+	template< typename Storage >
+	void run(const char* name, const Config& config, size_t n, size_t block_capacity)
+	{
+		// Small sizes are timed over many containers so the clock resolution does not dominate.
+		size_t rounds = std::max< size_t >(1, 1000000 / n);
+		double per_element = static_cast< double >(rounds * n);
+
+		std::uint64_t insert = bench::measure(
+			config.repeats,
+			[] { return 0; },
+			[&](int)
+			{
+				for (size_t r = 0; r < rounds; ++r)
+				{
+					Storage c(block_capacity);
+					for (size_t i = 0; i < n; ++i)
+						c.insert(i);
+					bench::do_not_optimize(c);
+				}
+			});
+
+		std::uint64_t scan = bench::measure(
+			config.repeats,
+			[&] { return fill< Storage >(n, block_capacity); },
+			[&](Filled< Storage >& f)
+			{
+				std::uint64_t sum = 0;
+				for (size_t r = 0; r < rounds; ++r)
+					for (std::uint64_t x : std::as_const(f.c))
+						sum += x;
+				bench::do_not_optimize(sum);
+			});
+
+		std::uint64_t erase = bench::measure(
+			config.repeats,
+			[&]
+			{
+				auto f = fill< Storage >(n, block_capacity);
+				bench::Rng(n).shuffle(f.its.begin(), f.its.end());
+				return f;
+			},
+			[&](Filled< Storage >& f)
+			{
+				for (auto& it : f.its)
+					f.c.erase(it);
+			});
+
+		Filled< Storage > f = fill< Storage >(n, block_capacity);
+		typename Storage::MemoryStats full = f.c.memory_stats();
+		bench::Rng(n + 1).shuffle(f.its.begin(), f.its.end());
+		for (size_t i = 0; i < n - n / 10; ++i)
+			f.c.erase(f.its[i]);
+		typename Storage::MemoryStats tenth = f.c.memory_stats();
+
+		std::printf("%-10s block=%-5zu n=%-10zu insert=%7.2f scan=%6.2f erase=%7.2f ns/element  blocks=%-7zu bytes/element=%7.2f"
+					"  after erasing 90%%: blocks=%-7zu bytes/element=%7.2f\n",
+					name,
+					block_capacity,
+					n,
+					static_cast< double >(insert) / per_element,
+					static_cast< double >(scan) / per_element,
+					static_cast< double >(erase) / static_cast< double >(n),
+					full.blocks,
+					static_cast< double >(full.slot_bytes + full.metadata_bytes) / static_cast< double >(n),
+					tenth.blocks,
+					static_cast< double >(tenth.slot_bytes + tenth.metadata_bytes) / static_cast< double >(std::max< size_t >(1, f.c.size())));
+	}
+
+	std::vector< size_t > parse_list(const char* text)
+	{
+		std::vector< size_t > values;
+		while (*text != '\0')
+		{
+			char* end = nullptr;
+			values.push_back(std::strtoull(text, &end, 10));
+			if (*end != ',')
+				break;
+			text = end + 1;
+		}
+		return values;
+	}
+}	 // namespace
+
+// Usage: bench_blocks [--sizes=10,1000,100000,10000000] [--repeats=3]
+// Compares fixed block capacities with geometric_blocks (first block of 8 slots, at most 65536) for uint64_t values.
+int main(int argc, char** argv)
+{
+	Config config;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (std::strncmp(argv[i], "--sizes=", 8) == 0)
+			config.sizes = parse_list(argv[i] + 8);
+		else if (std::strncmp(argv[i], "--repeats=", 10) == 0)
+			config.repeats = std::strtoull(argv[i] + 10, nullptr, 10);
+		else
+		{
+			std::fprintf(stderr, "usage: %s [--sizes=N,...] [--repeats=N]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	for (size_t n : config.sizes)
+	{
+		if (n == 0)
+			continue;
+		run< fixed >("fixed", config, n, 8);
+		run< fixed >("fixed", config, n, 64);
+		run< fixed >("fixed", config, n, 4096);
+		run< geometric >("geometric", config, n, 8);
+	}
+	return 0;
+}
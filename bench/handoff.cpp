@@ -0,0 +1,148 @@
+#include "../bucket_storage.hpp"
+#include "harness.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace
+{
+	struct Config
+	{
+		size_t count = 50000000;
+		std::vector< size_t > block_capacities = { 64, 256, 1024 };
+		size_t repeats = 3;
+	};
+
+	// Runs producer and consumer on two threads and returns the wall time of the slower one.
+	template< typename Produce, typename Consume >
+	std::uint64_t run_pair(Produce&& produce, Consume&& consume)
+	{
+		auto start = std::chrono::steady_clock::now();
+		std::thread producer(produce);
+		consume();
+		producer.join();
+		auto stop = std::chrono::steady_clock::now();
+		return static_cast< std::uint64_t >(std::chrono::duration_cast< std::chrono::nanoseconds >(stop - start).count());
+	}
+
+	std::uint64_t handoff(size_t n, size_t block_capacity)
+	{
+		BlockHandoff< std::uint64_t > h(block_capacity);
+		std::uint64_t sum = 0;
+		std::uint64_t ns = run_pair(
+			[&]
+			{
+				for (size_t i = 0; i < n; ++i)
+					h.push(i);
+				h.flush();
+			},
+			[&]
+			{
+				for (size_t seen = 0; seen < n;)
+				{
+					size_t got = h.consume([&](std::uint64_t& x) { sum += x; });
+					if (got == 0)
+						std::this_thread::yield();
+					seen += got;
+				}
+			});
+		bench::do_not_optimize(sum);
+		return ns;
+	}
+
+	// The setup this replaces: one BucketStorage, a mutex taken for every insert and every erase.
+	std::uint64_t locked(size_t n, size_t block_capacity)
+	{
+		BucketStorage< std::uint64_t > c(block_capacity);
+		std::mutex mutex;
+		std::uint64_t sum = 0;
+		std::uint64_t ns = run_pair(
+			[&]
+			{
+				for (size_t i = 0; i < n; ++i)
+				{
+					std::lock_guard< std::mutex > lock(mutex);
+					c.insert(i);
+				}
+			},
+			[&]
+			{
+				for (size_t seen = 0; seen < n;)
+				{
+					std::unique_lock< std::mutex > lock(mutex);
+					if (c.empty())
+					{
+						lock.unlock();
+						std::this_thread::yield();
+						continue;
+					}
+					sum += *c.begin();
+					c.erase(c.begin());
+					++seen;
+				}
+			});
+		bench::do_not_optimize(sum);
+		return ns;
+	}
+
+	std::vector< size_t > parse_list(const char* text)
+	{
+		std::vector< size_t > values;
+		while (*text != '\0')
+		{
+			char* end = nullptr;
+			values.push_back(std::strtoull(text, &end, 10));
+			if (*end != ',')
+				break;
+			text = end + 1;
+		}
+		return values;
+	}
+}	 // namespace
+
+// Usage: bench_handoff [--count=50000000] [--blocks=64,256,1024] [--repeats=3] > handoff.csv
+// One thread inserts --count values, another drains them oldest first; prints elements per second.
+int main(int argc, char** argv)
+{
+	Config config;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (std::strncmp(argv[i], "--count=", 8) == 0)
+			config.count = std::strtoull(argv[i] + 8, nullptr, 10);
+		else if (std::strncmp(argv[i], "--blocks=", 9) == 0)
+			config.block_capacities = parse_list(argv[i] + 9);
+		else if (std::strncmp(argv[i], "--repeats=", 10) == 0)
+			config.repeats = std::strtoull(argv[i] + 10, nullptr, 10);
+		else
+		{
+			std::fprintf(stderr, "usage: %s [--count=N] [--blocks=N,...] [--repeats=N]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	std::printf("mode,block_capacity,count,total_ns,elements_per_second\n");
+	auto emit = [&](const char* mode, size_t block_capacity, std::uint64_t ns)
+	{
+		double rate = ns == 0 ? 0.0 : static_cast< double >(config.count) * 1e9 / static_cast< double >(ns);
+		std::printf("%s,%zu,%zu,%llu,%.0f\n", mode, block_capacity, config.count, static_cast< unsigned long long >(ns), rate);
+		std::fflush(stdout);
+	};
+	for (size_t block_capacity : config.block_capacities)
+	{
+		std::uint64_t best = UINT64_MAX;
+		for (size_t r = 0; r < config.repeats; ++r)
+			best = std::min(best, handoff(config.count, block_capacity));
+		emit("BlockHandoff", block_capacity, best);
+
+		best = UINT64_MAX;
+		for (size_t r = 0; r < config.repeats; ++r)
+			best = std::min(best, locked(config.count, block_capacity));
+		emit("mutex+BucketStorage", block_capacity, best);
+	}
+	return 0;
+}
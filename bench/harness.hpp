@@ -0,0 +1,106 @@
+#ifndef BENCH_HARNESS_HPP
+#define BENCH_HARNESS_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace bench
+{
+	// Keeps the optimiser from dropping a computed value.
+	template< typename T >
+	inline void do_not_optimize(const T& value)
+	{
+		asm volatile("" : : "r,m"(value) : "memory");
+	}
+
+	struct Result
+	{
+		std::string container;
+		std::string operation;
+		size_t element_bytes;
+		size_t block_capacity;
+		size_t size;
+		size_t iterations;
+		std::uint64_t total_ns;
+	};
+
+	class Reporter
+	{
+	  public:
+		explicit Reporter(std::FILE* out) : m_out(out)
+		{
+			std::fprintf(m_out, "container,operation,element_bytes,block_capacity,size,iterations,total_ns,ns_per_element\n");
+		}
+
+		void report(const Result& r)
+		{
+			double per_element = r.iterations == 0 ? 0.0 : static_cast< double >(r.total_ns) / static_cast< double >(r.iterations);
+			std::fprintf(m_out,
+						 "%s,%s,%zu,%zu,%zu,%zu,%llu,%.3f\n",
+						 r.container.c_str(),
+						 r.operation.c_str(),
+						 r.element_bytes,
+						 r.block_capacity,
+						 r.size,
+						 r.iterations,
+						 static_cast< unsigned long long >(r.total_ns),
+						 per_element);
+			std::fflush(m_out);
+		}
+
+	  private:
+		std::FILE* m_out;
+	};
+
+	// Runs setup() untimed and body(state) timed `repeats` times; returns the fastest run in nanoseconds.
+	template< typename Setup, typename Body >
+	std::uint64_t measure(size_t repeats, Setup&& setup, Body&& body)
+	{
+		std::uint64_t best = UINT64_MAX;
+		for (size_t r = 0; r < repeats; ++r)
+		{
+			auto state = setup();
+			auto start = std::chrono::steady_clock::now();
+			body(state);
+			auto stop = std::chrono::steady_clock::now();
+			std::uint64_t ns = static_cast< std::uint64_t >(std::chrono::duration_cast< std::chrono::nanoseconds >(stop - start).count());
+			best = std::min(best, ns);
+			do_not_optimize(state);
+		}
+		return best;
+	}
+
+	// xorshift64*, so runs are reproducible without <random> distribution differences between libraries.
+	class Rng
+	{
+	  public:
+		explicit Rng(std::uint64_t seed) : m_state(seed ? seed : 1) {}
+
+		std::uint64_t next()
+		{
+			m_state ^= m_state >> 12;
+			m_state ^= m_state << 25;
+			m_state ^= m_state >> 27;
+			return m_state * 2685821657736338717ULL;
+		}
+
+		template< typename It >
+		void shuffle(It first, It last)
+		{
+			for (auto n = last - first; n > 1; --n)
+			{
+				std::swap(first[n - 1], first[static_cast< decltype(n) >(next() % static_cast< std::uint64_t >(n))]);
+			}
+		}
+
+	  private:
+		std::uint64_t m_state;
+	};
+}	 // namespace bench
+
+#endif /* BENCH_HARNESS_HPP */
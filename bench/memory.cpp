@@ -0,0 +1,195 @@
+#include "../bucket_storage.hpp"
+
+#include <malloc.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace
+{
+	std::size_t g_live_bytes = 0;
+	std::size_t g_live_blocks = 0;
+	std::size_t g_allocations = 0;
+
+	void* counted_alloc(std::size_t n, std::size_t alignment)
+	{
+		void* p = alignment <= alignof(std::max_align_t) ? std::malloc(n ? n : 1)
+														 : std::aligned_alloc(alignment, (n + alignment - 1) / alignment * alignment);
+		if (p == nullptr)
+			throw std::bad_alloc();
+		g_live_bytes += malloc_usable_size(p);
+		++g_live_blocks;
+		++g_allocations;
+		return p;
+	}
+
+	void counted_free(void* p) noexcept
+	{
+		if (p == nullptr)
+			return;
+		g_live_bytes -= malloc_usable_size(p);
+		--g_live_blocks;
+		std::free(p);
+	}
+}	 // namespace
+
+void* operator new(std::size_t n)
+{
+	return counted_alloc(n, alignof(std::max_align_t));
+}
+
+void* operator new(std::size_t n, std::align_val_t a)
+{
+	return counted_alloc(n, static_cast< std::size_t >(a));
+}
+
+void operator delete(void* p) noexcept
+{
+	counted_free(p);
+}
+
+void operator delete(void* p, std::align_val_t) noexcept
+{
+	counted_free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+	counted_free(p);
+}
+
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept
+{
+	counted_free(p);
+}
+
+template< typename Storage >
+void report(const char* name, std::size_t n)
+{
+	std::size_t bytes_before = g_live_bytes;
+	std::size_t allocations_before = g_live_blocks;
+	{
+		auto* storage = new Storage();
+		for (std::size_t i = 0; i < n; ++i)
+			storage->insert(static_cast< std::uint32_t >(i));
+
+		double bytes = static_cast< double >(g_live_bytes - bytes_before);
+		std::printf("%-40s n=%-9zu bytes/element=%6.2f overhead/element=%6.2f live allocations=%zu\n",
+					name,
+					n,
+					bytes / n,
+					(bytes - n * sizeof(std::uint32_t)) / n,
+					g_live_blocks - allocations_before);
+		delete storage;
+	}
+}
+
+// Many containers of a few values each; the vector holding them is counted too, since that is where inline
+// storage goes.
+template< typename Storage >
+void report_small(const char* name, std::size_t containers, std::size_t values, std::size_t block_capacity)
+{
+	std::size_t bytes_before = g_live_bytes;
+	std::size_t allocations_before = g_live_blocks;
+	{
+		std::vector< Storage > storages;
+		storages.reserve(containers);
+		for (std::size_t i = 0; i < containers; ++i)
+		{
+			storages.emplace_back(block_capacity);
+			for (std::size_t j = 0; j < values; ++j)
+				storages.back().insert(static_cast< std::uint32_t >(j));
+		}
+
+		std::printf("%-40s block=%-4zu values=%zu bytes/container=%8.1f live allocations/container=%5.2f\n",
+					name,
+					block_capacity,
+					values,
+					static_cast< double >(g_live_bytes - bytes_before) / containers,
+					static_cast< double >(g_live_blocks - allocations_before) / containers);
+	}
+}
+
+// Heap allocations per operation: a regression in the hot paths shows up here before it shows up in timings.
+template< typename Storage >
+void report_operations(const char* name, std::size_t n, std::size_t block_capacity)
+{
+	auto per_operation = [](std::size_t allocations_before, std::size_t operations)
+	{ return static_cast< double >(g_allocations - allocations_before) / static_cast< double >(operations); };
+
+	Storage storage(block_capacity);
+	std::vector< typename Storage::iterator > its;
+	its.reserve(n);
+	std::size_t before = g_allocations;
+	for (std::size_t i = 0; i < n; ++i)
+		its.push_back(storage.insert(static_cast< std::uint32_t >(i)));
+	double insert = per_operation(before, n);
+
+	// xorshift, so every run erases in the same order
+	std::uint64_t state = 88172645463325252ULL;
+	auto next = [&]
+	{
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		return state;
+	};
+	before = g_allocations;
+	for (std::size_t i = 0; i < n; ++i)
+	{
+		std::size_t victim = next() % n;
+		storage.erase(its[victim]);
+		its[victim] = storage.insert(static_cast< std::uint32_t >(i));
+	}
+	double churn = per_operation(before, n);
+
+	before = g_allocations;
+	{
+		Storage copy(storage);
+	}
+	double copy = per_operation(before, storage.memory_stats().blocks);
+
+	for (std::size_t i = n; i > 1; --i)
+		std::swap(its[i - 1], its[next() % i]);
+	before = g_allocations;
+	for (std::size_t i = 0; i < n; ++i)
+		storage.erase(its[i]);
+	double erase = per_operation(before, n);
+
+	std::printf("%-40s block=%-4zu allocations: insert=%.4f erase+insert=%.4f erase=%.4f copy=%.3f per block\n",
+				name,
+				block_capacity,
+				insert,
+				churn,
+				erase,
+				copy);
+}
+
+// Usage: bench_memory [elements=1000000] [small containers=1000000]
+int main(int argc, char** argv)
+{
+	std::size_t n = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+	report< BucketStorage< std::uint32_t > >("BucketStorage<uint32_t>", n);
+#ifndef BENCH_BASELINE
+	report< BucketStorage< std::uint32_t, compact_links > >("BucketStorage<uint32_t, compact_links>", n);
+
+	report_operations< BucketStorage< std::uint32_t > >("BucketStorage<uint32_t>", n, 64);
+	report_operations< BucketStorage< std::uint32_t, compact_links > >("BucketStorage<uint32_t, compact_links>", n, 64);
+
+	std::size_t containers = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 1000000;
+	for (std::size_t values : { 0, 1, 4, 8 })
+	{
+		report_small< BucketStorage< std::uint32_t > >("BucketStorage<uint32_t>", containers, values, 64);
+		report_small< BucketStorage< std::uint32_t > >("BucketStorage<uint32_t>", containers, values, 8);
+		report_small< BucketStorage< std::uint32_t, inline_block< 8 > > >("BucketStorage<uint32_t, inline_block<8>>", containers, values, 8);
+		report_small< BucketStorage< std::uint32_t, compact_links, inline_block< 8 > > >(
+			"BucketStorage<uint32_t, compact_links, inline_block<8>>", containers, values, 8);
+	}
+#endif
+	return 0;
+}
@@ -0,0 +1,151 @@
+#include "../bucket_storage.hpp"
+#include "harness.hpp"
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+	struct Config
+	{
+		size_t size = 4000000;
+		size_t block_capacity = 64;
+		std::vector< size_t > threads;
+		size_t repeats = 3;
+	};
+
+	template< typename T >
+	T make_value(size_t i)
+	{
+		if constexpr (std::is_same_v< T, std::string >)
+			return "value-" + std::to_string(i) + "-on-the-heap";
+		else
+			return static_cast< T >(i);
+	}
+
+	// Half of the values erased at random, so shrink_to_fit has every block to repack.
+	template< typename Storage >
+	Storage build(size_t n, size_t block_capacity, bool sparse)
+	{
+		Storage c(block_capacity);
+		std::vector< typename Storage::iterator > its;
+		its.reserve(n);
+		for (size_t i = 0; i < n; ++i)
+			its.push_back(c.insert(make_value< typename Storage::value_type >(i)));
+		if (sparse)
+		{
+			bench::Rng rng(n);
+			rng.shuffle(its.begin(), its.end());
+			for (size_t i = 0; i < n / 2; ++i)
+				c.erase(its[i]);
+		}
+		return c;
+	}
+
+	template< typename Storage >
+	void run(bench::Reporter& reporter, const char* name, const Config& config)
+	{
+		const size_t n = config.size;
+		auto emit = [&](const std::string& operation, size_t iterations, std::uint64_t ns)
+		{ reporter.report({ name, operation, sizeof(typename Storage::value_type), config.block_capacity, n, iterations, ns }); };
+
+		Storage full = build< Storage >(n, config.block_capacity, false);
+		auto copy_of_full = [&] { return Storage(full); };
+
+		emit("copy",
+			 n,
+			 bench::measure(
+				 config.repeats,
+				 [] { return 0; },
+				 [&](int)
+				 {
+					 Storage copy(full);
+					 bench::do_not_optimize(copy);
+				 }));
+		emit("clear", n, bench::measure(config.repeats, copy_of_full, [](Storage& c) { c.clear(); }));
+		emit("shrink_to_fit",
+			 n / 2,
+			 bench::measure(
+				 config.repeats,
+				 [&] { return build< Storage >(n, config.block_capacity, true); },
+				 [](Storage& c) { c.shrink_to_fit(); }));
+
+		for (size_t threads : config.threads)
+		{
+			parallel_t policy(static_cast< unsigned >(threads));
+			std::string suffix = "_parallel_t" + std::to_string(threads);
+			emit("copy" + suffix,
+				 n,
+				 bench::measure(
+					 config.repeats,
+					 [] { return 0; },
+					 [&](int)
+					 {
+						 Storage copy(full, policy);
+						 bench::do_not_optimize(copy);
+					 }));
+			emit("clear" + suffix, n, bench::measure(config.repeats, copy_of_full, [&](Storage& c) { c.clear(policy); }));
+			emit("shrink_to_fit" + suffix,
+				 n / 2,
+				 bench::measure(
+					 config.repeats,
+					 [&] { return build< Storage >(n, config.block_capacity, true); },
+					 [&](Storage& c) { c.shrink_to_fit(policy); }));
+		}
+	}
+
+	std::vector< size_t > parse_list(const char* text)
+	{
+		std::vector< size_t > values;
+		while (*text != '\0')
+		{
+			char* end = nullptr;
+			values.push_back(std::strtoull(text, &end, 10));
+			if (*end != ',')
+				break;
+			text = end + 1;
+		}
+		return values;
+	}
+}	 // namespace
+
+// Usage: bench_parallel [--size=4000000] [--block=64] [--threads=1,2,4,...] [--repeats=3] > results.csv
+// Wall-clock time of the plain copy constructor, clear() and shrink_to_fit() and of their parallel_t overloads for each
+// thread count (by default powers of two up to std::thread::hardware_concurrency()). std::string values are not
+// trivially relocatable, so their shrink_to_fit(parallel_t) runs single-threaded.
+int main(int argc, char** argv)
+{
+	Config config;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (std::strncmp(argv[i], "--size=", 7) == 0)
+			config.size = std::strtoull(argv[i] + 7, nullptr, 10);
+		else if (std::strncmp(argv[i], "--block=", 8) == 0)
+			config.block_capacity = std::strtoull(argv[i] + 8, nullptr, 10);
+		else if (std::strncmp(argv[i], "--threads=", 10) == 0)
+			config.threads = parse_list(argv[i] + 10);
+		else if (std::strncmp(argv[i], "--repeats=", 10) == 0)
+			config.repeats = std::strtoull(argv[i] + 10, nullptr, 10);
+		else
+		{
+			std::fprintf(stderr, "usage: %s [--size=N] [--block=N] [--threads=N,...] [--repeats=N]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (config.threads.empty())
+	{
+		size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+		for (size_t threads = 1; threads < hardware; threads *= 2)
+			config.threads.push_back(threads);
+		config.threads.push_back(hardware);
+	}
+
+	bench::Reporter reporter(stdout);
+	run< BucketStorage< std::uint64_t > >(reporter, "BucketStorage<uint64_t>", config);
+	run< BucketStorage< std::string > >(reporter, "BucketStorage<std::string>", config);
+	return 0;
+}
@@ -0,0 +1,209 @@
+#include "../bucket_storage.hpp"
+#include "harness.hpp"
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace
+{
+	using container = BucketStorage< std::uint64_t >;
+
+	struct Config
+	{
+		size_t bytes = size_t(1) << 30;
+		size_t evict_bytes = size_t(640) << 20;
+		size_t block_capacity = 64;
+		std::vector< size_t > distances = { 2, 4, 8, 16, 32 };
+		size_t repeats = 3;
+	};
+
+	enum class Layout
+	{
+		sequential,
+		scattered,
+		churn
+	};
+
+	// sequential: values inserted once, so the chain walks each block front to back.
+	// scattered: a random half is erased and re-inserted; re-inserts fill one partially free block after another.
+	// churn: n/2 rounds of "erase a random element, insert a new one"; every insert lands in the block that was
+	// just erased from, so consecutive elements of the chain sit in unrelated blocks.
+	container build(size_t n, size_t block_capacity, Layout layout)
+	{
+		container c(block_capacity);
+		std::vector< container::iterator > its;
+		if (layout != Layout::sequential)
+			its.reserve(n);
+		for (size_t i = 0; i < n; ++i)
+		{
+			container::iterator it = c.insert(i);
+			if (layout != Layout::sequential)
+				its.push_back(it);
+		}
+		bench::Rng rng(n);
+		if (layout == Layout::scattered)
+		{
+			rng.shuffle(its.begin(), its.end());
+			for (size_t i = 0; i < n / 2; ++i)
+				c.erase(its[i]);
+			for (size_t i = 0; i < n / 2; ++i)
+				c.insert(n + i);
+		}
+		else if (layout == Layout::churn)
+		{
+			for (size_t i = 0; i < n / 2; ++i)
+			{
+				size_t victim = rng.next() % n;
+				c.erase(its[victim]);
+				its[victim] = c.insert(n + i);
+			}
+		}
+		return c;
+	}
+
+	std::vector< size_t > parse_list(const char* text)
+	{
+		std::vector< size_t > values;
+		while (*text != '\0')
+		{
+			char* end = nullptr;
+			values.push_back(std::strtoull(text, &end, 10));
+			if (*end != ',')
+				break;
+			text = end + 1;
+		}
+		return values;
+	}
+}	 // namespace
+
+// Usage: bench_prefetch [--bytes=1073741824] [--evict=671088640] [--block=64] [--distances=2,4,8,16,32] [--repeats=3]
+// Every run starts by streaming through --evict bytes (make it larger than the last-level cache), so the container is
+// read cold from memory.
+int main(int argc, char** argv)
+{
+	Config config;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (std::strncmp(argv[i], "--bytes=", 8) == 0)
+			config.bytes = std::strtoull(argv[i] + 8, nullptr, 10);
+		else if (std::strncmp(argv[i], "--evict=", 8) == 0)
+			config.evict_bytes = std::strtoull(argv[i] + 8, nullptr, 10);
+		else if (std::strncmp(argv[i], "--block=", 8) == 0)
+			config.block_capacity = std::strtoull(argv[i] + 8, nullptr, 10);
+		else if (std::strncmp(argv[i], "--distances=", 12) == 0)
+			config.distances = parse_list(argv[i] + 12);
+		else if (std::strncmp(argv[i], "--repeats=", 10) == 0)
+			config.repeats = std::strtoull(argv[i] + 10, nullptr, 10);
+		else
+		{
+			std::fprintf(stderr,
+						 "usage: %s [--bytes=N] [--evict=N] [--block=N] [--distances=N,...] [--repeats=N]\n",
+						 argv[0]);
+			return 1;
+		}
+	}
+
+	std::vector< std::uint64_t > evict(config.evict_bytes / sizeof(std::uint64_t));
+	auto cold = [&]
+	{
+		for (std::uint64_t& x : evict)
+			++x;
+		bench::do_not_optimize(evict.data());
+		return 0;
+	};
+
+	bench::Reporter reporter(stdout);
+	for (Layout layout : { Layout::sequential, Layout::scattered, Layout::churn })
+	{
+		size_t slot_bytes = build(1, config.block_capacity, Layout::sequential).memory_stats().element_bytes / config.block_capacity +
+							sizeof(std::uint64_t);
+		size_t n = config.bytes / slot_bytes;
+		container c = build(n, config.block_capacity, layout);
+
+		std::string name = layout == Layout::sequential ? "sequential" : layout == Layout::scattered ? "scattered" : "churn";
+		auto emit = [&](const std::string& operation, std::uint64_t ns)
+		{
+			reporter.report({ "BucketStorage", name + "_" + operation, sizeof(std::uint64_t), config.block_capacity, n, n, ns });
+		};
+
+		emit("iterator",
+			 bench::measure(config.repeats,
+							cold,
+							[&](int)
+							{
+								std::uint64_t sum = 0;
+								for (std::uint64_t x : std::as_const(c))
+									sum += x;
+								bench::do_not_optimize(sum);
+							}));
+
+		emit("unordered_iterator",
+			 bench::measure(config.repeats,
+							cold,
+							[&](int)
+							{
+								std::uint64_t sum = 0;
+								for (auto it = std::as_const(c).unordered_begin(); it != std::as_const(c).unordered_end(); ++it)
+									sum += *it;
+								bench::do_not_optimize(sum);
+							}));
+		emit("for_each_unordered",
+			 bench::measure(config.repeats,
+							cold,
+							[&](int)
+							{
+								std::uint64_t sum = 0;
+								std::as_const(c).for_each_unordered([&](std::uint64_t x) { sum += x; });
+								bench::do_not_optimize(sum);
+							}));
+
+		for (size_t distance : config.distances)
+		{
+			std::string suffix = "_d" + std::to_string(distance);
+			emit("prefetch_iterator" + suffix,
+				 bench::measure(config.repeats,
+								cold,
+								[&](int)
+								{
+									std::uint64_t sum = 0;
+									for (std::uint64_t x : std::as_const(c).prefetched(distance))
+										sum += x;
+									bench::do_not_optimize(sum);
+								}));
+			emit("for_each" + suffix,
+				 bench::measure(config.repeats,
+								cold,
+								[&](int)
+								{
+									std::uint64_t sum = 0;
+									std::as_const(c).for_each([&](std::uint64_t x) { sum += x; }, distance);
+									bench::do_not_optimize(sum);
+								}));
+		}
+	}
+
+	// Lower bound for any full scan: the same number of values in one contiguous array.
+	std::vector< std::uint64_t > v(config.bytes / (2 * sizeof(std::uint64_t)));
+	for (size_t i = 0; i < v.size(); ++i)
+		v[i] = i;
+	reporter.report({ "std::vector",
+					  "scan",
+					  sizeof(std::uint64_t),
+					  0,
+					  v.size(),
+					  v.size(),
+					  bench::measure(config.repeats,
+									 cold,
+									 [&](int)
+									 {
+										 std::uint64_t sum = 0;
+										 for (std::uint64_t x : v)
+											 sum += x;
+										 bench::do_not_optimize(sum);
+									 }) });
+	return 0;
+}
@@ -1,993 +1,6259 @@
 #ifndef BUCKET_STORAGE_HPP
 #define BUCKET_STORAGE_HPP
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <istream>
 #include <iterator>
+#include <limits>
+#include <new>
+#include <ostream>
+#include <stdexcept>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Stores links and insertion stamps as 32-bit values: 12 bytes of metadata per element.
+struct compact_links
+{
+};
+
+// Counts hot-path events, see BucketStorage::hot_path_stats(). Without it the counters compile to nothing.
+struct with_counters
+{
+};
+
+// Makes copies share blocks, see BucketStorage(const BucketStorage&). A block is cloned the first time one of its
+// owners writes to it: insert, erase or a non-const access to one of its values.
+struct copy_on_write
+{
+};
+
+// Keeps blocks in a memory-mapped file that can be reopened later, see BucketStorage(const char*, ...).
+struct file_backed
+{
+};
+
+// Lets blocks grow: every new block gets as many slots as the live blocks hold together, at least the capacity passed
+// to the constructor and at most MaxCapacity. Block count then grows with the logarithm of the size until blocks
+// reach MaxCapacity, and new blocks come out small again once the container has shrunk.
+template< size_t MaxCapacity >
+struct geometric_blocks
+{
+	static constexpr size_t max_capacity = MaxCapacity;
+};
+
+// Keeps the bookkeeping and one block of up to N slots inside the container object, so a container that never
+// outgrows that block makes no heap allocation. The default block capacity becomes N. Moving or swapping such a
+// container copies the inline block, so iterators stay with the object rather than following the values.
+template< size_t N >
+struct inline_block
+{
+	static constexpr size_t capacity = N;
+};
+
+// Keeps a hash index from KeyFn{}(value) to the value's slot, see BucketStorage::find(). Hash defaults to
+// std::hash of the key type; a Hash with is_transparent lets find() take other key types without converting them.
+template< typename KeyFn, typename Hash = void, typename KeyEqual = std::equal_to<> >
+struct indexed_by
+{
+	using key_fn = KeyFn;
+	using hasher = Hash;
+	using key_equal = KeyEqual;
+};
+
+// Keeps a B+-tree of the values ordered by KeyFn{}(value), see BucketStorage::range() and nth_by_key(). Keys are
+// copied into the tree, so they have to be nothrow copyable: numbers, timestamps, enums, small PODs.
+template< typename KeyFn, typename Compare = std::less<> >
+struct ordered_by
+{
+	using key_fn = KeyFn;
+	using key_compare = Compare;
+};
+
+// Selects the bounded constructor, see BucketStorage(size_type, evict_oldest_t, size_type).
+struct evict_oldest_t
+{
+	explicit evict_oldest_t() = default;
+};
+
+inline constexpr evict_oldest_t evict_oldest{};
+
+// Selects the multi-threaded overloads of the copy constructor, clear() and shrink_to_fit(). `threads` caps the number
+// of threads; 0 means one per hardware thread.
+struct parallel_t
+{
+	constexpr explicit parallel_t(unsigned threads = 0) noexcept : threads(threads) {}
+
+	unsigned threads;
+};
+
+inline constexpr parallel_t parallel{};
+
+// Declares that a T may be moved to another address by copying its bytes, after which the source counts as dead:
+// neither the move constructor nor the destructor runs. Holds for trivially copyable types; specialize it for
+// others whose representation does not point into itself (e.g. types that only hold std::unique_ptr members).
+template< typename T >
+struct is_trivially_relocatable : std::is_trivially_copyable< T >
+{
+};
+
+template< typename T >
+inline constexpr bool is_trivially_relocatable_v = is_trivially_relocatable< T >::value;
 
 namespace details
 {
-	template< typename T >
-	class Stack
+	// std::vector for trivially copyable U that keeps the first N values inside the object.
+	template< typename U, size_t N >
+	class SmallVector
 	{
+		static_assert(std::is_trivially_copyable_v< U >, "SmallVector holds trivially copyable values only");
+
 	  public:
-		Stack() noexcept;
-		~Stack();
-		template< typename U >
-		void push(U&& x);
-		T pop();
-		T peek();
-		bool empty() const noexcept;
-		void clear();
+		SmallVector() noexcept : m_data(m_inline), m_size(0), m_capacity(N) {}
+		explicit SmallVector(size_t n) : SmallVector() { resize(n); }
+		SmallVector(const SmallVector& other) : SmallVector() { *this = other; }
+		SmallVector(SmallVector&& other) noexcept : SmallVector() { steal(other); }
+		~SmallVector() { release(); }
+
+		SmallVector& operator=(const SmallVector& other)
+		{
+			if (this != &other)
+			{
+				reserve(other.m_size);
+				std::copy(other.begin(), other.end(), m_data);
+				m_size = other.m_size;
+			}
+			return *this;
+		}
+
+		SmallVector& operator=(SmallVector&& other) noexcept
+		{
+			if (this != &other)
+			{
+				release();
+				steal(other);
+			}
+			return *this;
+		}
+
+		U* begin() noexcept { return m_data; }
+		U* end() noexcept { return m_data + m_size; }
+		const U* begin() const noexcept { return m_data; }
+		const U* end() const noexcept { return m_data + m_size; }
+		U& operator[](size_t i) noexcept { return m_data[i]; }
+		const U& operator[](size_t i) const noexcept { return m_data[i]; }
+		U& back() noexcept { return m_data[m_size - 1]; }
+		size_t size() const noexcept { return m_size; }
+		size_t capacity() const noexcept { return m_capacity; }
+		bool empty() const noexcept { return m_size == 0; }
+		void clear() noexcept { m_size = 0; }
+		void pop_back() noexcept { --m_size; }
+
+		void push_back(const U& x)
+		{
+			U value = x;
+			if (m_size == m_capacity)
+				grow(2 * m_capacity);
+			m_data[m_size++] = value;
+		}
+
+		void reserve(size_t n)
+		{
+			if (n > m_capacity)
+				grow(n);
+		}
+
+		void resize(size_t n)
+		{
+			reserve(n);
+			std::fill(m_data + std::min(m_size, n), m_data + n, U());
+			m_size = n;
+		}
+
+		void assign(size_t n, const U& x)
+		{
+			reserve(n);
+			std::fill_n(m_data, n, x);
+			m_size = n;
+		}
+
+		void shrink_to_fit()
+		{
+			if (m_data == m_inline || m_size == m_capacity)
+				return;
+			if (m_size > N)
+			{
+				grow(m_size);
+				return;
+			}
+			std::copy(m_data, m_data + m_size, m_inline);
+			delete[] m_data;
+			m_data = m_inline;
+			m_capacity = N;
+		}
 
 	  private:
-		struct Node
+		void grow(size_t n)
 		{
-			Node* prev;
-			T data;
-		};
-		Node* m_top;
+			U* data = new U[n];
+			std::copy(m_data, m_data + m_size, data);
+			release();
+			m_data = data;
+			m_capacity = n;
+		}
+
+		void release() noexcept
+		{
+			if (m_data != m_inline)
+				delete[] m_data;
+		}
+
+		void steal(SmallVector& other) noexcept
+		{
+			if (other.m_data == other.m_inline)
+			{
+				std::copy(other.m_inline, other.m_inline + other.m_size, m_inline);
+				m_data = m_inline;
+				m_capacity = N;
+			}
+			else
+			{
+				m_data = other.m_data;
+				m_capacity = other.m_capacity;
+			}
+			m_size = other.m_size;
+			other.m_data = other.m_inline;
+			other.m_size = 0;
+			other.m_capacity = N;
+		}
+
+		U* m_data;
+		size_t m_size;
+		size_t m_capacity;
+		U m_inline[N];
 	};
 
-	template< typename T >
-	Stack< T >::Stack() noexcept : m_top(nullptr)
+	template< typename U, size_t N >
+	using small_vector_t = std::conditional_t< N == 0, std::vector< U >, SmallVector< U, N > >;
+
+	template< typename Option, typename... Options >
+	inline constexpr bool has_option = (std::is_same_v< Option, Options > || ...);
+
+	template< typename... Options >
+	struct index_option
 	{
-	}
+		using type = void;
+	};
+
+	template< typename First, typename... Rest >
+	struct index_option< First, Rest... > : index_option< Rest... >
+	{
+	};
+
+	template< typename KeyFn, typename Hash, typename KeyEqual, typename... Rest >
+	struct index_option< indexed_by< KeyFn, Hash, KeyEqual >, Rest... >
+	{
+		using type = indexed_by< KeyFn, Hash, KeyEqual >;
+	};
+
+	template< typename... Options >
+	struct order_option
+	{
+		using type = void;
+	};
+
+	template< typename First, typename... Rest >
+	struct order_option< First, Rest... > : order_option< Rest... >
+	{
+	};
+
+	template< typename KeyFn, typename Compare, typename... Rest >
+	struct order_option< ordered_by< KeyFn, Compare >, Rest... >
+	{
+		using type = ordered_by< KeyFn, Compare >;
+	};
+
+	template< typename... Options >
+	struct inline_option
+	{
+		static constexpr size_t value = 0;
+	};
+
+	template< typename First, typename... Rest >
+	struct inline_option< First, Rest... > : inline_option< Rest... >
+	{
+	};
+
+	template< size_t N, typename... Rest >
+	struct inline_option< inline_block< N >, Rest... >
+	{
+		static constexpr size_t value = N;
+	};
+
+	struct NoInline
+	{
+	};
+
+	template< typename... Options >
+	struct geometric_option
+	{
+		static constexpr size_t value = 0;
+	};
+
+	template< typename First, typename... Rest >
+	struct geometric_option< First, Rest... > : geometric_option< Rest... >
+	{
+	};
+
+	template< size_t MaxCapacity, typename... Rest >
+	struct geometric_option< geometric_blocks< MaxCapacity >, Rest... >
+	{
+		static constexpr size_t value = MaxCapacity;
+	};
+
+	template< typename Policy, typename T >
+	struct IndexTraits
+	{
+		using key_fn = typename Policy::key_fn;
+		using key_type = std::decay_t< std::invoke_result_t< const key_fn&, const T& > >;
+		using hasher = std::conditional_t< std::is_void_v< typename Policy::hasher >, std::hash< key_type >, typename Policy::hasher >;
+		using key_equal = typename Policy::key_equal;
+		static constexpr bool is_transparent = requires { typename hasher::is_transparent; };
+	};
+
+	// Owner count of a block shared between copies; without copy_on_write it is empty and every block has one owner.
+	template< bool Enabled >
+	struct BlockShares
+	{
+		bool shared() const noexcept { return false; }
+		void retain() noexcept {}
+		bool release() noexcept { return true; }
+		void reset() noexcept {}
+	};
+
+	template<>
+	struct BlockShares< true >
+	{
+		bool shared() const noexcept { return m_count.load(std::memory_order_acquire) > 1; }
+		void retain() noexcept { m_count.fetch_add(1, std::memory_order_relaxed); }
+		// True for the last owner, which then frees the block.
+		bool release() noexcept { return m_count.fetch_sub(1, std::memory_order_acq_rel) == 1; }
+		void reset() noexcept { m_count.store(1, std::memory_order_relaxed); }
+
+		std::atomic< std::uint32_t > m_count{ 1 };
+	};
+
+	struct HotPathStats
+	{
+		size_t block_allocations = 0;
+		size_t block_frees = 0;
+		size_t free_slot_reuses = 0;
+		size_t head_bumps = 0;
+		size_t free_block_hits = 0;
+		size_t constructions = 0;
+		size_t destructions = 0;
 
-	template< typename T >
-	Stack< T >::~Stack()
+		bool operator==(const HotPathStats& rhs) const
+		{
+			return block_allocations == rhs.block_allocations && block_frees == rhs.block_frees &&
+				   free_slot_reuses == rhs.free_slot_reuses && head_bumps == rhs.head_bumps &&
+				   free_block_hits == rhs.free_block_hits && constructions == rhs.constructions &&
+				   destructions == rhs.destructions;
+		}
+	};
+
+	template< bool Enabled >
+	struct HotPathCounters
 	{
-		while (m_top != nullptr)
+		void block_allocation() noexcept {}
+		void block_free() noexcept {}
+		void free_slot_reuse() noexcept {}
+		void head_bump() noexcept {}
+		void free_block_hit() noexcept {}
+		void construction() noexcept {}
+		void destruction() noexcept {}
+		HotPathStats get() const noexcept { return HotPathStats(); }
+		void reset() noexcept {}
+		void merge(const HotPathCounters&) noexcept {}
+	};
+
+	template<>
+	struct HotPathCounters< true >
+	{
+		void block_allocation() noexcept { ++m_stats.block_allocations; }
+		void block_free() noexcept { ++m_stats.block_frees; }
+		void free_slot_reuse() noexcept { ++m_stats.free_slot_reuses; }
+		void head_bump() noexcept { ++m_stats.head_bumps; }
+		void free_block_hit() noexcept { ++m_stats.free_block_hits; }
+		void construction() noexcept { ++m_stats.constructions; }
+		void destruction() noexcept { ++m_stats.destructions; }
+		HotPathStats get() const noexcept { return m_stats; }
+		void reset() noexcept { m_stats = HotPathStats(); }
+		void merge(const HotPathCounters& other) noexcept
 		{
-			pop();
+			m_stats.block_allocations += other.m_stats.block_allocations;
+			m_stats.block_frees += other.m_stats.block_frees;
+			m_stats.free_slot_reuses += other.m_stats.free_slot_reuses;
+			m_stats.head_bumps += other.m_stats.head_bumps;
+			m_stats.free_block_hits += other.m_stats.free_block_hits;
+			m_stats.constructions += other.m_stats.constructions;
+			m_stats.destructions += other.m_stats.destructions;
 		}
-		m_top = nullptr;
+
+	  private:
+		HotPathStats m_stats;
+	};
+
+	constexpr size_t align_up(size_t value, size_t alignment) noexcept
+	{
+		return (value + alignment - 1) / alignment * alignment;
 	}
 
-	template< typename T >
-	template< typename U >
-	void Stack< T >::push(U&& x)
+	struct SnapshotHeader
+	{
+		char magic[8];
+		std::uint32_t version;
+		std::uint32_t value_size;
+		std::uint32_t value_alignment;
+		std::uint32_t link_size;
+		std::uint64_t block_capacity;
+		std::uint64_t block_table_size;
+		std::uint64_t blocks;
+		std::uint64_t size;
+		std::uint64_t start;
+		std::uint64_t end;
+		std::uint64_t next_time;
+		std::uint64_t checksum;
+	};
+
+	struct SnapshotBlock
+	{
+		std::uint64_t id;
+		std::uint64_t head;
+		std::uint64_t size;
+		std::uint64_t free_head;
+	};
+
+	// GCC treats __builtin_prefetch as side-effect free and deletes a look-ahead walk whose only use is prefetching,
+	// so on x86 the instruction is emitted through an asm statement the optimiser has to keep.
+	inline void prefetch(const void* address) noexcept
+	{
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+		asm volatile("prefetcht0 %0" : : "m"(*static_cast< const char* >(address)));
+#elif defined(__GNUC__) || defined(__clang__)
+		__builtin_prefetch(address);
+#else
+		(void)address;
+#endif
+	}
+
+	inline constexpr char snapshot_magic[8] = { 'B', 'U', 'C', 'K', 'E', 'T', 'S', '\0' };
+	inline constexpr std::uint32_t snapshot_version = 3;
+
+	// xxHash64-style striped hash over a byte stream; the result does not depend on how the stream is chunked.
+	class Checksum
+	{
+	  public:
+		void update(const void* data, size_t n) noexcept
+		{
+			const unsigned char* bytes = static_cast< const unsigned char* >(data);
+			m_length += n;
+			if (m_pending_size != 0)
+			{
+				size_t take = stripe - m_pending_size < n ? stripe - m_pending_size : n;
+				std::memcpy(m_pending + m_pending_size, bytes, take);
+				m_pending_size += take;
+				bytes += take;
+				n -= take;
+				if (m_pending_size < stripe)
+					return;
+				consume(m_pending);
+				m_pending_size = 0;
+			}
+			for (; n >= stripe; n -= stripe, bytes += stripe)
+			{
+				consume(bytes);
+			}
+			std::memcpy(m_pending, bytes, n);
+			m_pending_size = n;
+		}
+
+		std::uint64_t digest() const noexcept
+		{
+			std::uint64_t h = rotl(m_lanes[0], 1) + rotl(m_lanes[1], 7) + rotl(m_lanes[2], 12) + rotl(m_lanes[3], 18);
+			for (size_t i = 0; i < m_pending_size; ++i)
+			{
+				h = rotl(h ^ (m_pending[i] * prime5), 11) * prime1;
+			}
+			h ^= m_length;
+			h ^= h >> 33;
+			h *= prime2;
+			h ^= h >> 29;
+			h *= prime3;
+			h ^= h >> 32;
+			return h;
+		}
+
+	  private:
+		static constexpr size_t stripe = 4 * sizeof(std::uint64_t);
+		static constexpr std::uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+		static constexpr std::uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+		static constexpr std::uint64_t prime3 = 0x165667B19E3779F9ULL;
+		static constexpr std::uint64_t prime5 = 0x27D4EB2F165667C5ULL;
+
+		static std::uint64_t rotl(std::uint64_t x, int r) noexcept { return (x << r) | (x >> (64 - r)); }
+
+		void consume(const unsigned char* bytes) noexcept
+		{
+			for (size_t lane = 0; lane < 4; ++lane)
+			{
+				std::uint64_t word;
+				std::memcpy(&word, bytes + lane * sizeof(word), sizeof(word));
+				m_lanes[lane] = rotl(m_lanes[lane] + word * prime2, 31) * prime1;
+			}
+		}
+
+		std::uint64_t m_lanes[4] = { prime1 + prime2, prime2, 0, 0 - prime1 };
+		unsigned char m_pending[stripe] = {};
+		size_t m_pending_size = 0;
+		std::uint64_t m_length = 0;
+	};
+
+	class ChecksumSink
+	{
+	  public:
+		void write(const void* data, size_t n) noexcept { m_checksum.update(data, n); }
+		std::uint64_t digest() const noexcept { return m_checksum.digest(); }
+
+	  private:
+		Checksum m_checksum;
+	};
+
+	class StreamSink
+	{
+	  public:
+		explicit StreamSink(std::ostream& out) : m_out(out) {}
+		void write(const void* data, size_t n)
+		{
+			if (!m_out.write(static_cast< const char* >(data), static_cast< std::streamsize >(n)))
+				throw std::runtime_error("BucketStorage: snapshot write failed");
+		}
+
+	  private:
+		std::ostream& m_out;
+	};
+
+	class StreamSource
+	{
+	  public:
+		explicit StreamSource(std::istream& in) : m_in(in) {}
+		void read(void* data, size_t n)
+		{
+			if (!m_in.read(static_cast< char* >(data), static_cast< std::streamsize >(n)))
+				throw std::runtime_error("BucketStorage: snapshot is truncated");
+		}
+
+	  private:
+		std::istream& m_in;
+	};
+
+	// Small records are staged in a buffer so a snapshot costs a few large syscalls, not one per block.
+	class FdSink
+	{
+	  public:
+		explicit FdSink(int fd) : m_fd(fd), m_buffer(buffer_size), m_used(0) {}
+		void write(const void* data, size_t n)
+		{
+			if (m_used + n > m_buffer.size())
+				flush();
+			if (n >= m_buffer.size())
+			{
+				write_all(data, n);
+				return;
+			}
+			std::memcpy(m_buffer.data() + m_used, data, n);
+			m_used += n;
+		}
+		void flush()
+		{
+			write_all(m_buffer.data(), m_used);
+			m_used = 0;
+		}
+
+	  private:
+		static constexpr size_t buffer_size = size_t(1) << 20;
+
+		void write_all(const void* data, size_t n)
+		{
+			const char* bytes = static_cast< const char* >(data);
+			while (n > 0)
+			{
+				ssize_t written = ::write(m_fd, bytes, n);
+				if (written < 0 && errno == EINTR)
+					continue;
+				if (written <= 0)
+					throw std::runtime_error("BucketStorage: snapshot write failed");
+				bytes += written;
+				n -= static_cast< size_t >(written);
+			}
+		}
+
+		int m_fd;
+		std::vector< char > m_buffer;
+		size_t m_used;
+	};
+
+	// Reads ahead only on a seekable fd, and finish() seeks back over what was not consumed, so the fd is left right
+	// after the snapshot either way. A pipe or socket is read unbuffered, exactly as many bytes as the snapshot holds.
+	class FdSource
+	{
+	  public:
+		explicit FdSource(int fd) :
+			m_fd(fd), m_buffer(::lseek(fd, 0, SEEK_CUR) < 0 ? 0 : buffer_size), m_begin(0), m_end(0)
+		{
+		}
+		void read(void* data, size_t n)
+		{
+			char* out = static_cast< char* >(data);
+			if (m_buffer.empty())
+			{
+				read_all(out, n);
+				return;
+			}
+			size_t buffered = m_end - m_begin < n ? m_end - m_begin : n;
+			std::memcpy(out, m_buffer.data() + m_begin, buffered);
+			m_begin += buffered;
+			out += buffered;
+			n -= buffered;
+			if (n >= m_buffer.size())
+			{
+				read_all(out, n);
+				return;
+			}
+			while (n > 0)
+			{
+				m_begin = 0;
+				m_end = read_some(m_buffer.data(), m_buffer.size());
+				size_t chunk = m_end < n ? m_end : n;
+				std::memcpy(out, m_buffer.data(), chunk);
+				m_begin = chunk;
+				out += chunk;
+				n -= chunk;
+			}
+		}
+		// Runs after the loaded container is swapped in; seeking back within what was just read does not fail.
+		void finish() noexcept
+		{
+			if (m_end > m_begin)
+				::lseek(m_fd, -static_cast< off_t >(m_end - m_begin), SEEK_CUR);
+			m_begin = m_end = 0;
+		}
+
+	  private:
+		static constexpr size_t buffer_size = size_t(1) << 20;
+
+		size_t read_some(char* data, size_t n)
+		{
+			ssize_t got;
+			do
+			{
+				got = ::read(m_fd, data, n);
+			} while (got < 0 && errno == EINTR);
+			if (got <= 0)
+				throw std::runtime_error("BucketStorage: snapshot is truncated");
+			return static_cast< size_t >(got);
+		}
+
+		void read_all(char* data, size_t n)
+		{
+			while (n > 0)
+			{
+				size_t got = read_some(data, n);
+				data += got;
+				n -= got;
+			}
+		}
+
+		int m_fd;
+		std::vector< char > m_buffer;
+		size_t m_begin;
+		size_t m_end;
+	};
+
+	template< typename Source >
+	class ChecksumSource
+	{
+	  public:
+		explicit ChecksumSource(Source& source) : m_source(source) {}
+		void read(void* data, size_t n)
+		{
+			m_source.read(data, n);
+			m_checksum.update(data, n);
+		}
+		// Accounts for bytes that were read before checksumming started, such as the header.
+		void update(const void* data, size_t n) noexcept { m_checksum.update(data, n); }
+		std::uint64_t digest() const noexcept { return m_checksum.digest(); }
+
+	  private:
+		Source& m_source;
+		Checksum m_checksum;
+	};
+
+	// The first page of a file_backed container; block records follow it back to back.
+	struct MappedHeader
+	{
+		char magic[8];
+		std::uint32_t version;
+		std::uint32_t value_size;
+		std::uint32_t value_alignment;
+		std::uint32_t link_size;
+		std::uint64_t block_capacity;
+		std::uint64_t record_size;
+		std::uint64_t block_table_size;
+		std::uint64_t blocks;
+		std::uint64_t size;
+		std::uint64_t start;
+		std::uint64_t end;
+		std::uint64_t next_time;
+		std::uint64_t clean;
+		std::uint64_t occupancy_histogram[10];
+	};
+
+	inline constexpr char mapped_magic[8] = { 'B', 'U', 'C', 'K', 'E', 'T', 'M', '\0' };
+	inline constexpr std::uint32_t mapped_version = 3;
+	inline constexpr size_t mapped_header_bytes = 4096;
+	inline constexpr size_t mapped_default_reserve = sizeof(void*) >= 8 ? size_t(1) << 40 : size_t(1) << 30;
+
+	// A shared mapping of the whole file placed inside one address reservation, so growing the file never moves
+	// what is already mapped.
+	class MappedFile
+	{
+	  public:
+		MappedFile(const char* path, size_t reserve_bytes) :
+			m_fd(-1), m_base(nullptr), m_size(0), m_reserved(0), m_page(static_cast< size_t >(::sysconf(_SC_PAGESIZE)))
+		{
+			m_fd = ::open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+			if (m_fd < 0)
+				throw std::runtime_error("BucketStorage: cannot open the backing file");
+			struct stat st;
+			if (::fstat(m_fd, &st) != 0 || static_cast< size_t >(st.st_size) % m_page != 0)
+				fail("BucketStorage: backing file has an unexpected size");
+			m_size = static_cast< size_t >(st.st_size);
+			m_reserved = align_up(reserve_bytes < m_size ? m_size : reserve_bytes, m_page);
+
+			void* base = ::mmap(nullptr, m_reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			if (base == MAP_FAILED)
+				fail("BucketStorage: cannot reserve address space for the backing file");
+			m_base = static_cast< char* >(base);
+			if (m_size != 0 && ::mmap(m_base, m_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, m_fd, 0) == MAP_FAILED)
+				fail("BucketStorage: cannot map the backing file");
+		}
+
+		~MappedFile() { release(); }
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		char* data() const noexcept { return m_base; }
+		size_t size() const noexcept { return m_size; }
+
+		// Grows geometrically; the tail of the file stays sparse until it is written.
+		void grow(size_t size)
+		{
+			if (size <= m_size)
+				return;
+			if (size > m_reserved)
+				throw std::length_error("BucketStorage: backing file outgrew its address reservation");
+			size_t target = align_up(size < 2 * m_size ? 2 * m_size : size, m_page);
+			target = target < m_reserved ? target : m_reserved;
+			if (::ftruncate(m_fd, static_cast< off_t >(target)) != 0)
+				throw std::runtime_error("BucketStorage: cannot extend the backing file");
+			if (::mmap(m_base + m_size, target - m_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, m_fd,
+					   static_cast< off_t >(m_size)) == MAP_FAILED)
+				throw std::runtime_error("BucketStorage: cannot map the backing file");
+			m_size = target;
+		}
+
+		void sync(size_t offset, size_t length)
+		{
+			size_t begin = offset / m_page * m_page;
+			size_t end = align_up(offset + length, m_page);
+			if (::msync(m_base + begin, end - begin, MS_SYNC) != 0)
+				throw std::runtime_error("BucketStorage: msync of the backing file failed");
+		}
+
+	  private:
+		[[noreturn]] void fail(const char* message)
+		{
+			release();
+			throw std::runtime_error(message);
+		}
+
+		void release() noexcept
+		{
+			if (m_base != nullptr)
+				::munmap(m_base, m_reserved);
+			if (m_fd >= 0)
+				::close(m_fd);
+			m_base = nullptr;
+			m_fd = -1;
+		}
+
+		int m_fd;
+		char* m_base;
+		size_t m_size;
+		size_t m_reserved;
+		size_t m_page;
+	};
+
+	struct NoIndex
+	{
+	};
+
+	struct NoOrder
+	{
+	};
+
+	// Open addressing with linear probing and backward-shift deletion, so there are no tombstones. A slot stores the
+	// link and the mixed hash truncated to the link width; keys are never stored, the caller compares them by link.
+	template< typename Link >
+	class HashIndex
+	{
+	  public:
+		static constexpr Link empty = std::numeric_limits< Link >::max();
+
+		static Link mix(size_t hash) noexcept
+		{
+			std::uint64_t h = hash;
+			h ^= h >> 33;
+			h *= 0xff51afd7ed558ccdULL;
+			h ^= h >> 33;
+			h *= 0xc4ceb9fe1a85ec53ULL;
+			h ^= h >> 33;
+			return static_cast< Link >(h);
+		}
+
+		// Makes room for `count` entries, so that the following inserts cannot throw.
+		void reserve(size_t count)
+		{
+			size_t capacity = m_slots.empty() ? 16 : m_slots.size();
+			while (count * 4 > capacity * 3)
+			{
+				capacity *= 2;
+			}
+			if (capacity == m_slots.size())
+				return;
+			std::vector< Slot > slots(capacity, Slot{ empty, 0 });
+			slots.swap(m_slots);
+			for (const Slot& slot : slots)
+			{
+				if (slot.link != empty)
+					place(slot);
+			}
+		}
+
+		void insert(Link tag, Link link) noexcept { place(Slot{ link, tag }); ++m_size; }
+
+		void erase(Link tag, Link link) noexcept
+		{
+			size_t mask = m_slots.size() - 1;
+			size_t i = tag & mask;
+			while (m_slots[i].link != link)
+			{
+				i = (i + 1) & mask;
+			}
+			for (size_t j = (i + 1) & mask; m_slots[j].link != empty; j = (j + 1) & mask)
+			{
+				size_t home = m_slots[j].tag & mask;
+				if (((j - home) & mask) >= ((j - i) & mask))
+				{
+					m_slots[i] = m_slots[j];
+					i = j;
+				}
+			}
+			m_slots[i] = Slot{ empty, 0 };
+			--m_size;
+		}
+
+		// First entry with this tag for which equal(link) holds, in probe order, which is insertion order among
+		// entries with equal keys.
+		template< typename Equal >
+		Link find(Link tag, Equal&& equal) const
+		{
+			if (m_slots.empty())
+				return empty;
+			size_t mask = m_slots.size() - 1;
+			for (size_t i = tag & mask; m_slots[i].link != empty; i = (i + 1) & mask)
+			{
+				if (m_slots[i].tag == tag && equal(m_slots[i].link))
+					return m_slots[i].link;
+			}
+			return empty;
+		}
+
+		// Calls f(tag, link) for every entry.
+		template< typename F >
+		void for_each(F&& f) const
+		{
+			for (const Slot& slot : m_slots)
+			{
+				if (slot.link != empty)
+					f(slot.tag, slot.link);
+			}
+		}
+
+		void clear() noexcept
+		{
+			std::fill(m_slots.begin(), m_slots.end(), Slot{ empty, 0 });
+			m_size = 0;
+		}
+
+		size_t size() const noexcept { return m_size; }
+		size_t memory_bytes() const noexcept { return m_slots.capacity() * sizeof(Slot); }
+
+	  private:
+		struct Slot
+		{
+			Link link;
+			Link tag;
+		};
+
+		void place(const Slot& slot) noexcept
+		{
+			size_t mask = m_slots.size() - 1;
+			size_t i = slot.tag & mask;
+			while (m_slots[i].link != empty)
+			{
+				i = (i + 1) & mask;
+			}
+			m_slots[i] = slot;
+		}
+
+		std::vector< Slot > m_slots;
+		size_t m_size = 0;
+	};
+
+	// B+-tree over (key, link) pairs. The link breaks ties between equal keys, so every entry is unique and erase()
+	// finds exactly its own entry. Inner nodes keep the entry count of every subtree for rank queries. Nodes come
+	// from a small spare list that reserve() fills, so insert() and erase() never allocate.
+	template< typename Key, typename Link, typename Compare >
+	class OrderedIndex
+	{
+		static_assert(std::is_nothrow_default_constructible_v< Key > && std::is_nothrow_copy_constructible_v< Key > &&
+						  std::is_nothrow_copy_assignable_v< Key >,
+					  "ordered_by needs a key type that is nothrow default constructible and copyable");
+
+		static constexpr size_t leaf_capacity = 32;
+		static constexpr size_t inner_capacity = 32;
+		// Below this a node other than the root borrows from or merges with a sibling.
+		static constexpr size_t min_fill = 8;
+		// Bulk loads leave a quarter of every node free, so the inserts that follow do not split right away.
+		static constexpr size_t bulk_fill = 24;
+
+		struct Node
+		{
+			bool leaf;
+			std::uint32_t size;
+		};
+
+		struct Leaf : Node
+		{
+			Leaf* next;
+			std::array< Key, leaf_capacity > keys;
+			std::array< Link, leaf_capacity > links;
+		};
+
+		// Entry i > 0 is a lower bound of subtree i and above everything in subtree i - 1. Entry 0 is only meaningful
+		// while a split or a bulk load passes the lower bound of the node up.
+		struct Inner : Node
+		{
+			std::array< Key, inner_capacity > keys;
+			std::array< Link, inner_capacity > links;
+			std::array< Node*, inner_capacity > children;
+			std::array< size_t, inner_capacity > counts;
+		};
+
+	  public:
+		using key_type = Key;
+
+		struct Cursor
+		{
+			const Leaf* leaf;
+			size_t pos;
+
+			Link link() const noexcept { return leaf->links[pos]; }
+			const Key& key() const noexcept { return leaf->keys[pos]; }
+
+			void advance() noexcept
+			{
+				if (++pos == leaf->size)
+				{
+					leaf = leaf->next;
+					pos = 0;
+				}
+			}
+
+			bool operator==(const Cursor& other) const noexcept { return leaf == other.leaf && pos == other.pos; }
+		};
+
+		OrderedIndex() noexcept = default;
+
+		// Bulk loads the entries of `other`, which are already in order. Delegating to the default constructor makes the
+		// destructor free the spares that a failed build() leaves behind.
+		OrderedIndex(const OrderedIndex& other) : OrderedIndex()
+		{
+			std::vector< std::pair< Key, Link > > entries;
+			entries.reserve(other.m_size);
+			other.for_each([&](const Key& key, Link link) { entries.emplace_back(key, link); });
+			build(entries);
+		}
+
+		OrderedIndex(OrderedIndex&& other) noexcept { swap(other); }
+
+		OrderedIndex& operator=(const OrderedIndex& other)
+		{
+			if (this != &other)
+			{
+				OrderedIndex temp(other);
+				swap(temp);
+			}
+			return *this;
+		}
+
+		OrderedIndex& operator=(OrderedIndex&& other) noexcept
+		{
+			OrderedIndex temp(std::move(other));
+			swap(temp);
+			return *this;
+		}
+
+		~OrderedIndex()
+		{
+			clear();
+			drop_spares(0, 0);
+		}
+
+		void swap(OrderedIndex& other) noexcept
+		{
+			std::swap(m_root, other.m_root);
+			std::swap(m_height, other.m_height);
+			std::swap(m_size, other.m_size);
+			std::swap(m_spare_leaves, other.m_spare_leaves);
+			std::swap(m_spare_leaf_count, other.m_spare_leaf_count);
+			std::swap(m_spare_inners, other.m_spare_inners);
+			std::swap(m_spare_inner_count, other.m_spare_inner_count);
+			std::swap(m_leaf_count, other.m_leaf_count);
+			std::swap(m_inner_count, other.m_inner_count);
+		}
+
+		friend void swap(OrderedIndex& lhs, OrderedIndex& rhs) noexcept { lhs.swap(rhs); }
+
+		// Makes sure the next insert() finds every node a split can ask for: a leaf and one inner node per level.
+		void reserve()
+		{
+			while (m_spare_leaf_count < 1)
+			{
+				give_leaf(allocate_leaf());
+			}
+			while (m_spare_inner_count < m_height)
+			{
+				give_inner(allocate_inner());
+			}
+		}
+
+		void insert(const Key& key, Link link) noexcept
+		{
+			if (m_root == nullptr)
+			{
+				Leaf* leaf = take_leaf();
+				leaf->next = nullptr;
+				m_root = leaf;
+				m_height = 1;
+			}
+			Key split_key{};
+			Link split_link{};
+			Node* right = insert_into(m_root, key, link, split_key, split_link);
+			if (right != nullptr)
+			{
+				Inner* root = take_inner();
+				root->size = 2;
+				root->children[0] = m_root;
+				root->counts[0] = count_of(m_root);
+				root->children[1] = right;
+				root->counts[1] = count_of(right);
+				root->keys[1] = split_key;
+				root->links[1] = split_link;
+				m_root = root;
+				++m_height;
+			}
+			++m_size;
+		}
+
+		// The entry has to be present.
+		void erase(const Key& key, Link link) noexcept
+		{
+			erase_from(m_root, key, link);
+			--m_size;
+			if (m_root->leaf)
+			{
+				if (m_root->size == 0)
+				{
+					give_leaf(static_cast< Leaf* >(m_root));
+					m_root = nullptr;
+					m_height = 0;
+				}
+			}
+			else if (m_root->size == 1)
+			{
+				Inner* root = static_cast< Inner* >(m_root);
+				m_root = root->children[0];
+				--m_height;
+				give_inner(root);
+			}
+			drop_spares(1, m_height);
+		}
+
+		// Replaces the contents with `entries`, which have to be sorted by (key, link).
+		void assign(const std::vector< std::pair< Key, Link > >& entries)
+		{
+			OrderedIndex built;
+			built.build(entries);
+			swap(built);
+		}
+
+		// This index plus the entries of `other` with `offset` added to their links.
+		OrderedIndex merged(const OrderedIndex& other, Link offset) const
+		{
+			std::vector< std::pair< Key, Link > > entries;
+			entries.reserve(m_size + other.m_size);
+			Cursor a = begin();
+			Cursor b = other.begin();
+			while (a.leaf != nullptr || b.leaf != nullptr)
+			{
+				if (b.leaf == nullptr || (a.leaf != nullptr && less(a.key(), a.link(), b.key(), b.link() + offset)))
+				{
+					entries.emplace_back(a.key(), a.link());
+					a.advance();
+				}
+				else
+				{
+					entries.emplace_back(b.key(), b.link() + offset);
+					b.advance();
+				}
+			}
+			OrderedIndex result;
+			result.build(entries);
+			return result;
+		}
+
+		void clear() noexcept
+		{
+			if (m_root != nullptr)
+				free_subtree(m_root);
+			m_root = nullptr;
+			m_height = 0;
+			m_size = 0;
+			drop_spares(1, 0);
+		}
+
+		Cursor begin() const noexcept
+		{
+			const Node* node = m_root;
+			if (node == nullptr)
+				return end();
+			while (!node->leaf)
+			{
+				node = static_cast< const Inner* >(node)->children[0];
+			}
+			return { static_cast< const Leaf* >(node), 0 };
+		}
+
+		Cursor end() const noexcept { return { nullptr, 0 }; }
+
+		// First entry whose key is not below `key`.
+		template< typename K >
+		Cursor lower_bound(const K& key) const
+		{
+			const Node* node = m_root;
+			if (node == nullptr)
+				return end();
+			while (!node->leaf)
+			{
+				const Inner* inner = static_cast< const Inner* >(node);
+				auto first = inner->keys.begin() + 1;
+				size_t i = static_cast< size_t >(std::partition_point(first, first + (inner->size - 1), [&](const Key& k) { return Compare{}(k, key); }) - first);
+				node = inner->children[i];
+			}
+			const Leaf* leaf = static_cast< const Leaf* >(node);
+			size_t pos = static_cast< size_t >(
+				std::partition_point(leaf->keys.begin(), leaf->keys.begin() + leaf->size, [&](const Key& k) { return Compare{}(k, key); }) -
+				leaf->keys.begin());
+			if (pos == leaf->size)
+				return { leaf->next, 0 };
+			return { leaf, pos };
+		}
+
+		// Entry of rank n, or end() if there are not that many.
+		Cursor nth(size_t n) const noexcept
+		{
+			if (n >= m_size)
+				return end();
+			const Node* node = m_root;
+			while (!node->leaf)
+			{
+				const Inner* inner = static_cast< const Inner* >(node);
+				size_t i = 0;
+				while (n >= inner->counts[i])
+				{
+					n -= inner->counts[i++];
+				}
+				node = inner->children[i];
+			}
+			return { static_cast< const Leaf* >(node), n };
+		}
+
+		// Calls f(key, link) for every entry in order.
+		template< typename F >
+		void for_each(F&& f) const
+		{
+			for (Cursor c = begin(); c.leaf != nullptr; c.advance())
+			{
+				f(c.key(), c.link());
+			}
+		}
+
+		size_t size() const noexcept { return m_size; }
+		size_t memory_bytes() const noexcept { return m_leaf_count * sizeof(Leaf) + m_inner_count * sizeof(Inner); }
+
+	  private:
+		static bool less(const Key& a, Link a_link, const Key& b, Link b_link) noexcept
+		{
+			if (Compare{}(a, b))
+				return true;
+			if (Compare{}(b, a))
+				return false;
+			return a_link < b_link;
+		}
+
+		static size_t count_of(const Node* node) noexcept
+		{
+			if (node->leaf)
+				return node->size;
+			const Inner* inner = static_cast< const Inner* >(node);
+			size_t count = 0;
+			for (size_t i = 0; i < inner->size; ++i)
+			{
+				count += inner->counts[i];
+			}
+			return count;
+		}
+
+		// Position of the first entry above (key, link).
+		static size_t leaf_position(const Leaf* leaf, const Key& key, Link link) noexcept
+		{
+			size_t lo = 0;
+			size_t hi = leaf->size;
+			while (lo < hi)
+			{
+				size_t mid = (lo + hi) / 2;
+				if (less(key, link, leaf->keys[mid], leaf->links[mid]))
+					hi = mid;
+				else
+					lo = mid + 1;
+			}
+			return lo;
+		}
+
+		// Subtree that holds or would hold (key, link).
+		static size_t child_index(const Inner* inner, const Key& key, Link link) noexcept
+		{
+			size_t lo = 1;
+			size_t hi = inner->size;
+			while (lo < hi)
+			{
+				size_t mid = (lo + hi) / 2;
+				if (less(key, link, inner->keys[mid], inner->links[mid]))
+					hi = mid;
+				else
+					lo = mid + 1;
+			}
+			return lo - 1;
+		}
+
+		static void leaf_insert(Leaf* leaf, size_t pos, const Key& key, Link link) noexcept
+		{
+			std::copy_backward(leaf->keys.begin() + pos, leaf->keys.begin() + leaf->size, leaf->keys.begin() + leaf->size + 1);
+			std::copy_backward(leaf->links.begin() + pos, leaf->links.begin() + leaf->size, leaf->links.begin() + leaf->size + 1);
+			leaf->keys[pos] = key;
+			leaf->links[pos] = link;
+			++leaf->size;
+		}
+
+		static void leaf_remove(Leaf* leaf, size_t pos) noexcept
+		{
+			std::copy(leaf->keys.begin() + pos + 1, leaf->keys.begin() + leaf->size, leaf->keys.begin() + pos);
+			std::copy(leaf->links.begin() + pos + 1, leaf->links.begin() + leaf->size, leaf->links.begin() + pos);
+			--leaf->size;
+		}
+
+		static void inner_insert(Inner* inner, size_t pos, const Key& key, Link link, Node* child, size_t count) noexcept
+		{
+			size_t size = inner->size;
+			std::copy_backward(inner->keys.begin() + pos, inner->keys.begin() + size, inner->keys.begin() + size + 1);
+			std::copy_backward(inner->links.begin() + pos, inner->links.begin() + size, inner->links.begin() + size + 1);
+			std::copy_backward(inner->children.begin() + pos, inner->children.begin() + size, inner->children.begin() + size + 1);
+			std::copy_backward(inner->counts.begin() + pos, inner->counts.begin() + size, inner->counts.begin() + size + 1);
+			inner->keys[pos] = key;
+			inner->links[pos] = link;
+			inner->children[pos] = child;
+			inner->counts[pos] = count;
+			++inner->size;
+		}
+
+		static void inner_remove(Inner* inner, size_t pos) noexcept
+		{
+			size_t size = inner->size;
+			std::copy(inner->keys.begin() + pos + 1, inner->keys.begin() + size, inner->keys.begin() + pos);
+			std::copy(inner->links.begin() + pos + 1, inner->links.begin() + size, inner->links.begin() + pos);
+			std::copy(inner->children.begin() + pos + 1, inner->children.begin() + size, inner->children.begin() + pos);
+			std::copy(inner->counts.begin() + pos + 1, inner->counts.begin() + size, inner->counts.begin() + pos);
+			--inner->size;
+		}
+
+		// Inserts into the subtree at `node`. If the node had to split, returns the new right half and sets
+		// split_key and split_link to its lower bound.
+		Node* insert_into(Node* node, const Key& key, Link link, Key& split_key, Link& split_link) noexcept
+		{
+			if (node->leaf)
+			{
+				Leaf* leaf = static_cast< Leaf* >(node);
+				size_t pos = leaf_position(leaf, key, link);
+				if (leaf->size < leaf_capacity)
+				{
+					leaf_insert(leaf, pos, key, link);
+					return nullptr;
+				}
+				Leaf* right = take_leaf();
+				constexpr size_t half = leaf_capacity / 2;
+				std::copy(leaf->keys.begin() + half, leaf->keys.end(), right->keys.begin());
+				std::copy(leaf->links.begin() + half, leaf->links.end(), right->links.begin());
+				right->size = leaf_capacity - half;
+				leaf->size = half;
+				right->next = leaf->next;
+				leaf->next = right;
+				if (pos <= half)
+					leaf_insert(leaf, pos, key, link);
+				else
+					leaf_insert(right, pos - half, key, link);
+				split_key = right->keys[0];
+				split_link = right->links[0];
+				return right;
+			}
+
+			Inner* inner = static_cast< Inner* >(node);
+			size_t i = child_index(inner, key, link);
+			Key child_key{};
+			Link child_link{};
+			Node* child = insert_into(inner->children[i], key, link, child_key, child_link);
+			if (child == nullptr)
+			{
+				++inner->counts[i];
+				return nullptr;
+			}
+			size_t child_count = count_of(child);
+			inner->counts[i] = inner->counts[i] + 1 - child_count;
+			if (inner->size < inner_capacity)
+			{
+				inner_insert(inner, i + 1, child_key, child_link, child, child_count);
+				return nullptr;
+			}
+			Inner* right = take_inner();
+			constexpr size_t half = inner_capacity / 2;
+			std::copy(inner->keys.begin() + half, inner->keys.end(), right->keys.begin());
+			std::copy(inner->links.begin() + half, inner->links.end(), right->links.begin());
+			std::copy(inner->children.begin() + half, inner->children.end(), right->children.begin());
+			std::copy(inner->counts.begin() + half, inner->counts.end(), right->counts.begin());
+			right->size = inner_capacity - half;
+			inner->size = half;
+			if (i + 1 <= half)
+				inner_insert(inner, i + 1, child_key, child_link, child, child_count);
+			else
+				inner_insert(right, i + 1 - half, child_key, child_link, child, child_count);
+			split_key = right->keys[0];
+			split_link = right->links[0];
+			return right;
+		}
+
+		// Returns whether `node` dropped below min_fill.
+		bool erase_from(Node* node, const Key& key, Link link) noexcept
+		{
+			if (node->leaf)
+			{
+				Leaf* leaf = static_cast< Leaf* >(node);
+				leaf_remove(leaf, leaf_position(leaf, key, link) - 1);
+				return leaf->size < min_fill;
+			}
+			Inner* inner = static_cast< Inner* >(node);
+			size_t i = child_index(inner, key, link);
+			--inner->counts[i];
+			if (erase_from(inner->children[i], key, link))
+				rebalance(inner, i);
+			return inner->size < min_fill;
+		}
+
+		// Child i is below min_fill: merges it with a neighbour if both fit into one node, otherwise moves one entry
+		// over from the neighbour.
+		void rebalance(Inner* parent, size_t i) noexcept
+		{
+			size_t left = i == 0 ? 0 : i - 1;
+			size_t right = left + 1;
+			Node* a = parent->children[left];
+			Node* b = parent->children[right];
+			size_t capacity = a->leaf ? leaf_capacity : inner_capacity;
+			if (a->size + b->size <= capacity)
+			{
+				if (a->leaf)
+				{
+					Leaf* la = static_cast< Leaf* >(a);
+					Leaf* lb = static_cast< Leaf* >(b);
+					std::copy(lb->keys.begin(), lb->keys.begin() + lb->size, la->keys.begin() + la->size);
+					std::copy(lb->links.begin(), lb->links.begin() + lb->size, la->links.begin() + la->size);
+					la->size += lb->size;
+					la->next = lb->next;
+					give_leaf(lb);
+				}
+				else
+				{
+					Inner* ia = static_cast< Inner* >(a);
+					Inner* ib = static_cast< Inner* >(b);
+					ib->keys[0] = parent->keys[right];
+					ib->links[0] = parent->links[right];
+					std::copy(ib->keys.begin(), ib->keys.begin() + ib->size, ia->keys.begin() + ia->size);
+					std::copy(ib->links.begin(), ib->links.begin() + ib->size, ia->links.begin() + ia->size);
+					std::copy(ib->children.begin(), ib->children.begin() + ib->size, ia->children.begin() + ia->size);
+					std::copy(ib->counts.begin(), ib->counts.begin() + ib->size, ia->counts.begin() + ia->size);
+					ia->size += ib->size;
+					give_inner(ib);
+				}
+				parent->counts[left] += parent->counts[right];
+				inner_remove(parent, right);
+				return;
+			}
+
+			size_t moved;
+			if (a->leaf)
+			{
+				Leaf* la = static_cast< Leaf* >(a);
+				Leaf* lb = static_cast< Leaf* >(b);
+				if (i == right)
+				{
+					leaf_insert(lb, 0, la->keys[la->size - 1], la->links[la->size - 1]);
+					--la->size;
+				}
+				else
+				{
+					leaf_insert(la, la->size, lb->keys[0], lb->links[0]);
+					leaf_remove(lb, 0);
+				}
+				moved = 1;
+				parent->keys[right] = lb->keys[0];
+				parent->links[right] = lb->links[0];
+			}
+			else
+			{
+				Inner* ia = static_cast< Inner* >(a);
+				Inner* ib = static_cast< Inner* >(b);
+				if (i == right)
+				{
+					size_t last = ia->size - 1;
+					moved = ia->counts[last];
+					inner_insert(ib, 0, Key{}, Link{}, ia->children[last], moved);
+					ib->keys[1] = parent->keys[right];
+					ib->links[1] = parent->links[right];
+					parent->keys[right] = ia->keys[last];
+					parent->links[right] = ia->links[last];
+					--ia->size;
+				}
+				else
+				{
+					moved = ib->counts[0];
+					inner_insert(ia, ia->size, parent->keys[right], parent->links[right], ib->children[0], moved);
+					parent->keys[right] = ib->keys[1];
+					parent->links[right] = ib->links[1];
+					inner_remove(ib, 0);
+				}
+			}
+			if (i == right)
+			{
+				parent->counts[left] -= moved;
+				parent->counts[right] += moved;
+			}
+			else
+			{
+				parent->counts[left] += moved;
+				parent->counts[right] -= moved;
+			}
+		}
+
+		// Builds the tree from sorted entries. Every node is allocated before any is linked, so a failed allocation
+		// leaves only spares behind, which the destructor frees.
+		void build(const std::vector< std::pair< Key, Link > >& entries)
+		{
+			size_t n = entries.size();
+			if (n == 0)
+				return;
+			size_t leaves = (n + bulk_fill - 1) / bulk_fill;
+			size_t inners = 0;
+			for (size_t width = leaves; width > 1;)
+			{
+				width = (width + bulk_fill - 1) / bulk_fill;
+				inners += width;
+			}
+			std::vector< Node* > level;
+			std::vector< Node* > upper;
+			level.reserve(leaves);
+			upper.reserve((leaves + bulk_fill - 1) / bulk_fill);
+			for (size_t k = 0; k < leaves; ++k)
+			{
+				give_leaf(allocate_leaf());
+			}
+			for (size_t k = 0; k < inners; ++k)
+			{
+				give_inner(allocate_inner());
+			}
+
+			Leaf* previous = nullptr;
+			for (size_t k = 0, first = 0; k < leaves; ++k)
+			{
+				size_t last = n * (k + 1) / leaves;
+				Leaf* leaf = take_leaf();
+				leaf->size = static_cast< std::uint32_t >(last - first);
+				leaf->next = nullptr;
+				for (size_t j = first; j < last; ++j)
+				{
+					leaf->keys[j - first] = entries[j].first;
+					leaf->links[j - first] = entries[j].second;
+				}
+				if (previous != nullptr)
+					previous->next = leaf;
+				previous = leaf;
+				level.push_back(leaf);
+				first = last;
+			}
+			m_height = 1;
+			while (level.size() > 1)
+			{
+				size_t groups = (level.size() + bulk_fill - 1) / bulk_fill;
+				upper.clear();
+				for (size_t k = 0, first = 0; k < groups; ++k)
+				{
+					size_t last = level.size() * (k + 1) / groups;
+					Inner* inner = take_inner();
+					inner->size = static_cast< std::uint32_t >(last - first);
+					for (size_t j = first; j < last; ++j)
+					{
+						Node* child = level[j];
+						inner->children[j - first] = child;
+						inner->counts[j - first] = count_of(child);
+						if (child->leaf)
+						{
+							inner->keys[j - first] = static_cast< Leaf* >(child)->keys[0];
+							inner->links[j - first] = static_cast< Leaf* >(child)->links[0];
+						}
+						else
+						{
+							inner->keys[j - first] = static_cast< Inner* >(child)->keys[0];
+							inner->links[j - first] = static_cast< Inner* >(child)->links[0];
+						}
+					}
+					upper.push_back(inner);
+					first = last;
+				}
+				level.swap(upper);
+				++m_height;
+			}
+			m_root = level[0];
+			m_size = n;
+		}
+
+		Leaf* allocate_leaf()
+		{
+			Leaf* leaf = new Leaf();
+			leaf->leaf = true;
+			++m_leaf_count;
+			return leaf;
+		}
+
+		Inner* allocate_inner()
+		{
+			Inner* inner = new Inner();
+			inner->leaf = false;
+			++m_inner_count;
+			return inner;
+		}
+
+		Leaf* take_leaf() noexcept
+		{
+			Leaf* leaf = m_spare_leaves;
+			m_spare_leaves = leaf->next;
+			--m_spare_leaf_count;
+			leaf->size = 0;
+			return leaf;
+		}
+
+		Inner* take_inner() noexcept
+		{
+			Inner* inner = m_spare_inners;
+			m_spare_inners = static_cast< Inner* >(inner->children[0]);
+			--m_spare_inner_count;
+			inner->size = 0;
+			return inner;
+		}
+
+		void give_leaf(Leaf* leaf) noexcept
+		{
+			leaf->next = m_spare_leaves;
+			m_spare_leaves = leaf;
+			++m_spare_leaf_count;
+		}
+
+		void give_inner(Inner* inner) noexcept
+		{
+			inner->children[0] = m_spare_inners;
+			m_spare_inners = inner;
+			++m_spare_inner_count;
+		}
+
+		// Frees spare nodes beyond the given counts.
+		void drop_spares(size_t leaves, size_t inners) noexcept
+		{
+			while (m_spare_leaf_count > leaves)
+			{
+				Leaf* leaf = take_leaf();
+				delete leaf;
+				--m_leaf_count;
+			}
+			while (m_spare_inner_count > inners)
+			{
+				Inner* inner = take_inner();
+				delete inner;
+				--m_inner_count;
+			}
+		}
+
+		void free_subtree(Node* node) noexcept
+		{
+			if (node->leaf)
+			{
+				delete static_cast< Leaf* >(node);
+				--m_leaf_count;
+				return;
+			}
+			Inner* inner = static_cast< Inner* >(node);
+			for (size_t i = 0; i < inner->size; ++i)
+			{
+				free_subtree(inner->children[i]);
+			}
+			delete inner;
+			--m_inner_count;
+		}
+
+		Node* m_root = nullptr;
+		size_t m_height = 0;
+		size_t m_size = 0;
+		Leaf* m_spare_leaves = nullptr;
+		size_t m_spare_leaf_count = 0;
+		Inner* m_spare_inners = nullptr;
+		size_t m_spare_inner_count = 0;
+		size_t m_leaf_count = 0;
+		size_t m_inner_count = 0;
+	};
+
+	template< typename Policy, typename T, typename Link >
+	struct order_tree
+	{
+		using key_type = std::decay_t< std::invoke_result_t< const typename Policy::key_fn&, const T& > >;
+		using type = OrderedIndex< key_type, Link, typename Policy::key_compare >;
+	};
+
+	template< typename T, typename Link >
+	struct order_tree< void, T, Link >
+	{
+		using type = NoOrder;
+	};
+
+	// Bounded lock-free queue between exactly one pushing and one popping thread. Each side caches the other's index
+	// and rereads it only when the ring looks full or empty, so the shared cache lines move once per batch.
+	template< typename P >
+	class SpscRing
+	{
+	  public:
+		explicit SpscRing(size_t capacity) : m_slots(std::bit_ceil(capacity < 2 ? size_t(2) : capacity)) {}
+
+		bool try_push(P value) noexcept
+		{
+			size_t tail = m_tail.load(std::memory_order_relaxed);
+			if (tail - m_head_cache == m_slots.size())
+			{
+				m_head_cache = m_head.load(std::memory_order_acquire);
+				if (tail - m_head_cache == m_slots.size())
+					return false;
+			}
+			m_slots[tail & (m_slots.size() - 1)] = value;
+			m_tail.store(tail + 1, std::memory_order_release);
+			return true;
+		}
+
+		bool try_pop(P& value) noexcept
+		{
+			size_t head = m_head.load(std::memory_order_relaxed);
+			if (head == m_tail_cache)
+			{
+				m_tail_cache = m_tail.load(std::memory_order_acquire);
+				if (head == m_tail_cache)
+					return false;
+			}
+			value = m_slots[head & (m_slots.size() - 1)];
+			m_head.store(head + 1, std::memory_order_release);
+			return true;
+		}
+
+	  private:
+		std::vector< P > m_slots;
+		alignas(64) std::atomic< size_t > m_head{ 0 };
+		size_t m_tail_cache = 0;
+		alignas(64) std::atomic< size_t > m_tail{ 0 };
+		size_t m_head_cache = 0;
+	};
+
+	// Fewer blocks than this per thread cost more to start the thread than to process them.
+	inline constexpr size_t parallel_grain = 1024;
+
+	inline size_t slice_count(size_t count, unsigned threads) noexcept
+	{
+		if (threads == 0)
+			threads = std::max(1u, std::thread::hardware_concurrency());
+		return std::clamp< size_t >(count / parallel_grain, 1, threads);
+	}
+
+	// Runs f(slice, first, last) for `slices` contiguous parts of [0, count), each but the first on its own thread. A
+	// part whose thread cannot be started runs on the calling thread. The first exception thrown by f is rethrown
+	// once every part has finished.
+	template< typename F >
+	void run_slices(size_t slices, size_t count, F& f)
+	{
+		std::exception_ptr error;
+		std::atomic< bool > failed(false);
+		auto run = [&](size_t slice) noexcept
+		{
+			try
+			{
+				f(slice, count * slice / slices, count * (slice + 1) / slices);
+			} catch (...)
+			{
+				if (!failed.exchange(true))
+					error = std::current_exception();
+			}
+		};
+		std::vector< std::thread > workers;
+		size_t started = 1;
+		try
+		{
+			workers.reserve(slices - 1);
+			for (; started < slices; ++started)
+				workers.emplace_back(run, started);
+		} catch (...)
+		{
+			// The parts from `started` on run below.
+		}
+		for (size_t slice = started; slice < slices; ++slice)
+			run(slice);
+		run(0);
+		for (std::thread& worker : workers)
+			worker.join();
+		if (error)
+			std::rethrow_exception(error);
+	}
+}	 // namespace details
+
+template< typename T, typename... Options >
+class BlockHandoff;
+
+template< typename T, typename... Options >
+class BucketStorage
+{
+	template< typename, typename... >
+	friend class BlockHandoff;
+
+	template< bool IsConst >
+	class BaseIterator;
+	template< bool IsConst >
+	class BasePrefetchIterator;
+	template< bool IsConst >
+	struct PrefetchView;
+	template< bool IsConst >
+	class BaseUnorderedIterator;
+	template< bool IsConst >
+	class BaseOrderedIterator;
+	template< bool IsConst >
+	struct OrderedView;
+	struct Block;
+	struct Element;
+	class VirtualMemory;
+	class PhysicalMemory;
+
+  public:
+	using value_type = T;
+	using reference = T&;
+	using pointer = T*;
+	using size_type = size_t;
+	using const_reference = const T&;
+	using difference_type = std::ptrdiff_t;
+	using link_type = std::conditional_t< details::has_option< compact_links, Options... >, std::uint32_t, size_type >;
+	using stamp_type = link_type;
+	typedef details::HotPathStats HotPathStats;
+	typedef details::HotPathCounters< details::has_option< with_counters, Options... > > Counters;
+
+	// How many elements ahead of the current one prefetch iterators and for_each start loading.
+	static constexpr size_type default_prefetch_distance = 8;
+
+	// Index 0 counts empty blocks, the last index full ones, the rest split partial occupancy into eighths.
+	static constexpr size_type occupancy_buckets = 10;
+
+	struct MemoryStats
+	{
+		size_type slot_bytes;
+		size_type element_bytes;
+		size_type block_header_bytes;
+		size_type block_table_bytes;
+		size_type free_block_bytes;
+		size_type metadata_bytes;
+		size_type blocks;
+		size_type partially_free_blocks;
+		std::array< size_type, occupancy_buckets > occupancy_histogram;
+		size_type index_bytes;
+		double fragmentation;
+	};
+
+	explicit BucketStorage() noexcept;
+	explicit BucketStorage(size_type m_bucket_capacity) noexcept;
+	BucketStorage(size_type size_limit, evict_oldest_t, size_type m_bucket_capacity = default_block_capacity);
+	explicit BucketStorage(const char* path,
+						   size_type m_bucket_capacity = 64,
+						   size_type max_file_bytes = details::mapped_default_reserve);
+	~BucketStorage();
+
+	BucketStorage(BucketStorage&& other) noexcept;
+	BucketStorage(const BucketStorage& other);
+	BucketStorage(const BucketStorage& other, parallel_t policy);
+	BucketStorage& operator=(BucketStorage&& other) noexcept;
+	BucketStorage& operator=(const BucketStorage& other);
+
+	using iterator = BaseIterator< false >;
+	using const_iterator = BaseIterator< true >;
+	using prefetch_iterator = BasePrefetchIterator< false >;
+	using const_prefetch_iterator = BasePrefetchIterator< true >;
+	using unordered_iterator = BaseUnorderedIterator< false >;
+	using const_unordered_iterator = BaseUnorderedIterator< true >;
+	using ordered_iterator = BaseOrderedIterator< false >;
+	using const_ordered_iterator = BaseOrderedIterator< true >;
+	class Snapshot;
+	iterator erase(iterator iter);
+	iterator insert(const value_type& x);
+	iterator insert(value_type&& x);
+	iterator begin() noexcept;
+	iterator end() noexcept;
+	const_iterator begin() const noexcept;
+	const_iterator end() const noexcept;
+	const_iterator cbegin() noexcept;
+	const_iterator cend() noexcept;
+	size_type size() const noexcept;
+	bool empty() const noexcept;
+	void clear() noexcept;
+	void clear(parallel_t policy) noexcept;
+	void shrink_to_fit();
+	void shrink_to_fit(parallel_t policy);
+	size_type trim(size_type target_bytes, std::chrono::nanoseconds budget = std::chrono::nanoseconds::max());
+	void splice(BucketStorage&& other);
+	size_type size_limit() const noexcept;
+	template< typename K >
+	iterator find(const K& key);
+	template< typename K >
+	const_iterator find(const K& key) const;
+	template< typename K >
+	OrderedView< false > range(const K& lo, const K& hi);
+	template< typename K >
+	OrderedView< true > range(const K& lo, const K& hi) const;
+	OrderedView< false > ordered() noexcept;
+	OrderedView< true > ordered() const noexcept;
+	iterator nth_by_key(size_type n) noexcept;
+	const_iterator nth_by_key(size_type n) const noexcept;
+	std::vector< BucketStorage > split(size_type n);
+	Snapshot snapshot() const;
+	iterator lower_bound_time(stamp_type time) noexcept;
+	const_iterator lower_bound_time(stamp_type time) const noexcept;
+	iterator upper_bound_time(stamp_type time) noexcept;
+	const_iterator upper_bound_time(stamp_type time) const noexcept;
+	std::pair< iterator, iterator > range_by_time(stamp_type first, stamp_type last) noexcept;
+	std::pair< const_iterator, const_iterator > range_by_time(stamp_type first, stamp_type last) const noexcept;
+	void swap(BucketStorage& other) noexcept;
+	size_type capacity() const noexcept;
+	iterator get_to_distance(iterator it, difference_type dist) noexcept;
+	PrefetchView< false > prefetched(size_type distance = default_prefetch_distance) noexcept;
+	PrefetchView< true > prefetched(size_type distance = default_prefetch_distance) const noexcept;
+	template< typename F >
+	void for_each(F&& f, size_type distance = default_prefetch_distance);
+	template< typename F >
+	void for_each(F&& f, size_type distance = default_prefetch_distance) const;
+	unordered_iterator unordered_begin() noexcept;
+	unordered_iterator unordered_end() noexcept;
+	const_unordered_iterator unordered_begin() const noexcept;
+	const_unordered_iterator unordered_end() const noexcept;
+	template< typename F >
+	void for_each_unordered(F&& f);
+	template< typename F >
+	void for_each_unordered(F&& f) const;
+	MemoryStats memory_stats() const noexcept;
+	HotPathStats hot_path_stats() const noexcept;
+	void reset_hot_path_stats() noexcept;
+	void flush();
+
+	void save(std::ostream& out) const;
+	void save(int fd) const;
+	void load(std::istream& in);
+	void load(int fd);
+
+  private:
+	template< typename U >
+	iterator insert_impl(U&& x);
+	template< typename U >
+	iterator replace_oldest(U&& x);
+	void evict_over_limit();
+	template< typename K >
+	link_type find_link(const K& key) const;
+	link_type index_tag(const value_type& x) const;
+	decltype(auto) order_key(const value_type& x) const;
+	void rebuild_index();
+	void move_element(link_type link);
+	template< typename Sink >
+	void save_impl(Sink& sink) const;
+	template< typename Source >
+	void load_impl(Source& source);
+	template< typename Self, typename F >
+	static void for_each_impl(Self& self, F& f, size_type distance);
+	PhysicalMemory* make_physical_memory(size_type capacity);
+	VirtualMemory* make_virtual_memory();
+	void destroy_memory() noexcept;
+
+	static constexpr link_type npos = std::numeric_limits< link_type >::max();
+	static constexpr bool is_file_backed = details::has_option< file_backed, Options... >;
+	static constexpr bool is_shared = details::has_option< copy_on_write, Options... >;
+	static_assert(!is_shared || (std::is_trivially_copyable_v< value_type > && !is_file_backed),
+				  "copy_on_write needs a trivially copyable value_type and is not available for a file-backed BucketStorage");
+	static constexpr size_type inline_capacity = details::inline_option< Options... >::value;
+	static constexpr bool is_inline = inline_capacity != 0;
+	static_assert(!is_inline || (is_trivially_relocatable_v< value_type > && !is_shared && !is_file_backed),
+				  "inline_block needs a trivially relocatable value_type and does not combine with copy_on_write or file_backed");
+	static constexpr size_type default_block_capacity = is_inline ? inline_capacity : 64;
+	static constexpr size_type max_block_capacity = details::geometric_option< Options... >::value;
+	static constexpr bool is_geometric = max_block_capacity != 0;
+	static_assert(!is_geometric || !is_file_backed, "geometric_blocks is not available for a file-backed BucketStorage");
+	static_assert(!is_file_backed || std::is_trivially_copyable_v< value_type >,
+				  "a file-backed BucketStorage needs a trivially copyable value_type");
+	using index_policy = typename details::index_option< Options... >::type;
+	static constexpr bool is_indexed = !std::is_void_v< index_policy >;
+	typedef std::conditional_t< is_indexed, details::HashIndex< link_type >, details::NoIndex > Index;
+	using order_policy = typename details::order_option< Options... >::type;
+	static constexpr bool is_ordered = !std::is_void_v< order_policy >;
+	typedef typename details::order_tree< order_policy, value_type, link_type >::type Order;
+
+	struct Element
+	{
+		stamp_type get_time() const;
+		link_type get_next() const;
+		link_type get_prev() const;
+
+		void set_time(stamp_type time);
+		void set_next(link_type next);
+		void set_prev(link_type prev);
+
+	  private:
+		link_type m_next;
+		link_type m_prev;
+		stamp_type m_time;
+	};
+
+	// Header of a single allocation: Block, then Element[m_capacity], then value_type[m_capacity], then an occupancy
+	// bitmap with one bit per slot. Free slots below m_head are chained through Element::m_next starting at
+	// m_free_head, so a block holds no pointers.
+	struct Block
+	{
+		static Block* create(size_type capacity);
+		static Block* create_at(void* raw, size_type capacity) noexcept;
+		static void destroy(Block* block) noexcept;
+		static constexpr size_type alignment();
+		static constexpr size_type footprint(size_type capacity);
+		Element* get_element(size_type pos);
+		value_type* get_data(size_type pos);
+		void set_live(size_type pos) noexcept;
+		void set_free(size_type pos) noexcept;
+		size_type find_live(size_type pos) noexcept;
+		void rebuild_occupancy() noexcept;
+		void copy_from(Block& other) noexcept;
+		void copy_layout(Block& other) noexcept;
+		void rank_words(size_type base, size_type* ranks) noexcept;
+		size_type rank(size_type pos, const size_type* ranks) noexcept;
+		size_type occupancy_word_count() const noexcept;
+
+		link_type m_head;
+		link_type m_size;
+		link_type m_capacity;
+		link_type m_free_head;
+		// Stamps of the live slots lie in [m_min_time, m_max_time]; m_min_time is exact unless it is 0.
+		stamp_type m_min_time;
+		stamp_type m_max_time;
+		[[no_unique_address]] details::BlockShares< is_shared > m_shares;
+
+	  private:
+		explicit Block(size_type capacity) noexcept;
+		static constexpr size_type elements_offset();
+		static constexpr size_type data_offset(size_type capacity);
+		static constexpr size_type occupancy_offset(size_type capacity);
+		static constexpr size_type occupancy_words(size_type capacity);
+		std::uint64_t* get_occupancy() noexcept;
+	};
+
+	class VirtualMemory
+	{
+	  public:
+		explicit VirtualMemory(PhysicalMemory* physical_memory) noexcept;
+
+		void push(link_type link);
+		link_type unlink(link_type link);
+		void relink(link_type from, link_type to) noexcept;
+		void reset() noexcept;
+		void restore(link_type start, link_type end, stamp_type next_time) noexcept;
+		void append(link_type start, link_type end, stamp_type next_time) noexcept;
+		void restamp() noexcept;
+		link_type get_start() const noexcept;
+		link_type get_end() const noexcept;
+		stamp_type get_next_time() const noexcept;
+		Element* get_element(link_type link) const;
+		value_type* get_data(link_type link) const;
+		Block* get_block(link_type link) const noexcept;
+		link_type get_slot_mask() const noexcept;
+		void touch(link_type link) const;
+		void prepare_push();
+		void prepare_unlink(link_type link);
+		link_type prefetch_next(link_type link, size_type& run) const noexcept;
+		link_type next_live(link_type link) const noexcept;
+
+	  private:
+		PhysicalMemory* m_physical_memory;
+		link_type m_start;
+		link_type m_end;
+		mutable Element m_over_end;
+	};
+
+	class PhysicalMemory
+	{
+	  public:
+		explicit PhysicalMemory(size_type m_bucket_capacity);
+		PhysicalMemory(size_type m_bucket_capacity, const char* path, size_type max_file_bytes);
+		PhysicalMemory(PhysicalMemory&& other) noexcept;
+		~PhysicalMemory();
+
+		void swap(PhysicalMemory& other) noexcept;
+
+		template< typename U >
+		link_type push(U&& x);
+		link_type relocate(value_type* source);
+		void pop(link_type link);
+		void replace(link_type link, value_type&& value) noexcept;
+		void clear(unsigned threads = 1) noexcept;
+		void release_relocated() noexcept;
+		void pack(PhysicalMemory& from, link_type& start, link_type& end, unsigned threads);
+		link_type transfer(link_type link);
+		void release_transferred(link_type link) noexcept;
+		template< typename Move, typename Stop >
+		void compact(size_type free_slots, size_type target_bytes, Move& move, Stop& stop);
+		void release_slack() noexcept;
+		size_type footprint_bytes() const noexcept;
+		void clone(const PhysicalMemory& other, unsigned threads = 1);
+		void share(const PhysicalMemory& other);
+		void own(link_type link);
+		void own_all();
+		void spill_inline();
+		link_type adopt(PhysicalMemory& other, stamp_type time_offset);
+		void take_blocks(const PhysicalMemory& from, size_type first, size_type last);
+		void forget_blocks() noexcept;
+		size_type size() const noexcept;
+		size_type slots() const noexcept;
+		Block* get_block(link_type link) const;
+		Element* get_element(link_type link) const;
+		value_type* get_data(link_type link) const;
+		bool is_live(link_type link) const noexcept;
+		void fill_stats(MemoryStats& stats) const noexcept;
+		Counters& get_counters() noexcept;
+		template< typename Sink >
+		void save_blocks(Sink& sink) const;
+		template< typename Source >
+		void load_blocks(Source& source, size_type block_table_size, size_type blocks);
+		size_type get_block_table_size() const noexcept;
+		unsigned get_slot_bits() const noexcept;
+		link_type get_slot_mask() const noexcept;
+		void touch(link_type link) noexcept;
+		void record_time(link_type link, stamp_type time) noexcept;
+		void merge_time(link_type link, stamp_type time) noexcept;
+		void forget_times() noexcept;
+		link_type lower_bound_time(stamp_type time) noexcept;
+		link_type lower_bound_time(stamp_type time) const noexcept;
+		void prefetch_block(link_type link) const noexcept;
+		link_type next_live(link_type link) const noexcept;
+		template< bool Touch, typename F >
+		void for_each_live(F& f);
+		details::MappedHeader* get_mapped_header() const noexcept;
+		void store_header(link_type start, link_type end, stamp_type next_time, size_type size) noexcept;
+		void flush(link_type start, link_type end, stamp_type next_time, size_type size);
+
+	  private:
+		template< typename Construct >
+		link_type place(Construct&& construct);
+		void release_all(bool destroy_values) noexcept;
+		size_type ensure_capacity();
+		Block* allocate_block(size_type id, size_type capacity);
+		size_type next_block_capacity() const noexcept;
+		void free_block(Block* block, size_type id) noexcept;
+		void destroy_block(Block* block) noexcept;
+		bool rediscover_free_block();
+		void mark_dirty(size_type id) noexcept;
+		void release(size_type id) noexcept;
+		void vacate(link_type link) noexcept;
+		void clear_free_blocks() noexcept;
+		void push_free_block(size_type id) noexcept;
+		void remove_free_block(size_type id) noexcept;
+		void push_free_id(size_type id) noexcept;
+		size_type occupancy_bucket(size_type size, size_type capacity) const noexcept;
+		void move_occupancy(size_type from, size_type to, size_type capacity) noexcept;
+		void track_block(const Block* block) noexcept;
+		void untrack_block(const Block* block) noexcept;
+		std::pair< stamp_type, stamp_type > refresh_times(size_type id) noexcept;
+		std::pair< stamp_type, stamp_type > scan_times(size_type id) const noexcept;
+		template< typename Bounds >
+		link_type find_time(stamp_type time, Bounds& bounds) const noexcept;
+
+		// The block kept inside the container by inline_block; `id` is its entry in m_blocks, npos while unused.
+		struct InlineBlock
+		{
+			alignas(Block::alignment()) unsigned char bytes[Block::footprint(inline_capacity)];
+			size_type id = npos;
+		};
+
+		// Entry of the list of blocks with free slots, kept per block id next to m_blocks rather than in the block
+		// header: a copy_on_write block may be listed by several containers at once. For an unused id, `next` chains
+		// the ids free for reuse instead.
+		struct FreeLink
+		{
+			link_type prev;
+			link_type next;
+			bool listed;
+		};
+
+		details::small_vector_t< Block*, is_inline ? 1 : 0 > m_blocks;
+		details::small_vector_t< FreeLink, is_inline ? 1 : 0 > m_free_links;
+		link_type m_free_head;
+		link_type m_free_id;
+		size_type m_bucket_capacity;
+		size_type m_max_capacity;
+		size_type m_size;
+		size_type m_slots;
+		size_type m_block_bytes;
+		unsigned m_slot_bits;
+		link_type m_slot_mask;
+		details::small_vector_t< unsigned char, is_inline ? inline_capacity + 1 : 0 > m_occupancy_bucket;
+		std::array< size_type, occupancy_buckets > m_occupancy_histogram;
+		size_type m_free_block_entries;
+		[[no_unique_address]] Counters m_counters;
+		details::MappedFile* m_file;
+		size_type m_record_size;
+		size_type m_scan_cursor;
+		std::vector< unsigned char > m_dirty;
+		std::vector< size_type > m_dirty_ids;
+		[[no_unique_address]] std::conditional_t< is_inline, InlineBlock, details::NoInline > m_inline;
+	};
+
+	template< bool IsConst >
+	class BaseIterator
+	{
+	  public:
+		using iterator_category = std::bidirectional_iterator_tag;
+		using difference_type = std::ptrdiff_t;
+		using value_type = T;
+		using pointer = typename std::conditional< IsConst, const T*, T* >::type;
+		using reference = typename std::conditional< IsConst, const T&, T& >::type;
+
+		BaseIterator() noexcept;
+		BaseIterator(VirtualMemory* memory, link_type current);
+
+		reference operator*() const;
+		pointer operator->() const;
+		BaseIterator& operator++();
+		BaseIterator operator++(int);
+		BaseIterator& operator--();
+		BaseIterator operator--(int);
+		BaseIterator& advance_by(difference_type n);
+		template< bool OtherIsConst >
+		bool operator==(const BaseIterator< OtherIsConst >& other) const;
+		template< bool OtherIsConst >
+		bool operator!=(const BaseIterator< OtherIsConst >& other) const;
+		template< bool OtherIsConst >
+		bool operator>(const BaseIterator< OtherIsConst >& other) const;
+		template< bool OtherIsConst >
+		bool operator<(const BaseIterator< OtherIsConst >& other) const;
+		template< bool OtherIsConst >
+		bool operator>=(const BaseIterator< OtherIsConst >& other) const;
+		template< bool OtherIsConst >
+		bool operator<=(const BaseIterator< OtherIsConst >& other) const;
+
+		link_type get_current() const;
+		stamp_type get_time() const;
+
+	  private:
+		Element* element() const;
+		value_type* data() const;
+		void step(link_type next);
+
+		VirtualMemory* m_memory;
+		link_type m_current;
+		// Block of m_current, so steps inside one block skip the block table. Null at end() and with copy_on_write,
+		// where a write through another iterator may replace the block.
+		Block* m_block;
+	};
+
+	// Walks the same chain as BaseIterator, with a second cursor `distance` elements ahead whose Element and value
+	// are prefetched, so the loads for upcoming elements overlap with the work on the current one.
+	template< bool IsConst >
+	class BasePrefetchIterator
+	{
+	  public:
+		using iterator_category = std::forward_iterator_tag;
+		using difference_type = std::ptrdiff_t;
+		using value_type = T;
+		using pointer = typename std::conditional< IsConst, const T*, T* >::type;
+		using reference = typename std::conditional< IsConst, const T&, T& >::type;
+
+		BasePrefetchIterator(VirtualMemory* memory, link_type current, size_type distance) noexcept;
+
+		reference operator*() const;
+		pointer operator->() const;
+		BasePrefetchIterator& operator++();
+		BasePrefetchIterator operator++(int);
+		template< bool OtherIsConst >
+		bool operator==(const BaseIterator< OtherIsConst >& other) const;
+		template< bool OtherIsConst >
+		bool operator!=(const BaseIterator< OtherIsConst >& other) const;
+		template< bool OtherIsConst >
+		bool operator==(const BasePrefetchIterator< OtherIsConst >& other) const;
+		template< bool OtherIsConst >
+		bool operator!=(const BasePrefetchIterator< OtherIsConst >& other) const;
+
+		BaseIterator< IsConst > base() const;
+		link_type get_current() const;
+
+	  private:
+		VirtualMemory* m_memory;
+		link_type m_current;
+		link_type m_ahead;
+		size_type m_run;
+	};
+
+	template< bool IsConst >
+	struct PrefetchView
+	{
+		BasePrefetchIterator< IsConst > begin() const noexcept { return m_begin; }
+		BaseIterator< IsConst > end() const noexcept { return m_end; }
+
+		BasePrefetchIterator< IsConst > m_begin;
+		BaseIterator< IsConst > m_end;
+	};
+
+	// Visits live slots block by block in memory order; the order says nothing about insertion time.
+	template< bool IsConst >
+	class BaseUnorderedIterator
+	{
+	  public:
+		using iterator_category = std::forward_iterator_tag;
+		using difference_type = std::ptrdiff_t;
+		using value_type = T;
+		using pointer = typename std::conditional< IsConst, const T*, T* >::type;
+		using reference = typename std::conditional< IsConst, const T&, T& >::type;
+
+		BaseUnorderedIterator(VirtualMemory* memory, link_type current) noexcept;
+
+		reference operator*() const;
+		pointer operator->() const;
+		BaseUnorderedIterator& operator++();
+		BaseUnorderedIterator operator++(int);
+		template< bool OtherIsConst >
+		bool operator==(const BaseUnorderedIterator< OtherIsConst >& other) const;
+		template< bool OtherIsConst >
+		bool operator!=(const BaseUnorderedIterator< OtherIsConst >& other) const;
+
+		BaseIterator< IsConst > base() const;
+		link_type get_current() const;
+
+	  private:
+		VirtualMemory* m_memory;
+		link_type m_current;
+	};
+
+	// Walks the leaves of the ordered_by index in key order. Any insert or erase invalidates it.
+	template< bool IsConst >
+	class BaseOrderedIterator
+	{
+	  public:
+		using iterator_category = std::forward_iterator_tag;
+		using difference_type = std::ptrdiff_t;
+		using value_type = T;
+		using pointer = typename std::conditional< IsConst, const T*, T* >::type;
+		using reference = typename std::conditional< IsConst, const T&, T& >::type;
+
+		BaseOrderedIterator(VirtualMemory* memory, typename Order::Cursor cursor) noexcept;
+
+		reference operator*() const;
+		pointer operator->() const;
+		BaseOrderedIterator& operator++();
+		BaseOrderedIterator operator++(int);
+		template< bool OtherIsConst >
+		bool operator==(const BaseOrderedIterator< OtherIsConst >& other) const;
+		template< bool OtherIsConst >
+		bool operator!=(const BaseOrderedIterator< OtherIsConst >& other) const;
+
+		BaseIterator< IsConst > base() const;
+		link_type get_current() const;
+
+	  private:
+		template< bool >
+		friend class BaseOrderedIterator;
+
+		VirtualMemory* m_memory;
+		typename Order::Cursor m_cursor;
+	};
+
+	template< bool IsConst >
+	struct OrderedView
+	{
+		BaseOrderedIterator< IsConst > begin() const noexcept { return m_begin; }
+		BaseOrderedIterator< IsConst > end() const noexcept { return m_end; }
+
+		BaseOrderedIterator< IsConst > m_begin;
+		BaseOrderedIterator< IsConst > m_end;
+	};
+
+	// Storage for the two bookkeeping objects of an inline_block container; the pointers below then point here.
+	struct InlineMemory
+	{
+		alignas(PhysicalMemory) unsigned char physical[sizeof(PhysicalMemory)];
+		alignas(VirtualMemory) unsigned char virtual_memory[sizeof(VirtualMemory)];
+	};
+
+	[[no_unique_address]] std::conditional_t< is_inline, InlineMemory, details::NoInline > m_inline;
+	PhysicalMemory* m_physical_memory;
+	VirtualMemory* m_virtual_memory;
+	size_type m_bucket_size;
+	size_type m_bucket_capacity;
+	size_type m_size_limit;
+	[[no_unique_address]] Index m_index;
+	[[no_unique_address]] Order m_order;
+};
+
+// A read-only copy of a copy_on_write container as it was when snapshot() was called. It shares the blocks with the
+// container, and the writer clones a block before changing it, so readers scan without locks and never see a half
+// written block. Blocks the writer has moved past are freed when the last snapshot holding them goes away.
+template< typename T, typename... Options >
+class BucketStorage< T, Options... >::Snapshot
+{
+  public:
+	const_iterator begin() const noexcept { return m_storage.begin(); }
+	const_iterator end() const noexcept { return m_storage.end(); }
+	size_type size() const noexcept { return m_storage.size(); }
+	bool empty() const noexcept { return m_storage.empty(); }
+	const BucketStorage& operator*() const noexcept { return m_storage; }
+	const BucketStorage* operator->() const noexcept { return &m_storage; }
+
+  private:
+	friend class BucketStorage;
+
+	explicit Snapshot(const BucketStorage& storage) : m_storage(storage) {}
+
+	BucketStorage m_storage;
+};
+
+// Moves values from one producer thread to one consumer thread in whole blocks. The producer builds values in its
+// current block and publishes the block once it is full or on flush(); the consumer visits published blocks oldest
+// first and hands the drained blocks back for reuse. The threads meet only at the two block queues, never per value.
+template< typename T, typename... Options >
+class BlockHandoff
+{
+	typedef typename BucketStorage< T, Options... >::Block Block;
+
+  public:
+	using value_type = T;
+	using size_type = size_t;
+
+	explicit BlockHandoff(size_type m_block_capacity = 64, size_type queue_blocks = 64);
+	~BlockHandoff();
+
+	BlockHandoff(const BlockHandoff&) = delete;
+	BlockHandoff& operator=(const BlockHandoff&) = delete;
+
+	// Producer side.
+	void push(const value_type& x);
+	void push(value_type&& x);
+	void flush();
+
+	// Consumer side.
+	template< typename F >
+	size_type consume(F&& f);
+
+  private:
+	template< typename U >
+	void push_impl(U&& x);
+	void publish(Block* block);
+	void recycle(Block* block) noexcept;
+	static void destroy_values(Block* block, size_type from) noexcept;
+
+	static_assert(!details::has_option< file_backed, Options... >, "BlockHandoff does not take file_backed");
+
+	size_type m_block_capacity;
+	details::SpscRing< Block* > m_published;
+	details::SpscRing< Block* > m_returned;
+	// Producer only: the block being filled and full blocks that did not fit into m_published yet.
+	Block* m_current;
+	std::deque< Block* > m_backlog;
+	// Consumer only: a block left half visited by a throwing callback, and where to resume in it.
+	Block* m_reading;
+	size_type m_read_pos;
+};
+
+// !BucketStorage
+template< typename T, typename... Options >
+BucketStorage< T, Options... >::BucketStorage() noexcept :
+	m_physical_memory(make_physical_memory(default_block_capacity)), m_virtual_memory(make_virtual_memory()), m_bucket_size(0),
+	m_bucket_capacity(default_block_capacity), m_size_limit(0)
+{
+	static_assert(!is_file_backed, "a file-backed BucketStorage is opened with a path");
+}
+
+template< typename T, typename... Options >
+BucketStorage< T, Options... >::BucketStorage(size_type m_bucket_capacity) noexcept :
+	m_physical_memory(make_physical_memory(m_bucket_capacity)), m_virtual_memory(make_virtual_memory()),
+	m_bucket_size(0), m_bucket_capacity(m_bucket_capacity), m_size_limit(0)
+{
+	static_assert(!is_file_backed, "a file-backed BucketStorage is opened with a path");
+}
+
+// Holds at most `size_limit` values. Once full, an insert evicts the oldest value and builds the new one in its slot,
+// so blocks are recycled in place and the steady state allocates nothing.
+template< typename T, typename... Options >
+BucketStorage< T, Options... >::BucketStorage(size_type size_limit, evict_oldest_t, size_type m_bucket_capacity) :
+	BucketStorage(m_bucket_capacity)
+{
+	if (size_limit == 0)
+	{
+		throw std::invalid_argument("BucketStorage: size limit must be positive");
+	}
+	m_size_limit = size_limit;
+}
+
+// Opens the file at `path`, creating it if needed, and faults blocks in only when touched. The destructor flushes, so
+// a reopened container comes back as it was when the previous one was destroyed. A file left by a crash is refused
+// unless nothing changed after its last flush().
+template< typename T, typename... Options >
+BucketStorage< T, Options... >::BucketStorage(const char* path, size_type m_bucket_capacity, size_type max_file_bytes) :
+	m_physical_memory(new PhysicalMemory(m_bucket_capacity, path, max_file_bytes)),
+	m_virtual_memory(new VirtualMemory(m_physical_memory)), m_bucket_size(0), m_bucket_capacity(m_bucket_capacity),
+	m_size_limit(0)
+{
+	static_assert(is_file_backed, "only BucketStorage< T, file_backed > is opened with a path");
+	static_assert(!is_indexed, "indexed_by is not available for a file-backed BucketStorage");
+	static_assert(!is_ordered, "ordered_by is not available for a file-backed BucketStorage");
+
+	const details::MappedHeader* header = m_physical_memory->get_mapped_header();
+	m_virtual_memory->restore(static_cast< link_type >(header->start),
+							  static_cast< link_type >(header->end),
+							  static_cast< stamp_type >(header->next_time));
+	m_bucket_size = header->size;
+}
+
+template< typename T, typename... Options >
+BucketStorage< T, Options... >::BucketStorage(const BucketStorage& other) :
+	m_physical_memory(make_physical_memory(other.m_bucket_capacity)), m_virtual_memory(make_virtual_memory()),
+	m_bucket_size(0), m_bucket_capacity(other.m_bucket_capacity), m_size_limit(other.m_size_limit)
+{
+	static_assert(!is_file_backed, "a file-backed BucketStorage cannot be copied");
+	try
+	{
+		if constexpr (std::is_trivially_copyable_v< value_type >)
+		{
+			if constexpr (is_shared)
+				m_physical_memory->share(*other.m_physical_memory);
+			else
+				m_physical_memory->clone(*other.m_physical_memory);
+			m_virtual_memory->restore(other.m_virtual_memory->get_start(),
+									  other.m_virtual_memory->get_end(),
+									  other.m_virtual_memory->get_next_time());
+			m_bucket_size = other.m_bucket_size;
+			m_index = other.m_index;
+			m_order = other.m_order;
+		}
+		else
+		{
+			const_iterator temp = other.begin();
+			while (temp != other.end())
+			{
+				insert(*temp);
+				++temp;
+			}
+		}
+	} catch (...)
+	{
+		// The destructor does not run for a constructor that throws.
+		destroy_memory();
+		throw;
+	}
+}
+
+// Unlike the plain copy, keeps the slots, stamps and handles of `other` for every value_type and fills the blocks on
+// several threads.
+template< typename T, typename... Options >
+BucketStorage< T, Options... >::BucketStorage(const BucketStorage& other, parallel_t policy) :
+	m_physical_memory(make_physical_memory(other.m_bucket_capacity)), m_virtual_memory(make_virtual_memory()),
+	m_bucket_size(0), m_bucket_capacity(other.m_bucket_capacity), m_size_limit(other.m_size_limit)
+{
+	static_assert(!is_file_backed, "a file-backed BucketStorage cannot be copied");
+	try
+	{
+		if constexpr (is_shared)
+			m_physical_memory->share(*other.m_physical_memory);
+		else
+			m_physical_memory->clone(*other.m_physical_memory, policy.threads);
+		m_index = other.m_index;
+		m_order = other.m_order;
+	} catch (...)
+	{
+		// A throwing value copy is expected here, and the destructor does not run for a constructor that throws.
+		destroy_memory();
+		throw;
+	}
+	m_virtual_memory->restore(other.m_virtual_memory->get_start(),
+							  other.m_virtual_memory->get_end(),
+							  other.m_virtual_memory->get_next_time());
+	m_bucket_size = other.m_bucket_size;
+}
+
+template< typename T, typename... Options >
+BucketStorage< T, Options... >::BucketStorage(BucketStorage&& other) noexcept :
+	m_physical_memory(std::move(other.m_physical_memory)), m_virtual_memory(std::move(other.m_virtual_memory)),
+	m_bucket_size(other.m_bucket_size), m_bucket_capacity(other.m_bucket_capacity), m_size_limit(other.m_size_limit),
+	m_index(std::move(other.m_index)), m_order(std::move(other.m_order))
+{
+	if constexpr (is_inline)
+	{
+		m_physical_memory = new (m_inline.physical) PhysicalMemory(std::move(*other.m_physical_memory));
+		m_virtual_memory = make_virtual_memory();
+		m_virtual_memory->restore(other.m_virtual_memory->get_start(),
+								  other.m_virtual_memory->get_end(),
+								  other.m_virtual_memory->get_next_time());
+		other.m_virtual_memory->reset();
+	}
+	else
+	{
+		other.m_physical_memory = nullptr;
+		other.m_virtual_memory = nullptr;
+	}
+	other.m_bucket_size = 0;
+	other.m_bucket_capacity = 0;
+	other.m_size_limit = 0;
+	other.m_index = Index();
+	other.m_order = Order();
+}
+
+template< typename T, typename... Options >
+BucketStorage< T, Options... >::~BucketStorage()
+{
+	if constexpr (is_file_backed)
+	{
+		if (m_physical_memory != nullptr)
+		{
+			try
+			{
+				flush();
+			} catch (...)
+			{
+				// The header stays dirty, so the next open refuses the file instead of trusting unsynced blocks.
+			}
+		}
+	}
+	destroy_memory();
+}
+
+// The constructors run these before any other member is set up, so they only use m_inline and m_physical_memory.
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::PhysicalMemory* BucketStorage< T, Options... >::make_physical_memory(size_type capacity)
+{
+	if constexpr (is_inline)
+		return new (m_inline.physical) PhysicalMemory(capacity);
+	else
+		return new PhysicalMemory(capacity);
+}
+
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::VirtualMemory* BucketStorage< T, Options... >::make_virtual_memory()
+{
+	if constexpr (is_inline)
+		return new (m_inline.virtual_memory) VirtualMemory(m_physical_memory);
+	else
+	{
+		// Runs in the constructors' initializer lists, right after make_physical_memory(), where nothing else would free
+		// the physical memory.
+		try
+		{
+			return new VirtualMemory(m_physical_memory);
+		} catch (...)
+		{
+			delete m_physical_memory;
+			throw;
+		}
+	}
+}
+
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::destroy_memory() noexcept
+{
+	if constexpr (is_inline)
+	{
+		m_virtual_memory->~VirtualMemory();
+		m_physical_memory->~PhysicalMemory();
+	}
+	else
+	{
+		delete m_virtual_memory;
+		delete m_physical_memory;
+	}
+}
+
+template< typename T, typename... Options >
+BucketStorage< T, Options... >& BucketStorage< T, Options... >::operator=(BucketStorage&& other) noexcept
+{
+	if (this == &other)
+		return *this;
+
+	BucketStorage temp(std::move(other));
+	swap(temp);
+
+	return *this;
+}
+
+template< typename T, typename... Options >
+BucketStorage< T, Options... >& BucketStorage< T, Options... >::operator=(const BucketStorage& other)
+{
+	if (this != &other)
+	{
+		BucketStorage temp(other);
+		swap(temp);
+	}
+	return *this;
+}
+
+template< typename T, typename... Options >
+template< typename U >
+typename BucketStorage< T, Options... >::iterator BucketStorage< T, Options... >::insert_impl(U&& x)
+{
+	if (m_bucket_size == m_size_limit && m_size_limit != 0)
+	{
+		return replace_oldest(std::forward< U >(x));
+	}
+	link_type tag = 0;
+	if constexpr (is_indexed)
+	{
+		tag = index_tag(x);
+		m_index.reserve(m_bucket_size + 1);
+	}
+	if constexpr (is_ordered)
+	{
+		m_order.reserve();
+	}
+	m_virtual_memory->prepare_push();
+	link_type link = m_physical_memory->push(std::forward< U >(x));
+	m_virtual_memory->push(link);
+	m_bucket_size++;
+	if constexpr (is_indexed)
+	{
+		m_index.insert(tag, link);
+	}
+	if constexpr (is_ordered)
+	{
+		m_order.insert(order_key(*m_virtual_memory->get_data(link)), link);
+	}
+	return iterator(m_virtual_memory, link);
+}
+
+// The new value is built before the oldest one is touched, which also keeps `x` valid if it refers to that value.
+// Without a nothrow move the slot cannot be refilled safely, so the oldest value is erased the usual way.
+template< typename T, typename... Options >
+template< typename U >
+typename BucketStorage< T, Options... >::iterator BucketStorage< T, Options... >::replace_oldest(U&& x)
+{
+	value_type value(std::forward< U >(x));
+	link_type link = m_virtual_memory->get_start();
+	if constexpr (std::is_nothrow_move_constructible_v< value_type >)
+	{
+		if constexpr (is_ordered)
+		{
+			m_order.reserve();
+		}
+		m_virtual_memory->prepare_unlink(link);
+		m_virtual_memory->prepare_push();
+		if constexpr (is_indexed)
+		{
+			link_type tag = index_tag(value);
+			m_index.erase(index_tag(*m_virtual_memory->get_data(link)), link);
+			m_index.insert(tag, link);
+		}
+		if constexpr (is_ordered)
+		{
+			m_order.erase(order_key(*m_virtual_memory->get_data(link)), link);
+		}
+		m_virtual_memory->unlink(link);
+		m_physical_memory->replace(link, std::move(value));
+		m_virtual_memory->push(link);
+		if constexpr (is_ordered)
+		{
+			m_order.insert(order_key(*m_virtual_memory->get_data(link)), link);
+		}
+		return iterator(m_virtual_memory, link);
+	}
+	else
+	{
+		erase(iterator(m_virtual_memory, link));
+		return insert_impl(std::move(value));
+	}
+}
+
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::iterator BucketStorage< T, Options... >::insert(const value_type& x)
+{
+	return insert_impl(x);
+}
+
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::iterator BucketStorage< T, Options... >::insert(value_type&& x)
+{
+	return insert_impl(std::move(x));
+}
+
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::iterator BucketStorage< T, Options... >::begin() noexcept
+{
+	return iterator(m_virtual_memory, m_virtual_memory->get_start());
+}
+
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::iterator BucketStorage< T, Options... >::end() noexcept
+{
+	return iterator(m_virtual_memory, npos);
+}
+
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::const_iterator BucketStorage< T, Options... >::begin() const noexcept
+{
+	return const_iterator(m_virtual_memory, m_virtual_memory->get_start());
+}
+
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::const_iterator BucketStorage< T, Options... >::end() const noexcept
+{
+	return const_iterator(m_virtual_memory, npos);
+}
+
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::const_iterator BucketStorage< T, Options... >::cbegin() noexcept
+{
+	if (m_virtual_memory != nullptr)
+	{
+		return const_iterator(m_virtual_memory, m_virtual_memory->get_start());
+	}
+	return const_iterator(nullptr, npos);
+}
+
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::const_iterator BucketStorage< T, Options... >::cend() noexcept
+{
+	if (m_virtual_memory != nullptr)
+	{
+		return const_iterator(m_virtual_memory, npos);
+	}
+	return const_iterator(nullptr, npos);
+}
+
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::iterator BucketStorage< T, Options... >::erase(iterator iter)
+{
+	link_type link = iter.get_current();
+	if (link == npos)
+		return end();
+
+	m_virtual_memory->prepare_unlink(link);
+	if constexpr (is_indexed)
+	{
+		m_index.erase(index_tag(*m_virtual_memory->get_data(link)), link);
+	}
+	if constexpr (is_ordered)
+	{
+		m_order.erase(order_key(*m_virtual_memory->get_data(link)), link);
+	}
+	link_type next = m_virtual_memory->unlink(link);
+	m_physical_memory->pop(link);
+	m_bucket_size--;
+	return iterator(m_virtual_memory, next);
+}
+
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::iterator
+	BucketStorage< T, Options... >::get_to_distance(iterator it, const difference_type dist) noexcept
+{
+	return it.advance_by(dist);
+}
+
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::template PrefetchView< false > BucketStorage< T, Options... >::prefetched(size_type distance) noexcept
+{
+	return { prefetch_iterator(m_virtual_memory, m_virtual_memory->get_start(), distance), end() };
+}
+
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::template PrefetchView< true > BucketStorage< T, Options... >::prefetched(size_type distance) const noexcept
+{
+	return { const_prefetch_iterator(m_virtual_memory, m_virtual_memory->get_start(), distance), end() };
+}
+
+template< typename T, typename... Options >
+template< typename F >
+void BucketStorage< T, Options... >::for_each(F&& f, size_type distance)
+{
+	for_each_impl(*this, f, distance);
+}
+
+template< typename T, typename... Options >
+template< typename F >
+void BucketStorage< T, Options... >::for_each(F&& f, size_type distance) const
+{
+	for_each_impl(*this, f, distance);
+}
+
+// Same walk as BasePrefetchIterator without the per-step bookkeeping of an iterator object.
+template< typename T, typename... Options >
+template< typename Self, typename F >
+void BucketStorage< T, Options... >::for_each_impl(Self& self, F& f, size_type distance)
+{
+	const VirtualMemory* memory = self.m_virtual_memory;
+	link_type ahead = memory->get_start();
+	size_type run = 0;
+	for (size_type i = 0; i < distance && ahead != npos; ++i)
+	{
+		ahead = memory->prefetch_next(ahead, run);
+	}
+	for (link_type link = memory->get_start(); link != npos;)
+	{
+		if (ahead != npos)
+			ahead = memory->prefetch_next(ahead, run);
+		link_type next = memory->get_element(link)->get_next();
+		if constexpr (!std::is_const_v< Self >)
+			memory->touch(link);
+		f(*memory->get_data(link));
+		link = next;
+	}
+}
+
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::unordered_iterator BucketStorage< T, Options... >::unordered_begin() noexcept
+{
+	return unordered_iterator(m_virtual_memory, m_virtual_memory->next_live(0));
+}
+
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::unordered_iterator BucketStorage< T, Options... >::unordered_end() noexcept
+{
+	return unordered_iterator(m_virtual_memory, npos);
+}
+
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::const_unordered_iterator BucketStorage< T, Options... >::unordered_begin() const noexcept
+{
+	return const_unordered_iterator(m_virtual_memory, m_virtual_memory->next_live(0));
+}
+
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::const_unordered_iterator BucketStorage< T, Options... >::unordered_end() const noexcept
+{
+	return const_unordered_iterator(m_virtual_memory, npos);
+}
+
+template< typename T, typename... Options >
+template< typename F >
+void BucketStorage< T, Options... >::for_each_unordered(F&& f)
+{
+	m_physical_memory->template for_each_live< true >(f);
+}
+
+template< typename T, typename... Options >
+template< typename F >
+void BucketStorage< T, Options... >::for_each_unordered(F&& f) const
+{
+	auto visit = [&f](value_type& x) { f(std::as_const(x)); };
+	m_physical_memory->template for_each_live< false >(visit);
+}
+
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::MemoryStats BucketStorage< T, Options... >::memory_stats() const noexcept
+{
+	MemoryStats stats{};
+	m_physical_memory->fill_stats(stats);
+	if constexpr (is_indexed)
+	{
+		stats.index_bytes += m_index.memory_bytes();
+	}
+	if constexpr (is_ordered)
+	{
+		stats.index_bytes += m_order.memory_bytes();
+	}
+	stats.metadata_bytes += stats.index_bytes;
+	size_type slots = stats.slot_bytes / sizeof(value_type);
+	stats.fragmentation = slots == 0 ? 0.0 : static_cast< double >(slots - m_bucket_size) / static_cast< double >(slots);
+	return stats;
+}
+
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::HotPathStats BucketStorage< T, Options... >::hot_path_stats() const noexcept
+{
+	return m_physical_memory->get_counters().get();
+}
+
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::reset_hot_path_stats() noexcept
+{
+	m_physical_memory->get_counters().reset();
+}
+
+// Writes back only the blocks changed since the previous flush, then the header describing them.
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::flush()
+{
+	static_assert(is_file_backed, "flush() is only available for BucketStorage< T, file_backed >");
+	m_physical_memory->flush(m_virtual_memory->get_start(),
+							 m_virtual_memory->get_end(),
+							 m_virtual_memory->get_next_time(),
+							 m_bucket_size);
+}
+
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::save(std::ostream& out) const
+{
+	details::StreamSink sink(out);
+	save_impl(sink);
+}
+
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::save(int fd) const
+{
+	details::FdSink sink(fd);
+	save_impl(sink);
+	sink.flush();
+}
+
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::load(std::istream& in)
+{
+	details::StreamSource source(in);
+	load_impl(source);
+}
+
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::load(int fd)
+{
+	details::FdSource source(fd);
+	load_impl(source);
+	source.finish();
+}
+
+template< typename T, typename... Options >
+template< typename Sink >
+void BucketStorage< T, Options... >::save_impl(Sink& sink) const
+{
+	static_assert(std::is_trivially_copyable_v< value_type >, "BucketStorage snapshots need a trivially copyable value_type");
+	static_assert(!is_file_backed, "a file-backed BucketStorage is persisted with flush()");
+	static_assert(!is_geometric, "snapshots are not available with geometric_blocks");
+
+	details::SnapshotHeader header{};
+	std::memcpy(header.magic, details::snapshot_magic, sizeof(header.magic));
+	header.version = details::snapshot_version;
+	header.value_size = sizeof(value_type);
+	header.value_alignment = alignof(value_type);
+	header.link_size = sizeof(link_type);
+	header.block_capacity = m_bucket_capacity;
+	header.block_table_size = m_physical_memory->get_block_table_size();
+	header.blocks = m_physical_memory->size();
+	header.size = m_bucket_size;
+	header.start = m_virtual_memory->get_start();
+	header.end = m_virtual_memory->get_end();
+	header.next_time = m_virtual_memory->get_next_time();
+
+	// The checksum covers the header, with its checksum field still zero, and then every block record.
+	details::ChecksumSink checksum;
+	checksum.write(&header, sizeof(header));
+	m_physical_memory->save_blocks(checksum);
+	header.checksum = checksum.digest();
+
+	sink.write(&header, sizeof(header));
+	m_physical_memory->save_blocks(sink);
+}
+
+// The snapshot is loaded into a fresh container and swapped in, so a failed load leaves *this untouched.
+template< typename T, typename... Options >
+template< typename Source >
+void BucketStorage< T, Options... >::load_impl(Source& source)
+{
+	static_assert(std::is_trivially_copyable_v< value_type >, "BucketStorage snapshots need a trivially copyable value_type");
+	static_assert(!is_file_backed, "a file-backed BucketStorage is persisted with flush()");
+	static_assert(!is_geometric, "snapshots are not available with geometric_blocks");
+
+	details::SnapshotHeader header;
+	source.read(&header, sizeof(header));
+	if (std::memcmp(header.magic, details::snapshot_magic, sizeof(header.magic)) != 0 ||
+		header.version != details::snapshot_version)
+		throw std::runtime_error("BucketStorage: not a snapshot of a supported version");
+	if (header.value_size != sizeof(value_type) || header.value_alignment != alignof(value_type) ||
+		header.link_size != sizeof(link_type))
+		throw std::runtime_error("BucketStorage: snapshot was written for a different value or link type");
+	if (header.block_capacity == 0 || header.block_capacity > npos || header.blocks > header.block_table_size ||
+		header.size > header.blocks * header.block_capacity)
+		throw std::runtime_error("BucketStorage: snapshot header is corrupted");
+
+	BucketStorage temp(static_cast< size_type >(header.block_capacity));
+	details::ChecksumSource< Source > checked(source);
+	details::SnapshotHeader unsigned_header = header;
+	unsigned_header.checksum = 0;
+	checked.update(&unsigned_header, sizeof(unsigned_header));
+	temp.m_physical_memory->load_blocks(checked, header.block_table_size, header.blocks);
+	if (checked.digest() != header.checksum)
+		throw std::runtime_error("BucketStorage: snapshot checksum mismatch");
+	bool empty = header.size == 0;
+	if (header.start > npos || header.end > npos ||
+		(empty ? header.start != npos || header.end != npos
+			   : !temp.m_physical_memory->is_live(static_cast< link_type >(header.start)) ||
+					 !temp.m_physical_memory->is_live(static_cast< link_type >(header.end))))
+		throw std::runtime_error("BucketStorage: snapshot header is corrupted");
+
+	temp.m_virtual_memory->restore(static_cast< link_type >(header.start),
+								   static_cast< link_type >(header.end),
+								   static_cast< stamp_type >(header.next_time));
+	temp.m_bucket_size = header.size;
+	temp.rebuild_index();
+	temp.m_size_limit = m_size_limit;
+	temp.evict_over_limit();
+	swap(temp);
+}
+
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::size_type BucketStorage< T, Options... >::size() const noexcept
+{
+	return m_bucket_size;
+}
+
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::size_type BucketStorage< T, Options... >::capacity() const noexcept
+{
+	return m_physical_memory->slots();
+}
+
+template< typename T, typename... Options >
+bool BucketStorage< T, Options... >::empty() const noexcept
+{
+	return m_bucket_size == 0;
+}
+
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::clear() noexcept
+{
+	m_physical_memory->clear();
+	m_virtual_memory->reset();
+	m_bucket_size = 0;
+	if constexpr (is_indexed)
+	{
+		m_index.clear();
+	}
+	if constexpr (is_ordered)
+	{
+		m_order.clear();
+	}
+}
+
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::clear(parallel_t policy) noexcept
+{
+	m_physical_memory->clear(policy.threads);
+	m_virtual_memory->reset();
+	m_bucket_size = 0;
+	if constexpr (is_indexed)
+	{
+		m_index.clear();
+	}
+	if constexpr (is_ordered)
+	{
+		m_order.clear();
+	}
+}
+
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::shrink_to_fit()
+{
+	static_assert(!is_file_backed, "shrink_to_fit() is not available for a file-backed BucketStorage");
+	BucketStorage temp_bucket(m_bucket_capacity);
+	temp_bucket.m_size_limit = m_size_limit;
+	if constexpr (is_trivially_relocatable_v< value_type >)
+	{
+		// Until the swap the originals still belong to *this, so a failed relocation drops the copies unseen.
+		try
+		{
+			for (link_type link = m_virtual_memory->get_start(); link != npos; link = m_virtual_memory->get_element(link)->get_next())
+			{
+				temp_bucket.m_virtual_memory->push(temp_bucket.m_physical_memory->relocate(m_virtual_memory->get_data(link)));
+				++temp_bucket.m_bucket_size;
+			}
+			temp_bucket.rebuild_index();
+		} catch (...)
+		{
+			temp_bucket.m_physical_memory->release_relocated();
+			temp_bucket.m_virtual_memory->reset();
+			temp_bucket.m_bucket_size = 0;
+			throw;
+		}
+		m_physical_memory->release_relocated();
+		m_virtual_memory->reset();
+		m_bucket_size = 0;
+	}
+	else
+	{
+		iterator i = begin();
+		while (i != end())
+		{
+			temp_bucket.insert(std::move(*i));
+			i++;
+		}
+	}
+	swap(temp_bucket);
+}
+
+// Packs the values in the order of their old blocks rather than in insertion order, which lets every thread work on
+// its own range of blocks; the chain is rewritten to keep insertion order. Types that are not trivially relocatable
+// take the single-threaded path.
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::shrink_to_fit(parallel_t policy)
+{
+	static_assert(!is_file_backed, "shrink_to_fit() is not available for a file-backed BucketStorage");
+	if constexpr (!is_trivially_relocatable_v< value_type >)
+	{
+		shrink_to_fit();
+	}
+	else
+	{
+		BucketStorage temp_bucket(m_bucket_capacity);
+		temp_bucket.m_size_limit = m_size_limit;
+		try
+		{
+			link_type start = m_virtual_memory->get_start();
+			link_type end = m_virtual_memory->get_end();
+			temp_bucket.m_physical_memory->pack(*m_physical_memory, start, end, policy.threads);
+			temp_bucket.m_virtual_memory->restore(start, end, m_virtual_memory->get_next_time());
+			temp_bucket.m_bucket_size = m_bucket_size;
+			temp_bucket.rebuild_index();
+		} catch (...)
+		{
+			temp_bucket.m_physical_memory->release_relocated();
+			temp_bucket.m_virtual_memory->reset();
+			temp_bucket.m_bucket_size = 0;
+			throw;
+		}
+		m_physical_memory->release_relocated();
+		m_virtual_memory->reset();
+		m_bucket_size = 0;
+		swap(temp_bucket);
+	}
+}
+
+// Unlike shrink_to_fit(), moves elements one at a time into free slots of blocks that stay, so memory never grows on
+// the way. Only iterators to moved elements are invalidated.
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::size_type BucketStorage< T, Options... >::trim(size_type target_bytes, std::chrono::nanoseconds budget)
+{
+	static_assert(!is_file_backed, "trim() is not available for a file-backed BucketStorage");
+	size_type before = m_physical_memory->footprint_bytes();
+	if constexpr (!is_shared)
+	{
+		// Shared blocks are not freed by moving their elements out, and writing to a shared block copies it first.
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		auto stop = [&] { return std::chrono::steady_clock::now() - start >= budget; };
+		auto move = [this](link_type link) { move_element(link); };
+		m_physical_memory->compact(m_physical_memory->slots() - m_bucket_size, target_bytes, move, stop);
+	}
+	m_physical_memory->release_slack();
+	size_type after = m_physical_memory->footprint_bytes();
+	return before > after ? before - after : 0;
+}
+
+// Moves one element into another block; its place in the insertion order, its stamp and its index entries follow.
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::move_element(link_type link)
+{
+	link_type tag = 0;
+	if constexpr (is_indexed)
+	{
+		tag = index_tag(*m_virtual_memory->get_data(link));
+	}
+	if constexpr (is_ordered)
+	{
+		m_order.reserve();
+	}
+	link_type moved = m_physical_memory->transfer(link);
+	m_virtual_memory->relink(link, moved);
+	if constexpr (is_indexed)
+	{
+		m_index.erase(tag, link);
+		m_index.insert(tag, moved);
+	}
+	if constexpr (is_ordered)
+	{
+		m_order.erase(order_key(*m_virtual_memory->get_data(moved)), link);
+		m_order.insert(order_key(*m_virtual_memory->get_data(moved)), moved);
+	}
+	m_physical_memory->release_transferred(link);
+}
+
+// Equal block capacities let the blocks of `other` be taken over as they are: values stay where they are and only
+// the links and stamps in their Elements are shifted. Otherwise the values are moved over one by one.
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::splice(BucketStorage&& other)
+{
+	static_assert(!is_file_backed, "splice() is not available for a file-backed BucketStorage");
+	if (this == &other)
+		return;
+	if (other.m_bucket_capacity != m_bucket_capacity)
+	{
+		for (iterator i = other.begin(); i != other.end(); ++i)
+		{
+			insert(std::move(*i));
+		}
+		other.clear();
+		return;
+	}
+
+	// adopt() rewrites every Element of `other`, append() the tail of *this.
+	other.m_physical_memory->spill_inline();
+	other.m_physical_memory->own_all();
+	m_physical_memory->own(m_virtual_memory->get_end());
+	stamp_type time_offset = m_virtual_memory->get_next_time() - 1;
+	if (other.m_virtual_memory->get_next_time() > std::numeric_limits< stamp_type >::max() - time_offset)
+	{
+		m_physical_memory->own_all();
+		m_virtual_memory->restamp();
+		other.m_virtual_memory->restamp();
+		time_offset = m_virtual_memory->get_next_time() - 1;
+	}
+	if constexpr (is_indexed)
+	{
+		m_index.reserve(m_bucket_size + other.m_bucket_size);
+	}
+	Order order;
+	if constexpr (is_ordered)
+	{
+		order = m_order.merged(other.m_order,
+							   static_cast< link_type >(m_physical_memory->get_block_table_size() << m_physical_memory->get_slot_bits()));
+	}
+	link_type link_offset = m_physical_memory->adopt(*other.m_physical_memory, time_offset);
+	if constexpr (is_indexed)
+	{
+		other.m_index.for_each([&](link_type tag, link_type link) { m_index.insert(tag, link + link_offset); });
+		other.m_index.clear();
+	}
+	if constexpr (is_ordered)
+	{
+		m_order.swap(order);
+		other.m_order.clear();
+	}
+	if (other.m_bucket_size != 0)
+	{
+		m_virtual_memory->append(other.m_virtual_memory->get_start() + link_offset,
+								 other.m_virtual_memory->get_end() + link_offset,
+								 other.m_virtual_memory->get_next_time() + time_offset);
+	}
+	m_bucket_size += other.m_bucket_size;
+	other.m_virtual_memory->reset();
+	other.m_bucket_size = 0;
+	evict_over_limit();
+}
+
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::size_type BucketStorage< T, Options... >::size_limit() const noexcept
+{
+	return m_size_limit;
+}
+
+template< typename T, typename... Options >
+template< typename K >
+typename BucketStorage< T, Options... >::iterator BucketStorage< T, Options... >::find(const K& key)
+{
+	return iterator(m_virtual_memory, find_link(key));
+}
+
+template< typename T, typename... Options >
+template< typename K >
+typename BucketStorage< T, Options... >::const_iterator BucketStorage< T, Options... >::find(const K& key) const
+{
+	return const_iterator(m_virtual_memory, find_link(key));
+}
+
+// Among values with equal keys the oldest surviving one is found. Keys the hasher cannot take directly are converted
+// to the key type first.
+template< typename T, typename... Options >
+template< typename K >
+typename BucketStorage< T, Options... >::link_type BucketStorage< T, Options... >::find_link(const K& key) const
+{
+	static_assert(is_indexed, "find() needs BucketStorage< T, indexed_by< KeyFn > >");
+	using traits = details::IndexTraits< index_policy, value_type >;
+	if constexpr (traits::is_transparent || std::is_same_v< K, typename traits::key_type >)
+	{
+		link_type tag = Index::mix(typename traits::hasher{}(key));
+		return m_index.find(tag,
+							[&](link_type link)
+							{ return typename traits::key_equal{}(typename traits::key_fn{}(*m_virtual_memory->get_data(link)), key); });
+	}
+	else
+	{
+		return find_link(typename traits::key_type(key));
+	}
+}
+
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::link_type BucketStorage< T, Options... >::index_tag(const value_type& x) const
+{
+	using traits = details::IndexTraits< index_policy, value_type >;
+	return Index::mix(typename traits::hasher{}(typename traits::key_fn{}(x)));
+}
+
+template< typename T, typename... Options >
+decltype(auto) BucketStorage< T, Options... >::order_key(const value_type& x) const
+{
+	return typename order_policy::key_fn{}(x);
+}
+
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::rebuild_index()
+{
+	if constexpr (is_indexed)
+	{
+		m_index = Index();
+		m_index.reserve(m_bucket_size);
+		for (link_type link = m_virtual_memory->get_start(); link != npos; link = m_virtual_memory->get_element(link)->get_next())
+		{
+			m_index.insert(index_tag(*m_virtual_memory->get_data(link)), link);
+		}
+	}
+	if constexpr (is_ordered)
+	{
+		using key_type = typename Order::key_type;
+		std::vector< std::pair< key_type, link_type > > entries;
+		entries.reserve(m_bucket_size);
+		for (link_type link = m_virtual_memory->get_start(); link != npos; link = m_virtual_memory->get_element(link)->get_next())
+		{
+			entries.emplace_back(order_key(*m_virtual_memory->get_data(link)), link);
+		}
+		std::sort(entries.begin(),
+				  entries.end(),
+				  [](const std::pair< key_type, link_type >& a, const std::pair< key_type, link_type >& b)
+				  {
+					  using compare = typename order_policy::key_compare;
+					  if (compare{}(a.first, b.first))
+						  return true;
+					  return !compare{}(b.first, a.first) && a.second < b.second;
+				  });
+		m_order.assign(entries);
+	}
+}
+
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::evict_over_limit()
+{
+	while (m_size_limit != 0 && m_bucket_size > m_size_limit)
+	{
+		erase(begin());
+	}
+}
+
+// Values whose key lies in [lo, hi), in key order; values with equal keys come in no particular order.
+template< typename T, typename... Options >
+template< typename K >
+typename BucketStorage< T, Options... >::template OrderedView< false > BucketStorage< T, Options... >::range(const K& lo, const K& hi)
+{
+	static_assert(is_ordered, "range() needs BucketStorage< T, ordered_by< KeyFn > >");
+	ordered_iterator first(m_virtual_memory, m_order.lower_bound(lo));
+	if (!typename order_policy::key_compare{}(lo, hi))
+		return { first, first };
+	return { first, ordered_iterator(m_virtual_memory, m_order.lower_bound(hi)) };
+}
+
+template< typename T, typename... Options >
+template< typename K >
+typename BucketStorage< T, Options... >::template OrderedView< true >
+	BucketStorage< T, Options... >::range(const K& lo, const K& hi) const
+{
+	static_assert(is_ordered, "range() needs BucketStorage< T, ordered_by< KeyFn > >");
+	const_ordered_iterator first(m_virtual_memory, m_order.lower_bound(lo));
+	if (!typename order_policy::key_compare{}(lo, hi))
+		return { first, first };
+	return { first, const_ordered_iterator(m_virtual_memory, m_order.lower_bound(hi)) };
+}
+
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::template OrderedView< false > BucketStorage< T, Options... >::ordered() noexcept
+{
+	static_assert(is_ordered, "ordered() needs BucketStorage< T, ordered_by< KeyFn > >");
+	return { ordered_iterator(m_virtual_memory, m_order.begin()), ordered_iterator(m_virtual_memory, m_order.end()) };
+}
+
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::template OrderedView< true > BucketStorage< T, Options... >::ordered() const noexcept
+{
+	static_assert(is_ordered, "ordered() needs BucketStorage< T, ordered_by< KeyFn > >");
+	return { const_ordered_iterator(m_virtual_memory, m_order.begin()), const_ordered_iterator(m_virtual_memory, m_order.end()) };
+}
+
+// The value of rank n in key order, or end(); O(log size()) through the subtree counts of the index.
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::iterator BucketStorage< T, Options... >::nth_by_key(size_type n) noexcept
+{
+	static_assert(is_ordered, "nth_by_key() needs BucketStorage< T, ordered_by< KeyFn > >");
+	return ordered_iterator(m_virtual_memory, m_order.nth(n)).base();
+}
+
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::const_iterator BucketStorage< T, Options... >::nth_by_key(size_type n) const noexcept
+{
+	static_assert(is_ordered, "nth_by_key() needs BucketStorage< T, ordered_by< KeyFn > >");
+	return const_ordered_iterator(m_virtual_memory, m_order.nth(n)).base();
+}
+
+// Part k gets a contiguous range of block ids holding about size() / n live values, so *this is left empty and no
+// value moves. The elements of a part keep their relative insertion order and stamps; their links are renumbered
+// to the part's own block ids in a single walk of the list.
+template< typename T, typename... Options >
+std::vector< BucketStorage< T, Options... > > BucketStorage< T, Options... >::split(size_type n)
+{
+	static_assert(!is_file_backed, "split() is not available for a file-backed BucketStorage");
+	if (n == 0)
+	{
+		throw std::invalid_argument("BucketStorage: split() needs at least one part");
+	}
+	m_physical_memory->own_all();
+	m_physical_memory->spill_inline();
+
+	size_type table_size = m_physical_memory->get_block_table_size();
+	unsigned slot_bits = m_physical_memory->get_slot_bits();
+	std::vector< size_type > bounds(n + 1, table_size);
+	bounds[0] = 0;
+	size_type part = 1;
+	size_type seen = 0;
+	for (size_type id = 0; id < table_size; ++id)
+	{
+		while (part < n && seen * n >= m_bucket_size * part)
+		{
+			bounds[part++] = id;
+		}
+		Block* block = m_physical_memory->get_block(static_cast< link_type >(id << slot_bits));
+		seen += block == nullptr ? 0 : block->m_size;
+	}
+
+	std::vector< BucketStorage > parts;
+	parts.reserve(n);
+	std::vector< link_type > heads(n, npos);
+	std::vector< link_type > tails(n, npos);
+	std::vector< size_type > sizes(n, 0);
+	auto part_of = [&](link_type link)
+	{ return static_cast< size_type >(std::upper_bound(bounds.begin() + 1, bounds.end(), size_type(link >> slot_bits)) - (bounds.begin() + 1)); };
+	try
+	{
+		for (size_type k = 0; k < n; ++k)
+		{
+			parts.emplace_back(m_bucket_capacity);
+			parts.back().m_physical_memory->take_blocks(*m_physical_memory, bounds[k], bounds[k + 1]);
+		}
+		if constexpr (is_indexed)
+		{
+			m_index.for_each([&](link_type, link_type link) { ++sizes[part_of(link)]; });
+			for (size_type k = 0; k < n; ++k)
+			{
+				parts[k].m_index.reserve(sizes[k]);
+				sizes[k] = 0;
+			}
+		}
+		if constexpr (is_ordered)
+		{
+			std::vector< std::vector< std::pair< typename Order::key_type, link_type > > > entries(n);
+			m_order.for_each(
+				[&](const typename Order::key_type& key, link_type link)
+				{
+					size_type k = part_of(link);
+					entries[k].emplace_back(key, static_cast< link_type >(link - (bounds[k] << slot_bits)));
+				});
+			for (size_type k = 0; k < n; ++k)
+			{
+				parts[k].m_order.assign(entries[k]);
+			}
+		}
+	} catch (...)
+	{
+		for (BucketStorage& p : parts)
+		{
+			p.m_physical_memory->forget_blocks();
+		}
+		throw;
+	}
+
+	for (link_type link = m_virtual_memory->get_start(); link != npos;)
+	{
+		Element* el = m_physical_memory->get_element(link);
+		link_type next = el->get_next();
+		size_type k = part_of(link);
+		link_type local = static_cast< link_type >(link - (bounds[k] << slot_bits));
+		el->set_prev(tails[k]);
+		el->set_next(npos);
+		if (tails[k] == npos)
+			heads[k] = local;
+		else
+			parts[k].m_physical_memory->get_element(tails[k])->set_next(local);
+		tails[k] = local;
+		++sizes[k];
+		link = next;
+	}
+	for (size_type k = 0; k < n; ++k)
+	{
+		parts[k].m_virtual_memory->restore(heads[k], tails[k], m_virtual_memory->get_next_time());
+		parts[k].m_bucket_size = sizes[k];
+	}
+
+	if constexpr (is_indexed)
+	{
+		m_index.for_each(
+			[&](link_type tag, link_type link)
+			{
+				size_type k = part_of(link);
+				parts[k].m_index.insert(tag, static_cast< link_type >(link - (bounds[k] << slot_bits)));
+			});
+		m_index.clear();
+	}
+	if constexpr (is_ordered)
+	{
+		m_order.clear();
+	}
+	m_physical_memory->forget_blocks();
+	m_virtual_memory->reset();
+	m_bucket_size = 0;
+	return parts;
+}
+
+// Taken on the writer's thread; the result may then be handed to one reader thread. Costs one block table copy.
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::Snapshot BucketStorage< T, Options... >::snapshot() const
+{
+	static_assert(is_shared, "snapshot() needs BucketStorage< T, copy_on_write >");
+	return Snapshot(*this);
+}
+
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::iterator BucketStorage< T, Options... >::lower_bound_time(stamp_type time) noexcept
+{
+	return iterator(m_virtual_memory, m_physical_memory->lower_bound_time(time));
+}
+
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::const_iterator BucketStorage< T, Options... >::lower_bound_time(stamp_type time) const noexcept
+{
+	return const_iterator(m_virtual_memory, static_cast< const PhysicalMemory* >(m_physical_memory)->lower_bound_time(time));
+}
+
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::iterator BucketStorage< T, Options... >::upper_bound_time(stamp_type time) noexcept
+{
+	if (time == std::numeric_limits< stamp_type >::max())
+		return end();
+	return lower_bound_time(time + 1);
+}
+
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::const_iterator BucketStorage< T, Options... >::upper_bound_time(stamp_type time) const noexcept
+{
+	if (time == std::numeric_limits< stamp_type >::max())
+		return end();
+	return lower_bound_time(time + 1);
+}
+
+// Elements stamped in [first, last).
+template< typename T, typename... Options >
+std::pair< typename BucketStorage< T, Options... >::iterator, typename BucketStorage< T, Options... >::iterator >
+	BucketStorage< T, Options... >::range_by_time(stamp_type first, stamp_type last) noexcept
+{
+	iterator from = lower_bound_time(first);
+	return { from, last <= first ? from : lower_bound_time(last) };
+}
+
+template< typename T, typename... Options >
+std::pair< typename BucketStorage< T, Options... >::const_iterator, typename BucketStorage< T, Options... >::const_iterator >
+	BucketStorage< T, Options... >::range_by_time(stamp_type first, stamp_type last) const noexcept
+{
+	const_iterator from = lower_bound_time(first);
+	return { from, last <= first ? from : lower_bound_time(last) };
+}
+
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::swap(BucketStorage& other) noexcept
+{
+	using std::swap;
+	if constexpr (is_inline)
+	{
+		m_physical_memory->swap(*other.m_physical_memory);
+		link_type start = m_virtual_memory->get_start();
+		link_type end = m_virtual_memory->get_end();
+		stamp_type next_time = m_virtual_memory->get_next_time();
+		m_virtual_memory->restore(other.m_virtual_memory->get_start(),
+								  other.m_virtual_memory->get_end(),
+								  other.m_virtual_memory->get_next_time());
+		other.m_virtual_memory->restore(start, end, next_time);
+	}
+	else
+	{
+		swap(m_virtual_memory, other.m_virtual_memory);
+		swap(m_physical_memory, other.m_physical_memory);
+	}
+	swap(m_bucket_capacity, other.m_bucket_capacity);
+	swap(m_bucket_size, other.m_bucket_size);
+	swap(m_size_limit, other.m_size_limit);
+	swap(m_index, other.m_index);
+	swap(m_order, other.m_order);
+}
+
+//  !VirtualMemory
+template< typename T, typename... Options >
+BucketStorage< T, Options... >::VirtualMemory::VirtualMemory(PhysicalMemory* physical_memory) noexcept :
+	m_physical_memory(physical_memory)
+{
+	reset();
+}
+
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::VirtualMemory::push(link_type link)
+{
+	if (m_over_end.get_time() == std::numeric_limits< stamp_type >::max())
+	{
+		restamp();
+	}
+
+	Element* el = m_physical_memory->get_element(link);
+	el->set_prev(m_end);
+	el->set_next(npos);
+	el->set_time(m_over_end.get_time());
+	m_physical_memory->record_time(link, m_over_end.get_time());
+	if (m_end == npos)
+	{
+		m_start = link;
+	}
+	else
+	{
+		m_physical_memory->get_element(m_end)->set_next(link);
+		m_physical_memory->touch(m_end);
+	}
+	m_end = link;
+	m_over_end.set_prev(m_end);
+	m_over_end.set_time(m_over_end.get_time() + 1);
+}
+
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::link_type BucketStorage< T, Options... >::VirtualMemory::unlink(link_type link)
+{
+	Element* el = m_physical_memory->get_element(link);
+	link_type prev = el->get_prev();
+	link_type next = el->get_next();
+
+	if (prev != npos)
+	{
+		m_physical_memory->get_element(prev)->set_next(next);
+		m_physical_memory->touch(prev);
+	}
+	else
+		m_start = next;
+
+	if (next != npos)
+	{
+		m_physical_memory->get_element(next)->set_prev(prev);
+		m_physical_memory->touch(next);
+	}
+	else
+	{
+		m_end = prev;
+		m_over_end.set_prev(prev);
+	}
+	return next;
+}
+
+// Puts the slot at `to` in the place of the one at `from` in the chain, with the same stamp.
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::VirtualMemory::relink(link_type from, link_type to) noexcept
+{
+	Element* source = m_physical_memory->get_element(from);
+	Element* el = m_physical_memory->get_element(to);
+	link_type prev = source->get_prev();
+	link_type next = source->get_next();
+	el->set_prev(prev);
+	el->set_next(next);
+	el->set_time(source->get_time());
+	m_physical_memory->merge_time(to, source->get_time());
+
+	if (prev != npos)
+	{
+		m_physical_memory->get_element(prev)->set_next(to);
+		m_physical_memory->touch(prev);
+	}
+	else
+		m_start = to;
+
+	if (next != npos)
+	{
+		m_physical_memory->get_element(next)->set_prev(to);
+		m_physical_memory->touch(next);
+	}
+	else
+	{
+		m_end = to;
+		m_over_end.set_prev(to);
+	}
+}
+
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::VirtualMemory::reset() noexcept
+{
+	m_start = npos;
+	m_end = npos;
+	m_over_end.set_next(npos);
+	m_over_end.set_prev(npos);
+	m_over_end.set_time(1);
+}
+
+// Stamp 0 marks a free slot, so live stamps are renumbered from 1 once the counter runs out.
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::VirtualMemory::restamp() noexcept
+{
+	stamp_type time = 1;
+	for (link_type link = m_start; link != npos;)
+	{
+		Element* el = m_physical_memory->get_element(link);
+		el->set_time(time++);
+		m_physical_memory->touch(link);
+		link = el->get_next();
+	}
+	m_over_end.set_time(time);
+	m_physical_memory->forget_times();
+}
+
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::VirtualMemory::restore(link_type start, link_type end, stamp_type next_time) noexcept
+{
+	m_start = start;
+	m_end = end;
+	m_over_end.set_prev(end);
+	m_over_end.set_time(next_time);
+}
+
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::VirtualMemory::append(link_type start, link_type end, stamp_type next_time) noexcept
+{
+	if (m_end == npos)
+	{
+		m_start = start;
+	}
+	else
+	{
+		m_physical_memory->get_element(m_end)->set_next(start);
+		m_physical_memory->get_element(start)->set_prev(m_end);
+	}
+	m_end = end;
+	m_over_end.set_prev(end);
+	m_over_end.set_time(next_time);
+}
+
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::stamp_type BucketStorage< T, Options... >::VirtualMemory::get_next_time() const noexcept
+{
+	return m_over_end.get_time();
+}
+
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::link_type BucketStorage< T, Options... >::VirtualMemory::get_start() const noexcept
+{
+	return m_start;
+}
+
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::link_type BucketStorage< T, Options... >::VirtualMemory::get_end() const noexcept
+{
+	return m_end;
+}
+
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::Element* BucketStorage< T, Options... >::VirtualMemory::get_element(link_type link) const
+{
+	if (link == npos)
+	{
+		return &m_over_end;
+	}
+	return m_physical_memory->get_element(link);
+}
+
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::value_type* BucketStorage< T, Options... >::VirtualMemory::get_data(link_type link) const
+{
+	return m_physical_memory->get_data(link);
+}
+
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::Block* BucketStorage< T, Options... >::VirtualMemory::get_block(link_type link) const noexcept
+{
+	if (link == npos)
+	{
+		return nullptr;
+	}
+	return m_physical_memory->get_block(link);
+}
+
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::link_type BucketStorage< T, Options... >::VirtualMemory::get_slot_mask() const noexcept
+{
+	return m_physical_memory->get_slot_mask();
+}
+
+// Called before a value is handed out for writing.
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::VirtualMemory::touch(link_type link) const
+{
+	m_physical_memory->own(link);
+	m_physical_memory->touch(link);
+}
+
+// Owns the blocks push() writes to besides the new value's own: the tail's, or all of them if a restamp is due.
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::VirtualMemory::prepare_push()
+{
+	if constexpr (is_shared)
+	{
+		if (m_over_end.get_time() == std::numeric_limits< stamp_type >::max())
+			m_physical_memory->own_all();
+		else
+			m_physical_memory->own(m_end);
+	}
+}
+
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::VirtualMemory::prepare_unlink(link_type link)
+{
+	if constexpr (is_shared)
+	{
+		Element* el = m_physical_memory->get_element(link);
+		link_type prev = el->get_prev();
+		link_type next = el->get_next();
+		m_physical_memory->own(link);
+		m_physical_memory->own(prev);
+		m_physical_memory->own(next);
+	}
+}
+
+// Prefetches the element after `link`. `run` counts how many steps the walk has stayed inside one block; only a walk
+// that has been doing so gets the whole next block prefetched, one that hops between blocks gets single elements.
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::link_type
+	BucketStorage< T, Options... >::VirtualMemory::prefetch_next(link_type link, size_type& run) const noexcept
+{
+	constexpr size_type whole_block_run = 4;
+	link_type next = m_physical_memory->get_element(link)->get_next();
+	if (next == npos)
+		return next;
+	if (m_physical_memory->get_block(next) == m_physical_memory->get_block(link))
+	{
+		++run;
+	}
+	else if (run >= whole_block_run)
+	{
+		run = 0;
+		m_physical_memory->prefetch_block(next);
+		return next;
+	}
+	else
+	{
+		run = 0;
+	}
+	details::prefetch(m_physical_memory->get_element(next));
+	details::prefetch(m_physical_memory->get_data(next));
+	return next;
+}
+
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::link_type BucketStorage< T, Options... >::VirtualMemory::next_live(link_type link) const noexcept
+{
+	return m_physical_memory->next_live(link);
+}
+
+// !PhysicalMemory
+template< typename T, typename... Options >
+BucketStorage< T, Options... >::PhysicalMemory::PhysicalMemory(size_type m_bucket_capacity) :
+	m_free_head(npos), m_free_id(npos), m_bucket_capacity(m_bucket_capacity), m_max_capacity(std::max(m_bucket_capacity, max_block_capacity)), m_size(0),
+	m_slots(0), m_block_bytes(0), m_slot_bits(0), m_occupancy_bucket(is_geometric ? 0 : m_bucket_capacity + 1),
+	m_occupancy_histogram{}, m_free_block_entries(0), m_file(nullptr), m_record_size(0), m_scan_cursor(0)
+{
+	while ((size_type(1) << m_slot_bits) < m_max_capacity)
+	{
+		++m_slot_bits;
+	}
+	m_slot_mask = static_cast< link_type >((size_type(1) << m_slot_bits) - 1);
+
+	if constexpr (is_geometric)
+		return;
+	for (size_type size = 1; size < m_bucket_capacity; ++size)
+	{
+		m_occupancy_bucket[size] = static_cast< unsigned char >(1 + (size * (occupancy_buckets - 2) - 1) / m_bucket_capacity);
+	}
+	m_occupancy_bucket[m_bucket_capacity] = occupancy_buckets - 1;
+}
+
+// Reopening only validates the header and computes block addresses; no block page is read here.
+template< typename T, typename... Options >
+BucketStorage< T, Options... >::PhysicalMemory::PhysicalMemory(size_type m_bucket_capacity, const char* path, size_type max_file_bytes) :
+	PhysicalMemory(m_bucket_capacity)
+{
+	static_assert(Block::alignment() <= details::mapped_header_bytes, "value_type is over-aligned for a file-backed BucketStorage");
+	static_assert(occupancy_buckets == sizeof(details::MappedHeader::occupancy_histogram) / sizeof(std::uint64_t));
+
+	m_file = new details::MappedFile(path, max_file_bytes);
+	m_record_size = details::align_up(Block::footprint(m_bucket_capacity), Block::alignment());
+
+	if (m_file->size() == 0)
+	{
+		m_file->grow(details::mapped_header_bytes);
+		details::MappedHeader* header = get_mapped_header();
+		std::memcpy(header->magic, details::mapped_magic, sizeof(header->magic));
+		header->version = details::mapped_version;
+		header->value_size = sizeof(value_type);
+		header->value_alignment = alignof(value_type);
+		header->link_size = sizeof(link_type);
+		header->block_capacity = m_bucket_capacity;
+		header->record_size = m_record_size;
+		store_header(npos, npos, 1, 0);
+		return;
+	}
+
+	const details::MappedHeader* header = get_mapped_header();
+	if (m_file->size() < details::mapped_header_bytes || std::memcmp(header->magic, details::mapped_magic, sizeof(header->magic)) != 0 ||
+		header->version != details::mapped_version)
+		throw std::runtime_error("BucketStorage: backing file is not a file-backed BucketStorage of a supported version");
+	if (header->value_size != sizeof(value_type) || header->value_alignment != alignof(value_type) ||
+		header->link_size != sizeof(link_type) || header->block_capacity != m_bucket_capacity || header->record_size != m_record_size)
+		throw std::runtime_error("BucketStorage: backing file was written for a different value type, link type or block capacity");
+	if (header->clean == 0)
+		throw std::runtime_error("BucketStorage: backing file was modified after its last flush and not closed");
+	if (header->block_table_size > (npos >> m_slot_bits) || header->blocks > header->block_table_size ||
+		header->size > header->blocks * m_bucket_capacity ||
+		(m_file->size() - details::mapped_header_bytes) / m_record_size < header->block_table_size)
+		throw std::runtime_error("BucketStorage: backing file header is corrupted");
+
+	size_type table_size = header->block_table_size;
+	m_blocks.resize(table_size);
+	m_free_links.assign(table_size, FreeLink{ npos, npos, false });
+	for (size_type id = 0; id < table_size; ++id)
+	{
+		m_blocks[id] = reinterpret_cast< Block* >(m_file->data() + details::mapped_header_bytes + id * m_record_size);
+	}
+	m_dirty.assign(table_size, 0);
+	m_dirty_ids.reserve(table_size);
+	m_size = header->blocks;
+	m_slots = m_size * m_bucket_capacity;
+	m_block_bytes = m_size * Block::footprint(m_bucket_capacity);
+	std::copy(std::begin(header->occupancy_histogram), std::end(header->occupancy_histogram), m_occupancy_histogram.begin());
+	m_scan_cursor = m_size == table_size && m_occupancy_histogram.back() == m_size ? table_size : 0;
+}
+
+// Only inline containers move their PhysicalMemory; the source is left with an empty table.
+template< typename T, typename... Options >
+BucketStorage< T, Options... >::PhysicalMemory::PhysicalMemory(PhysicalMemory&& other) noexcept :
+	m_free_head(npos), m_free_id(npos), m_bucket_capacity(0), m_max_capacity(0), m_size(0), m_slots(0), m_block_bytes(0), m_slot_bits(0), m_slot_mask(0),
+	m_occupancy_histogram{}, m_free_block_entries(0), m_file(nullptr), m_record_size(0), m_scan_cursor(0)
+{
+	static_assert(is_inline, "only an inline_block BucketStorage moves its PhysicalMemory");
+	swap(other);
+}
+
+// Swaps the inline blocks byte for byte and points each table back at the inline block it now owns.
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::PhysicalMemory::swap(PhysicalMemory& other) noexcept
+{
+	static_assert(is_inline, "only an inline_block BucketStorage swaps its PhysicalMemory");
+	using std::swap;
+	swap(m_blocks, other.m_blocks);
+	swap(m_free_links, other.m_free_links);
+	swap(m_free_head, other.m_free_head);
+	swap(m_free_id, other.m_free_id);
+	swap(m_bucket_capacity, other.m_bucket_capacity);
+	swap(m_max_capacity, other.m_max_capacity);
+	swap(m_size, other.m_size);
+	swap(m_slots, other.m_slots);
+	swap(m_block_bytes, other.m_block_bytes);
+	swap(m_slot_bits, other.m_slot_bits);
+	swap(m_slot_mask, other.m_slot_mask);
+	swap(m_occupancy_bucket, other.m_occupancy_bucket);
+	swap(m_occupancy_histogram, other.m_occupancy_histogram);
+	swap(m_free_block_entries, other.m_free_block_entries);
+	swap(m_counters, other.m_counters);
+	swap(m_inline, other.m_inline);
+	if (m_inline.id != npos)
+		m_blocks[m_inline.id] = reinterpret_cast< Block* >(m_inline.bytes);
+	if (other.m_inline.id != npos)
+		other.m_blocks[other.m_inline.id] = reinterpret_cast< Block* >(other.m_inline.bytes);
+}
+
+template< typename T, typename... Options >
+BucketStorage< T, Options... >::PhysicalMemory::~PhysicalMemory()
+{
+	if constexpr (is_file_backed)
+	{
+		delete m_file;
+	}
+	else
+	{
+		clear();
+	}
+}
+
+template< typename T, typename... Options >
+template< typename U >
+typename BucketStorage< T, Options... >::link_type BucketStorage< T, Options... >::PhysicalMemory::push(U&& x)
+{
+	return place(
+		[&](value_type* slot)
+		{
+			new (slot) value_type(std::forward< U >(x));
+			m_counters.construction();
+		});
+}
+
+// The caller keeps owning *source until it gives up the original without destroying it (see release_relocated).
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::link_type BucketStorage< T, Options... >::PhysicalMemory::relocate(value_type* source)
+{
+	static_assert(is_trivially_relocatable_v< value_type >, "relocate() needs a trivially relocatable value_type");
+	return place([source](value_type* slot) { std::memcpy(static_cast< void* >(slot), static_cast< const void* >(source), sizeof(value_type)); });
+}
+
+template< typename T, typename... Options >
+template< typename Construct >
+typename BucketStorage< T, Options... >::link_type BucketStorage< T, Options... >::PhysicalMemory::place(Construct&& construct)
+{
+	size_type id = ensure_capacity();
+	own(static_cast< link_type >(id << m_slot_bits));
+	Block* m_active_block = m_blocks[id];
+	size_type pos = m_active_block->m_free_head != npos ? m_active_block->m_free_head : m_active_block->m_head;
+	construct(m_active_block->get_data(pos));
+	mark_dirty(id);
+	m_active_block->set_live(pos);
+	if (pos == m_active_block->m_head)
+	{
+		++m_active_block->m_head;
+		m_counters.head_bump();
+	}
+	else
+	{
+		m_active_block->m_free_head = m_active_block->get_element(pos)->get_next();
+		m_counters.free_slot_reuse();
+	}
+	move_occupancy(m_active_block->m_size, m_active_block->m_size + 1, m_active_block->m_capacity);
+	++m_active_block->m_size;
+	if (m_active_block->m_size == m_active_block->m_capacity)
+	{
+		remove_free_block(id);
+	}
+	return static_cast< link_type >((id << m_slot_bits) | pos);
+}
+
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::PhysicalMemory::pop(link_type link)
+{
+	get_data(link)->~value_type();
+	m_counters.destruction();
+	vacate(link);
+}
+
+// Returns the slot of a value that is already gone to its block's free chain and releases the block once it is empty.
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::PhysicalMemory::vacate(link_type link) noexcept
+{
+	size_type id = link >> m_slot_bits;
+	size_type pos = link & m_slot_mask;
+	Block* block_link = m_blocks[id];
+
+	mark_dirty(id);
+	block_link->set_free(pos);
+	Element* el = block_link->get_element(pos);
+	if (el->get_time() == block_link->m_min_time)
+	{
+		block_link->m_min_time = 0;
+	}
+	el->set_time(0);
+	el->set_next(block_link->m_free_head);
+	block_link->m_free_head = static_cast< link_type >(pos);
+	if (block_link->m_size == block_link->m_capacity)
+	{
+		push_free_block(id);
+	}
+	move_occupancy(block_link->m_size, block_link->m_size - 1, block_link->m_capacity);
+	--block_link->m_size;
+
+	if (block_link->m_size == 0)
+	{
+		release(id);
+	}
+}
+
+// Swaps the value in a live slot for a new one; the slot's old stamp may have been its block's minimum.
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::PhysicalMemory::replace(link_type link, value_type&& value) noexcept
+{
+	size_type id = link >> m_slot_bits;
+	size_type pos = link & m_slot_mask;
+	Block* block = m_blocks[id];
+	value_type* data = block->get_data(pos);
+
+	data->~value_type();
+	m_counters.destruction();
+	new (data) value_type(std::move(value));
+	m_counters.construction();
+	mark_dirty(id);
+	if (block->get_element(pos)->get_time() == block->m_min_time)
+	{
+		block->m_min_time = 0;
+	}
+}
+
+// With several threads the values are destroyed in parallel, block range by block range; the blocks themselves are
+// freed on the calling thread.
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::PhysicalMemory::clear(unsigned threads) noexcept
+{
+	if constexpr (!std::is_trivially_destructible_v< value_type >)
+	{
+		const size_type slices = details::slice_count(m_blocks.size(), threads);
+		std::vector< Counters > counters;
+		if (slices > 1)
+		{
+			try
+			{
+				counters.resize(slices);
+			} catch (...)
+			{
+				// Without per-slice counters fall back to the serial release_all() below.
+				counters.clear();
+			}
+		}
+		if (!counters.empty())
+		{
+			auto destroy = [&](size_type slice, size_type first, size_type last) noexcept
+			{
+				for (size_type id = first; id < last; ++id)
+				{
+					Block* block = m_blocks[id];
+					if (block == nullptr)
+						continue;
+					for (size_type pos = block->find_live(0); pos < block->m_head; pos = block->find_live(pos + 1))
+					{
+						block->get_data(pos)->~value_type();
+						counters[slice].destruction();
+					}
+					block->m_head = 0;
+				}
+			};
+			details::run_slices(slices, m_blocks.size(), destroy);
+			for (const Counters& slice_counters : counters)
+				m_counters.merge(slice_counters);
+		}
+	}
+	release_all(true);
+}
+
+// Frees every block without running destructors: the values now live elsewhere, moved there by relocate().
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::PhysicalMemory::release_relocated() noexcept
+{
+	release_all(false);
+}
+
+// Relocates the live values of `from` into fresh, densely filled blocks of this empty table and rewrites the links
+// between them; `start` and `end` are translated the same way. Values keep the order of `from`'s blocks and slots,
+// not insertion order. Up to `threads` threads each take a range of `from`'s blocks, then a range of the new ones.
+// The caller keeps owning the originals, as with relocate().
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::PhysicalMemory::pack(PhysicalMemory& from, link_type& start, link_type& end, unsigned threads)
+{
+	static_assert(is_trivially_relocatable_v< value_type >, "pack() needs a trivially relocatable value_type");
+	// ranks[words[id] + w]: dense index of the first live slot of `from`'s block id at or after occupancy word w.
+	std::vector< size_type > words(from.m_blocks.size() + 1, 0);
+	std::vector< size_type > firsts(from.m_blocks.size() + 1, 0);
+	for (size_type id = 0; id < from.m_blocks.size(); ++id)
+	{
+		Block* block = from.m_blocks[id];
+		words[id + 1] = words[id] + (block == nullptr ? 0 : block->occupancy_word_count());
+		firsts[id + 1] = firsts[id] + (block == nullptr ? 0 : block->m_size);
+	}
+	std::vector< size_type > ranks(words.back());
+
+	// Dense index of the first slot of each new block.
+	std::vector< size_type > starts;
+	size_type total = firsts.back();
+	for (size_type placed = 0; placed < total;)
+	{
+		size_type id = m_blocks.size();
+		if (id > (npos >> m_slot_bits) - 1)
+		{
+			throw std::length_error("BucketStorage: block index does not fit into link_type");
+		}
+		size_type capacity = next_block_capacity();
+		starts.push_back(placed);
+		Block* block = allocate_block(id, capacity);
+		try
+		{
+			m_free_links.push_back(FreeLink{ npos, npos, false });
+			m_blocks.push_back(block);
+		} catch (...)
+		{
+			if (m_free_links.size() > m_blocks.size())
+				m_free_links.pop_back();
+			free_block(block, id);
+			throw;
+		}
+		size_type count = std::min(capacity, total - placed);
+		block->m_head = static_cast< link_type >(count);
+		block->m_size = static_cast< link_type >(count);
+		block->rebuild_occupancy();
+		m_size++;
+		track_block(block);
+		++m_occupancy_histogram[occupancy_bucket(count, capacity)];
+		if (count < capacity)
+			push_free_block(id);
+		placed += count;
+	}
+
+	auto locate = [&](size_type index)
+	{
+		size_type id = index / m_bucket_capacity;
+		if constexpr (is_geometric)
+			id = static_cast< size_type >(std::upper_bound(starts.begin(), starts.end(), index) - starts.begin()) - 1;
+		return static_cast< link_type >((id << m_slot_bits) | (index - starts[id]));
+	};
+	auto translate = [&](link_type link)
+	{
+		if (link == npos)
+			return npos;
+		size_type id = link >> from.m_slot_bits;
+		return locate(from.m_blocks[id]->rank(link & from.m_slot_mask, ranks.data() + words[id]));
+	};
+
+	auto relocate_range = [&](size_type, size_type first, size_type last) noexcept
+	{
+		for (size_type id = first; id < last; ++id)
+		{
+			Block* source = from.m_blocks[id];
+			if (source == nullptr || source->m_size == 0)
+				continue;
+			source->rank_words(firsts[id], ranks.data() + words[id]);
+			link_type link = locate(firsts[id]);
+			size_type target = link >> m_slot_bits;
+			size_type slot = link & m_slot_mask;
+			Block* block = m_blocks[target];
+			for (size_type pos = source->find_live(0); pos < source->m_head; pos = source->find_live(pos + 1), ++slot)
+			{
+				if (slot == block->m_capacity)
+				{
+					block = m_blocks[++target];
+					slot = 0;
+				}
+				std::memcpy(static_cast< void* >(block->get_data(slot)), static_cast< const void* >(source->get_data(pos)), sizeof(value_type));
+				*block->get_element(slot) = *source->get_element(pos);
+			}
+		}
+	};
+	details::run_slices(details::slice_count(from.m_blocks.size(), threads), from.m_blocks.size(), relocate_range);
+
+	auto link_range = [&](size_type, size_type first, size_type last) noexcept
+	{
+		for (size_type id = first; id < last; ++id)
+		{
+			Block* block = m_blocks[id];
+			block->m_min_time = std::numeric_limits< stamp_type >::max();
+			block->m_max_time = 0;
+			for (size_type pos = 0; pos < block->m_head; ++pos)
+			{
+				Element* el = block->get_element(pos);
+				el->set_next(translate(el->get_next()));
+				el->set_prev(translate(el->get_prev()));
+				block->m_min_time = std::min(block->m_min_time, el->get_time());
+				block->m_max_time = std::max(block->m_max_time, el->get_time());
+			}
+		}
+	};
+	details::run_slices(details::slice_count(m_blocks.size(), threads), m_blocks.size(), link_range);
+
+	start = translate(start);
+	end = translate(end);
+}
+
+// Moves the value at `link` into a slot of the first block on the free list; the old slot stays live until
+// release_transferred(link), so the caller can still read its Element.
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::link_type BucketStorage< T, Options... >::PhysicalMemory::transfer(link_type link)
+{
+	if constexpr (is_trivially_relocatable_v< value_type >)
+		return relocate(get_data(link));
+	else
+		return push(std::move(*get_data(link)));
+}
+
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::PhysicalMemory::release_transferred(link_type link) noexcept
+{
+	if constexpr (is_trivially_relocatable_v< value_type >)
+		vacate(link);
+	else
+		pop(link);
+}
+
+// Empties the sparsest blocks, in eighths of occupancy and then by id, through move(link) for every live element. A
+// block is only emptied if the other blocks have room for its elements, so no block is allocated on the way, and the
+// inline block is kept since emptying it frees nothing. Stops once target_bytes of blocks are freed or stop() holds.
+template< typename T, typename... Options >
+template< typename Move, typename Stop >
+void BucketStorage< T, Options... >::PhysicalMemory::compact(size_type free_slots, size_type target_bytes, Move& move, Stop& stop)
+{
+	size_type block_bytes = m_block_bytes;
+	for (size_type bucket = 1; bucket + 1 < occupancy_buckets; ++bucket)
+	{
+		for (size_type id = 0; id < m_blocks.size(); ++id)
+		{
+			Block* block = m_blocks[id];
+			if (block == nullptr || occupancy_bucket(block->m_size, block->m_capacity) != bucket || block->m_capacity > free_slots)
+				continue;
+			if constexpr (is_inline)
+			{
+				if (id == m_inline.id)
+					continue;
+			}
+			if (block_bytes - m_block_bytes >= target_bytes || stop())
+				return;
+
+			free_slots -= block->m_capacity;
+			remove_free_block(id);
+			try
+			{
+				for (size_type pos = 0, left = block->m_size; left > 0; ++pos)
+				{
+					if (block->get_element(pos)->get_time() == 0)
+						continue;
+					--left;
+					move(static_cast< link_type >((id << m_slot_bits) | pos));
+				}
+			} catch (...)
+			{
+				push_free_block(id);
+				throw;
+			}
+		}
+	}
+}
+
+// Drops unused ids from the end of the block table and gives back the spare capacity of the block table, the free id
+// links. A failed reallocation only leaves the slack in place.
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::PhysicalMemory::release_slack() noexcept
+{
+	size_type table_size = m_blocks.size();
+	while (table_size > 0 && m_blocks[table_size - 1] == nullptr)
+		--table_size;
+	if (table_size < m_blocks.size())
+	{
+		m_blocks.resize(table_size);
+		m_free_links.resize(table_size);
+		m_free_id = npos;
+		for (size_type id = table_size; id-- > 0;)
+		{
+			if (m_blocks[id] == nullptr)
+				push_free_id(id);
+		}
+	}
+
+	try
+	{
+		m_blocks.shrink_to_fit();
+		m_free_links.shrink_to_fit();
+	} catch (...)
+	{
+	}
+}
+
+// Blocks and block-table arrays together, the part of the container trim() can shrink.
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::size_type BucketStorage< T, Options... >::PhysicalMemory::footprint_bytes() const noexcept
+{
+	return m_block_bytes + m_blocks.capacity() * sizeof(Block*) + m_free_links.capacity() * sizeof(FreeLink);
+}
+
+// Copies the block table and each block, so the copy keeps the same slots, free chains and handles. Blocks are
+// allocated on the calling thread and filled by up to `threads` threads: byte for byte when value_type is trivially
+// copyable, otherwise the Element arrays are copied and each value is copy-constructed.
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::PhysicalMemory::clone(const PhysicalMemory& other, unsigned threads)
+{
+	constexpr bool bytewise = std::is_trivially_copyable_v< value_type >;
+	try
+	{
+		m_blocks.assign(other.m_blocks.size(), nullptr);
+		m_free_links = other.m_free_links;
+		for (size_type id = 0; id < other.m_blocks.size(); ++id)
+		{
+			if (other.m_blocks[id] != nullptr)
+				m_blocks[id] = allocate_block(id, other.m_blocks[id]->m_capacity);
+		}
+		size_type slices = details::slice_count(m_blocks.size(), threads);
+		std::vector< Counters > counters(bytewise ? 0 : slices);
+		auto copy = [&](size_type slice, size_type first, size_type last)
+		{
+			for (size_type id = first; id < last; ++id)
+			{
+				Block* source = other.m_blocks[id];
+				if (source == nullptr)
+					continue;
+				Block* block = m_blocks[id];
+				if constexpr (bytewise)
+				{
+					std::memcpy(static_cast< void* >(block), source, Block::footprint(source->m_capacity));
+				}
+				else
+				{
+					block->copy_layout(*source);
+					size_type pos = block->find_live(0);
+					try
+					{
+						for (; pos < block->m_head; pos = block->find_live(pos + 1))
+						{
+							new (block->get_data(pos)) value_type(*source->get_data(pos));
+							counters[slice].construction();
+						}
+					} catch (...)
+					{
+						for (size_type built = block->find_live(0); built < pos; built = block->find_live(built + 1))
+						{
+							block->get_data(built)->~value_type();
+							counters[slice].destruction();
+						}
+						// release_all() below destroys the values of every other block below its m_head.
+						block->m_head = 0;
+						throw;
+					}
+				}
+			}
+		};
+		try
+		{
+			details::run_slices(slices, m_blocks.size(), copy);
+		} catch (...)
+		{
+			for (const Counters& slice_counters : counters)
+				m_counters.merge(slice_counters);
+			throw;
+		}
+		for (const Counters& slice_counters : counters)
+			m_counters.merge(slice_counters);
+	} catch (...)
+	{
+		release_all(!bytewise);
+		throw;
+	}
+	m_free_head = other.m_free_head;
+	m_free_id = other.m_free_id;
+	m_free_block_entries = other.m_free_block_entries;
+	m_size = other.m_size;
+	m_slots = other.m_slots;
+	m_block_bytes = other.m_block_bytes;
+	m_occupancy_histogram = other.m_occupancy_histogram;
+}
+
+// Copies only the block table; every block gains an owner and is cloned by whichever owner writes to it first.
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::PhysicalMemory::share(const PhysicalMemory& other)
+{
+	static_assert(is_shared, "share() needs BucketStorage< T, copy_on_write >");
+	try
+	{
+		m_blocks = other.m_blocks;
+		m_free_links = other.m_free_links;
+	} catch (...)
+	{
+		forget_blocks();
+		throw;
+	}
+	for (Block* block : m_blocks)
+	{
+		if (block != nullptr)
+			block->m_shares.retain();
+	}
+	m_free_head = other.m_free_head;
+	m_free_id = other.m_free_id;
+	m_free_block_entries = other.m_free_block_entries;
+	m_size = other.m_size;
+	m_slots = other.m_slots;
+	m_block_bytes = other.m_block_bytes;
+	m_occupancy_histogram = other.m_occupancy_histogram;
+}
+
+// Gives the block holding `link` a private copy if other containers still share it. Callers own every block they
+// are about to write before writing any, so a failed clone leaves the container unchanged.
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::PhysicalMemory::own(link_type link)
+{
+	if constexpr (is_shared)
+	{
+		if (link == npos)
+			return;
+		size_type id = link >> m_slot_bits;
+		Block* block = m_blocks[id];
+		if (!block->m_shares.shared())
+			return;
+		Block* copy = allocate_block(id, block->m_capacity);
+		copy->copy_from(*block);
+		m_blocks[id] = copy;
+		if (block->m_shares.release())
+			destroy_block(block);
+	}
+}
+
+// Moves the inline block to the heap, so its address can be handed to another table.
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::PhysicalMemory::spill_inline()
+{
+	if constexpr (is_inline)
+	{
+		if (m_inline.id == npos)
+			return;
+		size_type capacity = reinterpret_cast< Block* >(m_inline.bytes)->m_capacity;
+		Block* block = Block::create(capacity);
+		m_counters.block_allocation();
+		std::memcpy(static_cast< void* >(block), m_inline.bytes, Block::footprint(capacity));
+		m_blocks[m_inline.id] = block;
+		m_inline.id = npos;
+	}
+}
+
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::PhysicalMemory::own_all()
+{
+	if constexpr (is_shared)
+	{
+		for (size_type id = 0; id < m_blocks.size(); ++id)
+		{
+			if (m_blocks[id] != nullptr)
+				own(static_cast< link_type >(id << m_slot_bits));
+		}
+	}
+}
+
+// Appends the block table of `other` to this one and leaves `other` empty. A block keeps its address; its id grows
+// by the old table size, so every link stored in it grows by the returned offset and every stamp by time_offset.
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::link_type
+	BucketStorage< T, Options... >::PhysicalMemory::adopt(PhysicalMemory& other, stamp_type time_offset)
+{
+	size_type base = m_blocks.size();
+	if (other.m_blocks.size() > (npos >> m_slot_bits) - base)
+	{
+		throw std::length_error("BucketStorage: block index does not fit into link_type");
+	}
+	m_blocks.reserve(base + other.m_blocks.size());
+	m_free_links.reserve(base + other.m_blocks.size());
+
+	link_type link_offset = static_cast< link_type >(base << m_slot_bits);
+	for (Block* block : other.m_blocks)
+	{
+		m_blocks.push_back(block);
+		m_free_links.push_back(FreeLink{ npos, npos, false });
+		if (block == nullptr)
+		{
+			push_free_id(m_blocks.size() - 1);
+			continue;
+		}
+		if (block->m_size < block->m_capacity)
+			push_free_block(m_blocks.size() - 1);
+		if (block->m_min_time != 0)
+			block->m_min_time += time_offset;
+		block->m_max_time += time_offset;
+		for (size_type pos = 0; pos < block->m_head; ++pos)
+		{
+			Element* el = block->get_element(pos);
+			if (el->get_time() == 0)
+				continue;
+			el->set_time(el->get_time() + time_offset);
+			if (el->get_next() != npos)
+				el->set_next(el->get_next() + link_offset);
+			if (el->get_prev() != npos)
+				el->set_prev(el->get_prev() + link_offset);
+		}
+	}
+	for (size_type i = 0; i < occupancy_buckets; ++i)
+	{
+		m_occupancy_histogram[i] += other.m_occupancy_histogram[i];
+	}
+	m_size += other.m_size;
+	m_slots += other.m_slots;
+	m_block_bytes += other.m_block_bytes;
+	other.forget_blocks();
+	return link_offset;
+}
+
+// Shares blocks [first, last) of `from` as blocks 0.. of this empty table. Everything that can throw happens before
+// the first pointer is copied; afterwards exactly one of the two tables has to forget the blocks.
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::PhysicalMemory::take_blocks(const PhysicalMemory& from, size_type first, size_type last)
+{
+	m_blocks.reserve(last - first);
+	m_free_links.reserve(last - first);
+	for (size_type id = first; id < last; ++id)
+	{
+		Block* block = from.m_blocks[id];
+		m_blocks.push_back(block);
+		m_free_links.push_back(FreeLink{ npos, npos, false });
+		if (block == nullptr)
+		{
+			push_free_id(id - first);
+			continue;
+		}
+		if (block->m_size < block->m_capacity)
+			push_free_block(id - first);
+		++m_occupancy_histogram[occupancy_bucket(block->m_size, block->m_capacity)];
+		++m_size;
+		track_block(block);
+	}
+}
+
+// Drops the block table without freeing the blocks, which now belong to another table.
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::PhysicalMemory::forget_blocks() noexcept
+{
+	m_blocks.clear();
+	clear_free_blocks();
+	m_size = 0;
+	m_slots = 0;
+	m_block_bytes = 0;
+	m_occupancy_histogram.fill(0);
+}
+
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::PhysicalMemory::release_all(bool destroy_values) noexcept
+{
+	if constexpr (is_file_backed)
+	{
+		get_mapped_header()->clean = 0;
+	}
+	else
+	{
+		for (Block* block : m_blocks)
+		{
+			if (block == nullptr || !block->m_shares.release())
+				continue;
+			for (size_type pos = 0; destroy_values && pos < block->m_head; ++pos)
+			{
+				if (block->get_element(pos)->get_time() != 0)
+				{
+					block->get_data(pos)->~value_type();
+					m_counters.destruction();
+				}
+			}
+			destroy_block(block);
+		}
+	}
+	m_blocks.clear();
+	clear_free_blocks();
+	m_size = 0;
+	m_slots = 0;
+	m_block_bytes = 0;
+	m_occupancy_histogram.fill(0);
+	m_scan_cursor = 0;
+}
+
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::PhysicalMemory::release(size_type id) noexcept
+{
+	--m_occupancy_histogram[occupancy_bucket(m_blocks[id]->m_size, m_blocks[id]->m_capacity)];
+	remove_free_block(id);
+	untrack_block(m_blocks[id]);
+	free_block(m_blocks[id], id);
+	m_blocks[id] = nullptr;
+	push_free_id(id);
+	m_size--;
+}
+
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::PhysicalMemory::clear_free_blocks() noexcept
+{
+	m_free_links.clear();
+	m_free_head = npos;
+	m_free_id = npos;
+	m_free_block_entries = 0;
+}
+
+// A block is listed exactly while it is live and has a free slot; new entries go to the front, so the block that
+// gained room last is filled first.
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::PhysicalMemory::push_free_block(size_type id) noexcept
+{
+	FreeLink& link = m_free_links[id];
+	link.prev = npos;
+	link.next = m_free_head;
+	link.listed = true;
+	if (m_free_head != npos)
+		m_free_links[m_free_head].prev = static_cast< link_type >(id);
+	m_free_head = static_cast< link_type >(id);
+	++m_free_block_entries;
+}
+
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::PhysicalMemory::push_free_id(size_type id) noexcept
+{
+	m_free_links[id] = FreeLink{ npos, m_free_id, false };
+	m_free_id = static_cast< link_type >(id);
+}
+
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::PhysicalMemory::remove_free_block(size_type id) noexcept
+{
+	FreeLink& link = m_free_links[id];
+	if (!link.listed)
+		return;
+	if (link.prev != npos)
+		m_free_links[link.prev].next = link.next;
+	else
+		m_free_head = link.next;
+	if (link.next != npos)
+		m_free_links[link.next].prev = link.prev;
+	link.listed = false;
+	--m_free_block_entries;
+}
+
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::PhysicalMemory::move_occupancy(size_type from, size_type to, size_type capacity) noexcept
+{
+	--m_occupancy_histogram[occupancy_bucket(from, capacity)];
+	++m_occupancy_histogram[occupancy_bucket(to, capacity)];
+}
+
+// Fixed-size blocks read a table built by the constructor; geometric ones have too many capacities for one.
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::size_type
+	BucketStorage< T, Options... >::PhysicalMemory::occupancy_bucket(size_type size, size_type capacity) const noexcept
+{
+	if constexpr (is_geometric)
+	{
+		if (size == 0)
+			return 0;
+		if (size == capacity)
+			return occupancy_buckets - 1;
+		return 1 + (size * (occupancy_buckets - 2) - 1) / capacity;
+	}
+	else
+	{
+		return m_occupancy_bucket[size];
+	}
+}
+
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::PhysicalMemory::track_block(const Block* block) noexcept
+{
+	m_slots += block->m_capacity;
+	m_block_bytes += Block::footprint(block->m_capacity);
+}
+
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::PhysicalMemory::untrack_block(const Block* block) noexcept
+{
+	m_slots -= block->m_capacity;
+	m_block_bytes -= Block::footprint(block->m_capacity);
+}
+
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::Counters& BucketStorage< T, Options... >::PhysicalMemory::get_counters() noexcept
+{
+	return m_counters;
+}
+
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::size_type BucketStorage< T, Options... >::PhysicalMemory::get_block_table_size() const noexcept
+{
+	return m_blocks.size();
+}
+
+template< typename T, typename... Options >
+unsigned BucketStorage< T, Options... >::PhysicalMemory::get_slot_bits() const noexcept
+{
+	return m_slot_bits;
+}
+
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::link_type BucketStorage< T, Options... >::PhysicalMemory::get_slot_mask() const noexcept
+{
+	return m_slot_mask;
+}
+
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::PhysicalMemory::touch(link_type link) noexcept
+{
+	mark_dirty(link >> m_slot_bits);
+}
+
+// Blocks larger than a few pages get only the lines of the element itself.
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::PhysicalMemory::prefetch_block(link_type link) const noexcept
+{
+	constexpr size_type line = 64;
+	constexpr size_type whole_block_limit = 4096;
+	size_type bytes = Block::footprint(get_block(link)->m_capacity);
+	if (bytes > whole_block_limit)
+	{
+		details::prefetch(get_element(link));
+		details::prefetch(get_data(link));
+		return;
+	}
+	const char* block = reinterpret_cast< const char* >(get_block(link));
+	for (size_type offset = 0; offset < bytes; offset += line)
+	{
+		details::prefetch(block + offset);
+	}
+}
+
+// First live slot at or after `link` in block table order, npos past the last one.
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::link_type BucketStorage< T, Options... >::PhysicalMemory::next_live(link_type link) const noexcept
+{
+	size_type pos = link & m_slot_mask;
+	for (size_type id = link >> m_slot_bits; id < m_blocks.size(); ++id, pos = 0)
+	{
+		Block* block = m_blocks[id];
+		if (block == nullptr || pos >= block->m_head)
+			continue;
+		if (block->m_size != block->m_head)
+			pos = block->find_live(pos);
+		if (pos < block->m_head)
+			return static_cast< link_type >((id << m_slot_bits) | pos);
+	}
+	return npos;
+}
+
+// Stamps only grow, so the block receiving a new one gets it as its maximum; a block's first value also sets the minimum.
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::PhysicalMemory::record_time(link_type link, stamp_type time) noexcept
+{
+	Block* block = m_blocks[link >> m_slot_bits];
+	block->m_max_time = time;
+	if (block->m_size == 1)
+	{
+		block->m_min_time = time;
+	}
+}
+
+// A relinked element keeps its older stamp, so the bounds of the receiving block only widen to take it in.
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::PhysicalMemory::merge_time(link_type link, stamp_type time) noexcept
+{
+	Block* block = m_blocks[link >> m_slot_bits];
+	if (block->m_size == 1)
+	{
+		block->m_min_time = time;
+		block->m_max_time = time;
+		return;
+	}
+	block->m_max_time = std::max(block->m_max_time, time);
+	if (block->m_min_time != 0 && time < block->m_min_time)
+	{
+		block->m_min_time = time;
+	}
+}
+
+// After a restamp every old bound is wrong; the new stamps are all below the next one, which is what m_max_time
+// will keep as an upper bound until the block is refreshed.
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::PhysicalMemory::forget_times() noexcept
+{
+	for (size_type id = 0; id < m_blocks.size(); ++id)
+	{
+		if (m_blocks[id] == nullptr)
+			continue;
+		m_blocks[id]->m_min_time = 0;
+		m_blocks[id]->m_max_time = std::numeric_limits< stamp_type >::max();
+		mark_dirty(id);
+	}
+}
+
+// Returns the exact bounds; they are stored only in a block no other container reads.
+template< typename T, typename... Options >
+std::pair< typename BucketStorage< T, Options... >::stamp_type, typename BucketStorage< T, Options... >::stamp_type >
+	BucketStorage< T, Options... >::PhysicalMemory::refresh_times(size_type id) noexcept
+{
+	Block* block = m_blocks[id];
+	auto [min_time, max_time] = scan_times(id);
+	if (!block->m_shares.shared())
+	{
+		block->m_min_time = min_time;
+		block->m_max_time = max_time;
+		mark_dirty(id);
+	}
+	return { min_time, max_time };
+}
+
+template< typename T, typename... Options >
+std::pair< typename BucketStorage< T, Options... >::stamp_type, typename BucketStorage< T, Options... >::stamp_type >
+	BucketStorage< T, Options... >::PhysicalMemory::scan_times(size_type id) const noexcept
+{
+	Block* block = m_blocks[id];
+	stamp_type min_time = std::numeric_limits< stamp_type >::max();
+	stamp_type max_time = 0;
+	for (size_type pos = block->find_live(0); pos < block->m_head; pos = block->find_live(pos + 1))
+	{
+		stamp_type time = block->get_element(pos)->get_time();
+		min_time = time < min_time ? time : min_time;
+		max_time = time > max_time ? time : max_time;
+	}
+	return { min_time, max_time };
+}
+
+// Caches the bounds it has to recompute, so later queries skip more blocks.
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::link_type BucketStorage< T, Options... >::PhysicalMemory::lower_bound_time(stamp_type time) noexcept
+{
+	auto bounds = [this](size_type id) noexcept { return refresh_times(id); };
+	return find_time(time, bounds);
+}
+
+// Read-only, so concurrent const queries are safe: a block with an unknown minimum is rescanned every time.
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::link_type BucketStorage< T, Options... >::PhysicalMemory::lower_bound_time(stamp_type time) const noexcept
+{
+	auto bounds = [this](size_type id) noexcept { return scan_times(id); };
+	return find_time(time, bounds);
+}
+
+// Link of the live slot with the smallest stamp not below `time`, npos if there is none. Block bounds skip blocks
+// that end before `time` or cannot beat the best candidate; only blocks straddling `time` are scanned slot by slot.
+// `bounds(id)` supplies the exact bounds of a block whose minimum is unknown.
+template< typename T, typename... Options >
+template< typename Bounds >
+typename BucketStorage< T, Options... >::link_type BucketStorage< T, Options... >::PhysicalMemory::find_time(stamp_type time, Bounds& bounds) const noexcept
+{
+	stamp_type best_time = std::numeric_limits< stamp_type >::max();
+	size_type best_id = npos;
+	size_type best_pos = npos;
+	for (size_type id = 0; id < m_blocks.size(); ++id)
+	{
+		Block* block = m_blocks[id];
+		if (block == nullptr || block->m_max_time < time || (block->m_min_time != 0 && block->m_min_time >= best_time))
+			continue;
+		stamp_type min_time = block->m_min_time;
+		if (min_time == 0)
+		{
+			stamp_type max_time;
+			std::tie(min_time, max_time) = bounds(id);
+			if (max_time < time || min_time >= best_time)
+				continue;
+		}
+		if (min_time >= time)
+		{
+			best_time = min_time;
+			best_id = id;
+			best_pos = npos;
+			continue;
+		}
+		for (size_type pos = block->find_live(0); pos < block->m_head; pos = block->find_live(pos + 1))
+		{
+			stamp_type stamp = block->get_element(pos)->get_time();
+			if (stamp >= time && stamp < best_time)
+			{
+				best_time = stamp;
+				best_id = id;
+				best_pos = pos;
+			}
+		}
+	}
+	if (best_id == npos)
+		return npos;
+	if (best_pos == npos)
+	{
+		Block* block = m_blocks[best_id];
+		best_pos = block->find_live(0);
+		while (block->get_element(best_pos)->get_time() != best_time)
+		{
+			best_pos = block->find_live(best_pos + 1);
+		}
+	}
+	return static_cast< link_type >((best_id << m_slot_bits) | best_pos);
+}
+
+// Blocks without holes are walked as plain arrays; the rest skip 64 slots at a time through the occupancy bitmap.
+template< typename T, typename... Options >
+template< bool Touch, typename F >
+void BucketStorage< T, Options... >::PhysicalMemory::for_each_live(F& f)
+{
+	for (size_type id = 0; id < m_blocks.size(); ++id)
+	{
+		Block* block = m_blocks[id];
+		if (block == nullptr || block->m_size == 0)
+			continue;
+		if constexpr (Touch)
+		{
+			own(static_cast< link_type >(id << m_slot_bits));
+			block = m_blocks[id];
+			mark_dirty(id);
+		}
+		value_type* data = block->get_data(0);
+		size_type head = block->m_head;
+		if (block->m_size == head)
+		{
+			for (size_type pos = 0; pos < head; ++pos)
+			{
+				f(data[pos]);
+			}
+			continue;
+		}
+		for (size_type pos = block->find_live(0); pos < head; pos = block->find_live(pos + 1))
+		{
+			f(data[pos]);
+		}
+	}
+}
+
+// The first change after a flush also clears the header's clean flag, so a file abandoned mid-update is not trusted.
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::PhysicalMemory::mark_dirty(size_type id) noexcept
+{
+	if constexpr (is_file_backed)
+	{
+		if (m_dirty[id] != 0)
+			return;
+		if (m_dirty_ids.empty())
+			get_mapped_header()->clean = 0;
+		m_dirty[id] = 1;
+		m_dirty_ids.push_back(id);
+	}
+}
+
+template< typename T, typename... Options >
+details::MappedHeader* BucketStorage< T, Options... >::PhysicalMemory::get_mapped_header() const noexcept
+{
+	return reinterpret_cast< details::MappedHeader* >(m_file->data());
+}
+
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::PhysicalMemory::store_header(link_type start, link_type end, stamp_type next_time, size_type size) noexcept
+{
+	details::MappedHeader* header = get_mapped_header();
+	header->block_table_size = m_blocks.size();
+	header->blocks = m_size;
+	header->size = size;
+	header->start = start;
+	header->end = end;
+	header->next_time = next_time;
+	std::copy(m_occupancy_histogram.begin(), m_occupancy_histogram.end(), std::begin(header->occupancy_histogram));
+	header->clean = 1;
+}
+
+// Dirty blocks are synced in file order, adjacent ones as one range. The header is marked clean only after that, so it
+// never describes blocks that are not on disk yet.
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::PhysicalMemory::flush(link_type start, link_type end, stamp_type next_time, size_type size)
+{
+	std::sort(m_dirty_ids.begin(), m_dirty_ids.end());
+	for (size_type i = 0; i < m_dirty_ids.size();)
+	{
+		size_type first = m_dirty_ids[i];
+		size_type last = first;
+		for (++i; i < m_dirty_ids.size() && m_dirty_ids[i] == last + 1; ++i)
+		{
+			last = m_dirty_ids[i];
+		}
+		m_file->sync(details::mapped_header_bytes + first * m_record_size, (last - first + 1) * m_record_size);
+	}
+	for (size_type id : m_dirty_ids)
+	{
+		m_dirty[id] = 0;
+	}
+	m_dirty_ids.clear();
+	store_header(start, end, next_time, size);
+	m_file->sync(0, sizeof(details::MappedHeader));
+}
+
+// Per live block: a SnapshotBlock record, then Element[m_head] and value_type[m_head] as raw bytes.
+template< typename T, typename... Options >
+template< typename Sink >
+void BucketStorage< T, Options... >::PhysicalMemory::save_blocks(Sink& sink) const
+{
+	for (size_type id = 0; id < m_blocks.size(); ++id)
+	{
+		Block* block = m_blocks[id];
+		if (block == nullptr)
+			continue;
+
+		details::SnapshotBlock record{ id, block->m_head, block->m_size, block->m_free_head };
+		sink.write(&record, sizeof(record));
+		sink.write(block->get_element(0), block->m_head * sizeof(Element));
+		sink.write(block->get_data(0), block->m_head * sizeof(value_type));
+	}
+}
+
+template< typename T, typename... Options >
+template< typename Source >
+void BucketStorage< T, Options... >::PhysicalMemory::load_blocks(Source& source, size_type block_table_size, size_type blocks)
+{
+	if (block_table_size > (npos >> m_slot_bits))
+		throw std::runtime_error("BucketStorage: snapshot block table does not fit into link_type");
+	m_blocks.assign(block_table_size, nullptr);
+	m_free_links.assign(block_table_size, FreeLink{ npos, npos, false });
+
+	for (size_type i = 0; i < blocks; ++i)
+	{
+		details::SnapshotBlock record;
+		source.read(&record, sizeof(record));
+		if (record.id >= block_table_size || m_blocks[record.id] != nullptr || record.head > m_bucket_capacity ||
+			record.size > record.head || record.size == 0)
+			throw std::runtime_error("BucketStorage: snapshot block record is corrupted");
+
+		Block* block = allocate_block(record.id, m_bucket_capacity);
+		m_blocks[record.id] = block;
+
+		source.read(block->get_element(0), record.head * sizeof(Element));
+		source.read(block->get_data(0), record.head * sizeof(value_type));
+
+		size_type free_count = 0;
+		for (std::uint64_t pos = record.free_head; pos != npos; pos = block->get_element(pos)->get_next())
+		{
+			if (pos >= record.head || free_count == record.head - record.size || block->get_element(pos)->get_time() != 0)
+				throw std::runtime_error("BucketStorage: snapshot block record is corrupted");
+			++free_count;
+		}
+		if (free_count != record.head - record.size)
+			throw std::runtime_error("BucketStorage: snapshot block record is corrupted");
+		block->m_head = static_cast< link_type >(record.head);
+		block->m_size = static_cast< link_type >(record.size);
+		block->m_free_head = static_cast< link_type >(record.free_head);
+		block->rebuild_occupancy();
+		block->m_min_time = 0;
+		block->m_max_time = std::numeric_limits< stamp_type >::max();
+
+		++m_size;
+		track_block(block);
+		++m_occupancy_histogram[occupancy_bucket(block->m_size, block->m_capacity)];
+		if (block->m_size < block->m_capacity)
+			push_free_block(record.id);
+	}
+
+	for (size_type id = block_table_size; id-- > 0;)
+	{
+		if (m_blocks[id] == nullptr)
+			push_free_id(id);
+	}
+}
+
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::PhysicalMemory::fill_stats(MemoryStats& stats) const noexcept
+{
+	stats.blocks = m_size;
+	stats.slot_bytes = m_slots * sizeof(value_type);
+	stats.element_bytes = m_slots * sizeof(Element);
+	stats.block_header_bytes = m_block_bytes - m_slots * (sizeof(Element) + sizeof(value_type));
+	// Entries of listed blocks count as free-block bytes, the rest of m_free_links as part of the block table.
+	stats.block_table_bytes = m_blocks.capacity() * sizeof(Block*) + (m_free_links.capacity() - m_free_block_entries) * sizeof(FreeLink);
+	stats.free_block_bytes = m_free_block_entries * sizeof(FreeLink);
+	stats.metadata_bytes = stats.element_bytes + stats.block_header_bytes + stats.block_table_bytes + stats.free_block_bytes;
+	stats.occupancy_histogram = m_occupancy_histogram;
+	stats.partially_free_blocks = m_size - m_occupancy_histogram.front() - m_occupancy_histogram.back();
+}
+
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::size_type BucketStorage< T, Options... >::PhysicalMemory::ensure_capacity()
+{
+	if (m_free_head != npos || rediscover_free_block())
+	{
+		m_counters.free_block_hit();
+		return m_free_head;
+	}
+
+	size_type id = m_free_id != npos ? m_free_id : m_blocks.size();
+	if (id > (npos >> m_slot_bits) - 1)
+	{
+		throw std::length_error("BucketStorage: block index does not fit into link_type");
+	}
+
+	Block* block = allocate_block(id, next_block_capacity());
+	if (id == m_blocks.size())
 	{
-		Node* next = new Node;
-		next->prev = m_top;
-		next->data = std::forward< U >(x);
-		m_top = next;
+		try
+		{
+			m_free_links.push_back(FreeLink{ npos, npos, false });
+			m_blocks.push_back(block);
+		} catch (...)
+		{
+			if (m_free_links.size() > m_blocks.size())
+				m_free_links.pop_back();
+			free_block(block, id);
+			throw;
+		}
 	}
-
-	template< typename T >
-	T Stack< T >::pop()
+	else
 	{
-		T res = m_top->data;
-		Node* del = m_top;
-		m_top = m_top->prev;
-		delete del;
-		return res;
+		m_free_id = m_free_links[id].next;
+		m_blocks[id] = block;
 	}
+	m_size++;
+	track_block(block);
+	++m_occupancy_histogram.front();
+	push_free_block(id);
+	return id;
+}
 
-	template< typename T >
-	T Stack< T >::peek()
+// Blocks of a reopened file are not tracked until needed: once no known block has room, headers are scanned on from
+// where the previous scan stopped, collecting dead records and stopping at the first block with free slots.
+template< typename T, typename... Options >
+bool BucketStorage< T, Options... >::PhysicalMemory::rediscover_free_block()
+{
+	if constexpr (is_file_backed)
 	{
-		if (m_top == nullptr)
+		while (m_scan_cursor < m_blocks.size())
 		{
-			return nullptr;
+			size_type id = m_scan_cursor++;
+			Block* block = m_blocks[id];
+			if (block == nullptr)
+				continue;
+			if (block->m_size == 0)
+			{
+				push_free_id(id);
+				m_blocks[id] = nullptr;
+			}
+			else if (block->m_size < block->m_capacity)
+			{
+				push_free_block(id);
+				return true;
+			}
 		}
-		return m_top->data;
 	}
+	return false;
+}
 
-	template< typename T >
-	bool Stack< T >::empty() const noexcept
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::Block*
+	BucketStorage< T, Options... >::PhysicalMemory::allocate_block(size_type id, size_type capacity)
+{
+	if constexpr (is_file_backed)
 	{
-		return m_top == nullptr;
+		m_file->grow(details::mapped_header_bytes + (id + 1) * m_record_size);
+		if (id >= m_dirty.size())
+		{
+			m_dirty.resize(id + 1);
+			m_dirty_ids.reserve(m_dirty.capacity());
+		}
+		mark_dirty(id);
+		m_counters.block_allocation();
+		return Block::create_at(m_file->data() + details::mapped_header_bytes + id * m_record_size, capacity);
 	}
-
-	template< typename T >
-	void Stack< T >::clear()
+	else
 	{
-		while (m_top != nullptr)
+		if constexpr (is_inline)
 		{
-			pop();
+			if (m_inline.id == npos && capacity <= inline_capacity)
+			{
+				m_inline.id = id;
+				return Block::create_at(m_inline.bytes, capacity);
+			}
 		}
+		Block* block = Block::create(capacity);
+		m_counters.block_allocation();
+		return block;
 	}
-}	 // namespace details
+}
 
-template< typename T >
-class BucketStorage
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::size_type BucketStorage< T, Options... >::PhysicalMemory::next_block_capacity() const noexcept
 {
-	template< bool IsConst >
-	class BaseIterator;
-	struct Block;
-	struct Element;
-
-  public:
-	using value_type = T;
-	using reference = T&;
-	using pointer = T*;
-	using size_type = size_t;
-	using const_reference = const T&;
-	using difference_type = std::ptrdiff_t;
-	typedef details::Stack< Block* > StackBlock;
-	typedef details::Stack< size_type > StackIndexes;
-
-	explicit BucketStorage() noexcept;
-	explicit BucketStorage(size_type m_bucket_capacity) noexcept;
-	~BucketStorage();
-
-	BucketStorage(BucketStorage&& other) noexcept;
-	BucketStorage(const BucketStorage& other);
-	BucketStorage& operator=(BucketStorage&& other) noexcept;
-	BucketStorage& operator=(const BucketStorage& other);
-
-	using iterator = BaseIterator< false >;
-	using const_iterator = BaseIterator< true >;
-	iterator erase(iterator iter);
-	iterator insert(const value_type& x);
-	iterator insert(value_type&& x);
-	iterator begin() noexcept;
-	iterator end() noexcept;
-	const_iterator begin() const noexcept;
-	const_iterator end() const noexcept;
-	const_iterator cbegin() noexcept;
-	const_iterator cend() noexcept;
-	size_type size() const noexcept;
-	bool empty() const noexcept;
-	void clear() noexcept;
-	void shrink_to_fit();
-	void swap(BucketStorage& other) noexcept;
-	size_type capacity() const noexcept;
-	iterator get_to_distance(iterator it, difference_type dist) noexcept;
-
-  private:
-	template< typename U >
-	iterator insert_impl(U&& x);
+	if constexpr (is_geometric)
+		return std::clamp(m_slots, m_bucket_capacity, m_max_capacity);
+	else
+		return m_bucket_capacity;
+}
 
-	struct Element
+// A record of a file-backed container stays in the file; a zero m_size marks it as dead for the next reopen.
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::PhysicalMemory::free_block(Block* block, size_type id) noexcept
+{
+	if constexpr (is_file_backed)
 	{
-		explicit Element(size_type time);
-		~Element();
-		bool operator==(const Element& other);
-		bool operator!=(const Element& other);
-		bool operator<(const Element& other);
-		bool operator>(const Element& other);
-		bool operator>=(const Element& other);
-		bool operator<=(const Element& other);
-
-		size_type get_time() const;
-		size_type get_pos() const;
-		Block* get_block_link();
-		Element* get_prev();
-		Element* get_next();
-
-		void set_time(size_type time);
-		void set_pos(size_type pos);
-		void set_next(Element* next);
-		void set_prev(Element* prev);
-		void set_block_link(Block* block_link);
-
-	  private:
-		Block* m_block_link;
-		size_type m_pos;
-		Element* m_next;
-		Element* m_prev;
-		size_type m_time;
-	};
-
-	struct Block
+		block->m_size = 0;
+		mark_dirty(id);
+		m_counters.block_free();
+	}
+	else if (block->m_shares.release())
 	{
-		explicit Block(size_type m_bucket_capacity);
-		~Block();
-		value_type* get_data(size_type pos);
-		friend class BucketStorage;
-
-	  private:
-		Block* m_prev;
-		Block* m_next;
-		size_type m_head;
-		value_type* m_arr;
-		StackIndexes* m_free_pos;
-		size_type m_size;
-		size_type m_capacity;
-	};
+		destroy_block(block);
+	}
+}
 
-	class VirtualMemory
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::PhysicalMemory::destroy_block(Block* block) noexcept
+{
+	if constexpr (is_inline)
 	{
-	  public:
-		VirtualMemory();
-		~VirtualMemory();
-		void push(Element* el);
-		void pop();
-		Element* get_end();
-		Element* get_start();
-		Element* get_over_end();
-		void set_start(Element* el);
-		void set_end(Element* el);
+		if (block == reinterpret_cast< Block* >(m_inline.bytes))
+		{
+			block->~Block();
+			m_inline.id = npos;
+			return;
+		}
+	}
+	Block::destroy(block);
+	m_counters.block_free();
+}
 
-	  private:
-		Element* m_start;
-		Element* m_end;
-		Element* m_over_end;
-	};
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::size_type BucketStorage< T, Options... >::PhysicalMemory::size() const noexcept
+{
+	return m_size;
+}
 
-	class PhysicalMemory
-	{
-	  public:
-		explicit PhysicalMemory(size_type m_bucket_capacity);
-		~PhysicalMemory();
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::size_type BucketStorage< T, Options... >::PhysicalMemory::slots() const noexcept
+{
+	return m_slots;
+}
 
-		void push(const value_type& x, Element* el);
-		void push(value_type&& x, Element* el);
-		size_type size() const noexcept;
-		size_type empty(Block* block_link);
-		void push_free_block(Block* block_link);
-		void clear_free_blocks();
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::Block* BucketStorage< T, Options... >::PhysicalMemory::get_block(link_type link) const
+{
+	return m_blocks[link >> m_slot_bits];
+}
 
-	  private:
-		StackBlock* m_free_blocks;
-		Block* m_last_block;
-		size_type m_bucket_capacity;
-		void ensure_capacity();
-		size_type m_size;
-	};
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::Element* BucketStorage< T, Options... >::PhysicalMemory::get_element(link_type link) const
+{
+	return m_blocks[link >> m_slot_bits]->get_element(link & m_slot_mask);
+}
 
-	template< bool IsConst >
-	class BaseIterator
-	{
-	  public:
-		using iterator_category = std::bidirectional_iterator_tag;
-		using difference_type = std::ptrdiff_t;
-		using value_type = T;
-		using pointer = typename std::conditional< IsConst, const T*, T* >::type;
-		using reference = typename std::conditional< IsConst, const T&, T& >::type;
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::value_type* BucketStorage< T, Options... >::PhysicalMemory::get_data(link_type link) const
+{
+	return m_blocks[link >> m_slot_bits]->get_data(link & m_slot_mask);
+}
 
-		explicit BaseIterator(Element* ptr);
+// Unlike the accessors above, accepts any link, including npos and links into missing blocks.
+template< typename T, typename... Options >
+bool BucketStorage< T, Options... >::PhysicalMemory::is_live(link_type link) const noexcept
+{
+	size_type id = link >> m_slot_bits;
+	if (link == npos || id >= m_blocks.size() || m_blocks[id] == nullptr)
+		return false;
+	Block* block = m_blocks[id];
+	size_type pos = link & m_slot_mask;
+	return pos < block->m_head && block->get_element(pos)->get_time() != 0;
+}
 
-		reference operator*() const;
-		pointer operator->() const;
-		BaseIterator& operator++();
-		BaseIterator operator++(int);
-		BaseIterator& operator--();
-		BaseIterator operator--(int);
-		template< bool OtherIsConst >
-		bool operator==(const BaseIterator< OtherIsConst >& other) const;
-		template< bool OtherIsConst >
-		bool operator!=(const BaseIterator< OtherIsConst >& other) const;
-		template< bool OtherIsConst >
-		bool operator>(const BaseIterator< OtherIsConst >& other) const;
-		template< bool OtherIsConst >
-		bool operator<(const BaseIterator< OtherIsConst >& other) const;
-		template< bool OtherIsConst >
-		bool operator>=(const BaseIterator< OtherIsConst >& other) const;
-		template< bool OtherIsConst >
-		bool operator<=(const BaseIterator< OtherIsConst >& other) const;
+// !Block
+template< typename T, typename... Options >
+BucketStorage< T, Options... >::Block::Block(const size_type capacity) noexcept :
+	m_head(0), m_size(0), m_capacity(static_cast< link_type >(capacity)), m_free_head(npos), m_min_time(0), m_max_time(0)
+{
+	std::memset(get_occupancy(), 0, occupancy_words(capacity) * sizeof(std::uint64_t));
+}
 
-		Element* get_current() const;
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::Block* BucketStorage< T, Options... >::Block::create(size_type capacity)
+{
+	return create_at(operator new(footprint(capacity), std::align_val_t(alignment())), capacity);
+}
 
-	  private:
-		Element* m_current;
-	};
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::Block* BucketStorage< T, Options... >::Block::create_at(void* raw, size_type capacity) noexcept
+{
+	return new (raw) Block(capacity);
+}
 
-	VirtualMemory* m_virtual_memory;
-	PhysicalMemory* m_physical_memory;
-	size_type m_bucket_size;
-	size_type m_bucket_capacity;
-};
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::Block::destroy(Block* block) noexcept
+{
+	block->~Block();
+	operator delete(block, std::align_val_t(alignment()));
+}
 
-// !BucketStorage
-template< typename T >
-BucketStorage< T >::BucketStorage() noexcept :
-	m_physical_memory(new PhysicalMemory(64)), m_virtual_memory(new VirtualMemory()), m_bucket_size(0), m_bucket_capacity(64)
+template< typename T, typename... Options >
+constexpr typename BucketStorage< T, Options... >::size_type BucketStorage< T, Options... >::Block::alignment()
 {
+	size_type result = alignof(Block);
+	result = result < alignof(Element) ? alignof(Element) : result;
+	result = result < alignof(std::uint64_t) ? alignof(std::uint64_t) : result;
+	return result < alignof(value_type) ? alignof(value_type) : result;
 }
 
-template< typename T >
-BucketStorage< T >::BucketStorage(size_type m_bucket_capacity) noexcept :
-	m_physical_memory(new PhysicalMemory(m_bucket_capacity)), m_virtual_memory(new VirtualMemory()), m_bucket_size(0),
-	m_bucket_capacity(m_bucket_capacity)
+template< typename T, typename... Options >
+constexpr typename BucketStorage< T, Options... >::size_type BucketStorage< T, Options... >::Block::footprint(size_type capacity)
 {
+	return occupancy_offset(capacity) + occupancy_words(capacity) * sizeof(std::uint64_t);
 }
 
-template< typename T >
-BucketStorage< T >::BucketStorage(const BucketStorage& other) :
-	m_bucket_capacity(other.m_bucket_capacity), m_physical_memory(new PhysicalMemory(other.m_bucket_capacity)),
-	m_virtual_memory(new VirtualMemory()), m_bucket_size(0)
+template< typename T, typename... Options >
+constexpr typename BucketStorage< T, Options... >::size_type BucketStorage< T, Options... >::Block::elements_offset()
 {
-	const_iterator temp = other.begin();
-	while (temp != other.end())
-	{
-		insert(*temp);
-		++temp;
-	}
+	return details::align_up(sizeof(Block), alignof(Element));
 }
 
-template< typename T >
-BucketStorage< T >::BucketStorage(BucketStorage&& other) noexcept :
-	m_bucket_size(other.m_bucket_size), m_bucket_capacity(other.m_bucket_capacity),
-	m_physical_memory(std::move(other.m_physical_memory)), m_virtual_memory(std::move(other.m_virtual_memory))
+template< typename T, typename... Options >
+constexpr typename BucketStorage< T, Options... >::size_type BucketStorage< T, Options... >::Block::data_offset(size_type capacity)
 {
-	other.m_physical_memory = nullptr;
-	other.m_virtual_memory = nullptr;
-	other.m_bucket_size = 0;
-	other.m_bucket_capacity = 0;
+	return details::align_up(elements_offset() + capacity * sizeof(Element), alignof(value_type));
 }
 
-template< typename T >
-BucketStorage< T >::~BucketStorage()
+template< typename T, typename... Options >
+constexpr typename BucketStorage< T, Options... >::size_type BucketStorage< T, Options... >::Block::occupancy_offset(size_type capacity)
 {
-	while (!empty())
-	{
-		erase(begin());
-	}
-	delete m_physical_memory;
-	delete m_virtual_memory;
+	return details::align_up(data_offset(capacity) + capacity * sizeof(value_type), alignof(std::uint64_t));
 }
 
-template< typename T >
-BucketStorage< T >& BucketStorage< T >::operator=(BucketStorage< T >&& other) noexcept
+template< typename T, typename... Options >
+constexpr typename BucketStorage< T, Options... >::size_type BucketStorage< T, Options... >::Block::occupancy_words(size_type capacity)
 {
-	if (this == &other)
-		return *this;
+	return (capacity + 63) / 64;
+}
 
-	BucketStorage temp(std::move(other));
-	swap(temp);
+template< typename T, typename... Options >
+std::uint64_t* BucketStorage< T, Options... >::Block::get_occupancy() noexcept
+{
+	return reinterpret_cast< std::uint64_t* >(reinterpret_cast< char* >(this) + occupancy_offset(m_capacity));
+}
 
-	return *this;
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::Block::set_live(size_type pos) noexcept
+{
+	get_occupancy()[pos / 64] |= std::uint64_t(1) << (pos % 64);
 }
 
-template< typename T >
-BucketStorage< T >& BucketStorage< T >::operator=(const BucketStorage& other)
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::Block::set_free(size_type pos) noexcept
 {
-	if (this != &other)
+	get_occupancy()[pos / 64] &= ~(std::uint64_t(1) << (pos % 64));
+}
+
+// First live slot at or after `pos`, m_head if there is none.
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::size_type BucketStorage< T, Options... >::Block::find_live(size_type pos) noexcept
+{
+	if (pos >= m_head)
+		return m_head;
+	const std::uint64_t* words = get_occupancy();
+	size_type word_index = pos / 64;
+	size_type last_word = (m_head - 1) / 64;
+	std::uint64_t word = words[word_index] & (~std::uint64_t(0) << (pos % 64));
+	while (word == 0)
 	{
-		BucketStorage temp(other);
-		swap(temp);
+		if (++word_index > last_word)
+			return m_head;
+		word = words[word_index];
 	}
-	return *this;
+	return word_index * 64 + static_cast< size_type >(std::countr_zero(word));
 }
 
-template< typename T >
-template< typename U >
-typename BucketStorage< T >::iterator BucketStorage< T >::insert_impl(U&& x)
+// Used after the Element array was filled in bulk: every slot below m_head is live except those on the free chain.
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::Block::rebuild_occupancy() noexcept
 {
-	auto* el = new Element(m_virtual_memory->get_end()->get_time() + 1);
-	try
+	std::uint64_t* words = get_occupancy();
+	std::memset(words, 0, occupancy_words(m_capacity) * sizeof(std::uint64_t));
+	for (size_type i = 0; i < m_head / 64; ++i)
 	{
-		m_physical_memory->push(std::forward< U >(x), el);
-	} catch (int)
+		words[i] = ~std::uint64_t(0);
+	}
+	if (m_head % 64 != 0)
+		words[m_head / 64] = (std::uint64_t(1) << (m_head % 64)) - 1;
+	for (size_type pos = m_free_head; pos != npos; pos = get_element(pos)->get_next())
 	{
-		delete el;
-		throw;
+		set_free(pos);
 	}
-	m_virtual_memory->push(el);
-	m_bucket_size++;
-	return iterator(el);
 }
 
-template< typename T >
-typename BucketStorage< T >::iterator BucketStorage< T >::insert(const value_type& x)
+// Everything but the owner count, which stays at one for the fresh block.
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::Block::copy_from(Block& other) noexcept
 {
-	return insert_impl(x);
+	m_head = other.m_head;
+	m_size = other.m_size;
+	m_capacity = other.m_capacity;
+	m_free_head = other.m_free_head;
+	m_min_time = other.m_min_time;
+	m_max_time = other.m_max_time;
+	std::memcpy(reinterpret_cast< char* >(this) + elements_offset(),
+				reinterpret_cast< const char* >(&other) + elements_offset(),
+				footprint(m_capacity) - elements_offset());
 }
 
-template< typename T >
-typename BucketStorage< T >::iterator BucketStorage< T >::insert(value_type&& x)
+// Everything but the values and the owner count, for a copy that constructs the values itself.
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::Block::copy_layout(Block& other) noexcept
 {
-	return insert_impl(std::move(x));
+	m_head = other.m_head;
+	m_size = other.m_size;
+	m_capacity = other.m_capacity;
+	m_free_head = other.m_free_head;
+	m_min_time = other.m_min_time;
+	m_max_time = other.m_max_time;
+	std::memcpy(reinterpret_cast< char* >(this) + elements_offset(),
+				reinterpret_cast< const char* >(&other) + elements_offset(),
+				data_offset(m_capacity) - elements_offset());
+	std::memcpy(get_occupancy(), other.get_occupancy(), occupancy_words(m_capacity) * sizeof(std::uint64_t));
 }
 
-template< typename T >
-typename BucketStorage< T >::iterator BucketStorage< T >::begin() noexcept
+// Writes, for each word of the occupancy bitmap, `base` plus the live slots in the words before it.
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::Block::rank_words(size_type base, size_type* ranks) noexcept
 {
-	return iterator(m_virtual_memory->get_start());
+	const std::uint64_t* words = get_occupancy();
+	for (size_type i = 0; i < occupancy_words(m_capacity); ++i)
+	{
+		ranks[i] = base;
+		base += static_cast< size_type >(std::popcount(words[i]));
+	}
 }
 
-template< typename T >
-typename BucketStorage< T >::iterator BucketStorage< T >::end() noexcept
+// The rank_words() entry of the word holding `pos` plus the live slots below `pos` in that word.
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::size_type BucketStorage< T, Options... >::Block::rank(size_type pos, const size_type* ranks) noexcept
 {
-	return iterator(m_virtual_memory->get_over_end());
+	std::uint64_t below = get_occupancy()[pos / 64] & ((std::uint64_t(1) << (pos % 64)) - 1);
+	return ranks[pos / 64] + static_cast< size_type >(std::popcount(below));
 }
 
-template< typename T >
-typename BucketStorage< T >::const_iterator BucketStorage< T >::begin() const noexcept
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::size_type BucketStorage< T, Options... >::Block::occupancy_word_count() const noexcept
 {
-	return const_iterator(m_virtual_memory->get_start());
+	return occupancy_words(m_capacity);
 }
 
-template< typename T >
-typename BucketStorage< T >::const_iterator BucketStorage< T >::end() const noexcept
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::Element* BucketStorage< T, Options... >::Block::get_element(size_type pos)
 {
-	return const_iterator(m_virtual_memory->get_over_end());
+	return reinterpret_cast< Element* >(reinterpret_cast< char* >(this) + elements_offset()) + pos;
 }
 
-template< typename T >
-typename BucketStorage< T >::const_iterator BucketStorage< T >::cbegin() noexcept
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::value_type* BucketStorage< T, Options... >::Block::get_data(size_type pos)
 {
-	if (m_virtual_memory != nullptr)
-	{
-		return const_iterator(m_virtual_memory->get_start());
-	}
-	return const_iterator(nullptr);
+	return reinterpret_cast< value_type* >(reinterpret_cast< char* >(this) + data_offset(m_capacity)) + pos;
 }
 
-template< typename T >
-typename BucketStorage< T >::const_iterator BucketStorage< T >::cend() noexcept
+// !Element
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::link_type BucketStorage< T, Options... >::Element::get_next() const
 {
-	if (m_virtual_memory != nullptr)
-	{
-		return const_iterator(m_virtual_memory->get_end()->get_next());
-	}
-	return const_iterator(nullptr);
+	return m_next;
 }
 
-template< typename T >
-typename BucketStorage< T >::iterator BucketStorage< T >::erase(iterator iter)
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::link_type BucketStorage< T, Options... >::Element::get_prev() const
 {
-	Element* el = iter.get_current();
-	if (el == nullptr)
-		return end();
-
-	if (el->get_block_link()->m_size == el->get_block_link()->m_capacity)
-	{
-		m_physical_memory->push_free_block(el->get_block_link());
-	}
-
-	el->get_block_link()->m_free_pos->push(el->get_pos());
-	--el->get_block_link()->m_size;
-
-	if (el->get_prev() != nullptr)
-		el->get_prev()->set_next(el->get_next());
-	else
-		m_virtual_memory->set_start(el->get_next());
+	return m_prev;
+}
 
-	if (el->get_next() != nullptr)
-		el->get_next()->set_prev(el->get_prev());
-	else
-		m_virtual_memory->set_end(el->get_prev());
+template< typename T, typename... Options >
+typename BucketStorage< T, Options... >::stamp_type BucketStorage< T, Options... >::Element::get_time() const
+{
+	return m_time;
+}
 
-	Element* next_el = el->get_next();
-	el->get_block_link()->get_data(el->get_pos())->~value_type();
-	m_physical_memory->empty(el->get_block_link());
-	delete el;
-	m_bucket_size--;
-	return iterator(next_el);
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::Element::set_time(stamp_type time)
+{
+	m_time = time;
 }
 
-template< typename T >
-typename BucketStorage< T >::iterator BucketStorage< T >::get_to_distance(iterator it, const difference_type dist) noexcept
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::Element::set_next(link_type next)
 {
-	for (difference_type i = 0; i < dist; i++)
-	{
-		++it;
-	}
-	for (difference_type i = 0; i > dist; i--)
-	{
-		--it;
-	}
-	return it;
+	m_next = next;
 }
 
-template< typename T >
-typename BucketStorage< T >::size_type BucketStorage< T >::size() const noexcept
+template< typename T, typename... Options >
+void BucketStorage< T, Options... >::Element::set_prev(link_type prev)
 {
-	return m_bucket_size;
+	m_prev = prev;
 }
 
-template< typename T >
-typename BucketStorage< T >::size_type BucketStorage< T >::capacity() const noexcept
+// !Iterator
+
+template< typename T, typename... Options >
+template< bool IsConst >
+BucketStorage< T, Options... >::BaseIterator< IsConst >::BaseIterator() noexcept :
+	m_memory(nullptr), m_current(npos), m_block(nullptr)
 {
-	return m_bucket_capacity * m_physical_memory->size();
 }
 
-template< typename T >
-bool BucketStorage< T >::empty() const noexcept
+template< typename T, typename... Options >
+template< bool IsConst >
+BucketStorage< T, Options... >::BaseIterator< IsConst >::BaseIterator(VirtualMemory* memory, link_type current) :
+	m_memory(memory), m_current(current),
+	m_block(is_shared || memory == nullptr || current == npos ? nullptr : memory->get_block(current))
 {
-	return m_bucket_size == 0;
 }
 
-template< typename T >
-void BucketStorage< T >::clear() noexcept
+template< typename T, typename... Options >
+template< bool IsConst >
+typename BucketStorage< T, Options... >::template BaseIterator< IsConst >::reference
+	BucketStorage< T, Options... >::BaseIterator< IsConst >::operator*() const
 {
-	while (!empty())
-		erase(begin());
-	m_virtual_memory->set_start(m_virtual_memory->get_over_end());
-	m_virtual_memory->set_end(m_virtual_memory->get_over_end());
-	m_physical_memory->clear_free_blocks();
-	m_bucket_size = 0;
+	if constexpr (!IsConst)
+		m_memory->touch(m_current);
+	return *data();
+}
+
+template< typename T, typename... Options >
+template< bool IsConst >
+typename BucketStorage< T, Options... >::template BaseIterator< IsConst >::pointer
+	BucketStorage< T, Options... >::BaseIterator< IsConst >::operator->() const
+{
+	if constexpr (!IsConst)
+		m_memory->touch(m_current);
+	return data();
 }
 
-template< typename T >
-void BucketStorage< T >::shrink_to_fit()
+template< typename T, typename... Options >
+template< bool IsConst >
+typename BucketStorage< T, Options... >::template BaseIterator< IsConst >&
+	BucketStorage< T, Options... >::BaseIterator< IsConst >::operator++()
 {
-	BucketStorage temp_bucket(m_bucket_capacity);
-	iterator i = begin();
-	while (i != end())
-	{
-		temp_bucket.insert(std::move(*i));
-		i++;
-	}
-	swap(temp_bucket);
+	step(element()->get_next());
+	return *this;
 }
 
-template< typename T >
-void BucketStorage< T >::swap(BucketStorage& other) noexcept
+template< typename T, typename... Options >
+template< bool IsConst >
+typename BucketStorage< T, Options... >::template BaseIterator< IsConst >
+	BucketStorage< T, Options... >::BaseIterator< IsConst >::operator++(int)
 {
-	using std::swap;
-	swap(m_virtual_memory, other.m_virtual_memory);
-	swap(m_bucket_capacity, other.m_bucket_capacity);
-	swap(m_bucket_size, other.m_bucket_size);
-	swap(m_physical_memory, other.m_physical_memory);
+	BaseIterator tmp = *this;
+	++(*this);
+	return tmp;
 }
 
-//  !VirtualMemory
-template< typename T >
-BucketStorage< T >::VirtualMemory::VirtualMemory() : m_over_end(new Element(0))
+template< typename T, typename... Options >
+template< bool IsConst >
+typename BucketStorage< T, Options... >::template BaseIterator< IsConst >&
+	BucketStorage< T, Options... >::BaseIterator< IsConst >::operator--()
 {
-	m_end = m_over_end;
-	m_start = m_over_end;
+	step(element()->get_prev());
+	return *this;
 }
 
-template< typename T >
-BucketStorage< T >::VirtualMemory::~VirtualMemory()
+template< typename T, typename... Options >
+template< bool IsConst >
+typename BucketStorage< T, Options... >::template BaseIterator< IsConst >
+	BucketStorage< T, Options... >::BaseIterator< IsConst >::operator--(int)
 {
-	Element* current = m_start;
-	while (current != nullptr)
-	{
-		Element* next = current->get_next();
-		delete current;
-		current = next;
-	}
+	BaseIterator tmp = *this;
+	--(*this);
+	return tmp;
 }
 
-template< typename T >
-void BucketStorage< T >::VirtualMemory::push(Element* el)
+// Same as n increments (or -n decrements), but the walk keeps the link, block and slot mask in registers and only
+// goes through the block table when the chain leaves the current block.
+template< typename T, typename... Options >
+template< bool IsConst >
+typename BucketStorage< T, Options... >::template BaseIterator< IsConst >&
+	BucketStorage< T, Options... >::BaseIterator< IsConst >::advance_by(difference_type n)
 {
-	if (m_start == m_over_end)
+	if constexpr (is_shared)
 	{
-		m_start = el;
-		m_end = el;
+		for (; n > 0; --n)
+			m_current = m_memory->get_element(m_current)->get_next();
+		for (; n < 0; ++n)
+			m_current = m_memory->get_element(m_current)->get_prev();
 	}
 	else
 	{
-		m_end->set_next(el);
-		el->set_prev(m_end);
-		m_end = el;
+		const link_type mask = m_memory->get_slot_mask();
+		link_type current = m_current;
+		Block* block = m_block;
+		auto advance = [&](auto following)
+		{
+			Element* el = block == nullptr ? m_memory->get_element(current) : block->get_element(current & mask);
+			link_type next = following(el);
+			if (block == nullptr || next == npos || ((next ^ current) & ~mask) != 0)
+				block = m_memory->get_block(next);
+			current = next;
+		};
+		for (; n > 0; --n)
+			advance([](Element* el) { return el->get_next(); });
+		for (; n < 0; ++n)
+			advance([](Element* el) { return el->get_prev(); });
+		m_current = current;
+		m_block = block;
 	}
-	m_over_end->set_prev(m_end);
-	m_end->set_next(m_over_end);
-	m_over_end->set_time(m_end->get_time() + 1);
+	return *this;
 }
 
-template< typename T >
-void BucketStorage< T >::VirtualMemory::pop()
+template< typename T, typename... Options >
+template< bool IsConst >
+typename BucketStorage< T, Options... >::Element* BucketStorage< T, Options... >::BaseIterator< IsConst >::element() const
 {
-	if (m_end->m_prev != nullptr)
-	{
-		m_end = m_end->m_prev;
-		delete m_end->m_next;
-		m_end->m_next = nullptr;
-		m_over_end->m_prev = m_end;
-		m_over_end->m_time = m_end->m_time + 1;
-	}
-	else
-	{
-		m_start = m_over_end;
-		m_end = m_over_end;
-	}
+	if (m_block == nullptr)
+		return m_memory->get_element(m_current);
+	return m_block->get_element(m_current & m_memory->get_slot_mask());
 }
 
-template< typename T >
-typename BucketStorage< T >::Element* BucketStorage< T >::VirtualMemory::get_end()
+template< typename T, typename... Options >
+template< bool IsConst >
+typename BucketStorage< T, Options... >::value_type* BucketStorage< T, Options... >::BaseIterator< IsConst >::data() const
 {
-	return m_end;
+	if (m_block == nullptr)
+		return m_memory->get_data(m_current);
+	return m_block->get_data(m_current & m_memory->get_slot_mask());
 }
 
-template< typename T >
-typename BucketStorage< T >::Element* BucketStorage< T >::VirtualMemory::get_start()
+template< typename T, typename... Options >
+template< bool IsConst >
+void BucketStorage< T, Options... >::BaseIterator< IsConst >::step(link_type next)
 {
-	return m_start;
+	if constexpr (!is_shared)
+	{
+		if (m_block == nullptr || next == npos || ((next ^ m_current) & ~m_memory->get_slot_mask()) != 0)
+			m_block = m_memory->get_block(next);
+	}
+	m_current = next;
 }
 
-template< typename T >
-typename BucketStorage< T >::Element* BucketStorage< T >::VirtualMemory::get_over_end()
+template< typename T, typename... Options >
+template< bool IsConst >
+template< bool OtherIsConst >
+bool BucketStorage< T, Options... >::BaseIterator< IsConst >::operator>=(const BaseIterator< OtherIsConst >& other) const
 {
-	return m_over_end;
+	return get_time() >= other.get_time();
 }
 
-template< typename T >
-void BucketStorage< T >::VirtualMemory::set_start(Element* el)
+template< typename T, typename... Options >
+template< bool IsConst >
+template< bool OtherIsConst >
+bool BucketStorage< T, Options... >::BaseIterator< IsConst >::operator<=(const BaseIterator< OtherIsConst >& other) const
 {
-	m_start = el;
+	return get_time() <= other.get_time();
 }
 
-template< typename T >
-void BucketStorage< T >::VirtualMemory::set_end(Element* el)
+template< typename T, typename... Options >
+template< bool IsConst >
+typename BucketStorage< T, Options... >::link_type BucketStorage< T, Options... >::BaseIterator< IsConst >::get_current() const
 {
-	m_end = el;
+	return m_current;
 }
 
-// !PhysicalMemory
-template< typename T >
-BucketStorage< T >::PhysicalMemory::PhysicalMemory(size_type m_bucket_capacity) :
-	m_last_block(nullptr), m_free_blocks(new StackBlock()), m_bucket_capacity(m_bucket_capacity), m_size(0)
+template< typename T, typename... Options >
+template< bool IsConst >
+typename BucketStorage< T, Options... >::stamp_type BucketStorage< T, Options... >::BaseIterator< IsConst >::get_time() const
 {
+	return element()->get_time();
 }
 
-template< typename T >
-BucketStorage< T >::PhysicalMemory::~PhysicalMemory()
+template< typename T, typename... Options >
+template< bool IsConst >
+template< bool OtherIsConst >
+bool BucketStorage< T, Options... >::BaseIterator< IsConst >::operator==(const BaseIterator< OtherIsConst >& other) const
 {
-	delete m_free_blocks;
+	return m_current == other.get_current();
 }
 
-template< typename T >
-void BucketStorage< T >::PhysicalMemory::push(const value_type& x, Element* el)
+template< typename T, typename... Options >
+template< bool IsConst >
+template< bool OtherIsConst >
+bool BucketStorage< T, Options... >::BaseIterator< IsConst >::operator!=(const BaseIterator< OtherIsConst >& other) const
 {
-	ensure_capacity();
-	auto* m_active_block = m_free_blocks->peek();
-	if (!m_active_block->m_free_pos->empty())
-	{
-		el->set_pos(m_active_block->m_free_pos->pop());
-		new (m_active_block->get_data(el->get_pos())) value_type(x);
-	}
-	else
-	{
-		new (m_active_block->get_data(m_active_block->m_head)) value_type(x);
-		el->set_pos(m_active_block->m_head);
-		++m_active_block->m_head;
-	}
-	el->set_block_link(m_active_block);
-	++m_active_block->m_size;
+	return m_current != other.get_current();
 }
 
-template< typename T >
-void BucketStorage< T >::PhysicalMemory::push(value_type&& x, Element* el)
+template< typename T, typename... Options >
+template< bool IsConst >
+template< bool OtherIsConst >
+bool BucketStorage< T, Options... >::BaseIterator< IsConst >::operator>(const BaseIterator< OtherIsConst >& other) const
 {
-	ensure_capacity();
-	auto* m_active_block = m_free_blocks->peek();
-	if (!m_active_block->m_free_pos->empty())
-	{
-		el->set_pos(m_active_block->m_free_pos->pop());
-		new (m_active_block->get_data(el->get_pos())) value_type(std::move(x));
-	}
-	else
-	{
-		new (m_active_block->get_data(m_active_block->m_head)) value_type(std::move(x));
-		el->set_pos(m_active_block->m_head);
-		++m_active_block->m_head;
-	}
-	el->set_block_link(m_active_block);
-	++m_active_block->m_size;
+	return get_time() > other.get_time();
 }
 
-template< typename T >
-typename BucketStorage< T >::size_type BucketStorage< T >::PhysicalMemory::empty(Block* block_link)
+template< typename T, typename... Options >
+template< bool IsConst >
+template< bool OtherIsConst >
+bool BucketStorage< T, Options... >::BaseIterator< IsConst >::operator<(const BaseIterator< OtherIsConst >& other) const
 {
-	if (block_link->m_size == 0)
-	{
-		if (block_link->m_prev == nullptr)
-		{
-			if (block_link->m_next != nullptr)
-			{
-				block_link->m_next->m_prev = nullptr;
-			}
+	return get_time() < other.get_time();
+}
 
-			delete block_link;
-			m_last_block = nullptr;
+// !PrefetchIterator
 
-			m_size--;
-		}
-		else
-		{
-			m_size--;
-			block_link = block_link->m_prev;
-			delete block_link->m_next;
-			block_link->m_next = nullptr;
-			m_last_block = nullptr;
-		}
+template< typename T, typename... Options >
+template< bool IsConst >
+BucketStorage< T, Options... >::BasePrefetchIterator< IsConst >::BasePrefetchIterator(VirtualMemory* memory,
+																					   link_type current,
+																					   size_type distance) noexcept :
+	m_memory(memory), m_current(current), m_ahead(current), m_run(0)
+{
+	for (size_type i = 0; i < distance && m_ahead != npos; ++i)
+	{
+		m_ahead = m_memory->prefetch_next(m_ahead, m_run);
 	}
-
-	return 0;
 }
 
-template< typename T >
-void BucketStorage< T >::PhysicalMemory::push_free_block(Block* block_link)
+template< typename T, typename... Options >
+template< bool IsConst >
+typename BucketStorage< T, Options... >::template BasePrefetchIterator< IsConst >::reference
+	BucketStorage< T, Options... >::BasePrefetchIterator< IsConst >::operator*() const
 {
-	m_free_blocks->push(block_link);
+	if constexpr (!IsConst)
+		m_memory->touch(m_current);
+	return *m_memory->get_data(m_current);
 }
 
-template< typename T >
-void BucketStorage< T >::PhysicalMemory::clear_free_blocks()
+template< typename T, typename... Options >
+template< bool IsConst >
+typename BucketStorage< T, Options... >::template BasePrefetchIterator< IsConst >::pointer
+	BucketStorage< T, Options... >::BasePrefetchIterator< IsConst >::operator->() const
 {
-	m_free_blocks->clear();
+	if constexpr (!IsConst)
+		m_memory->touch(m_current);
+	return m_memory->get_data(m_current);
 }
 
-template< typename T >
-void BucketStorage< T >::PhysicalMemory::ensure_capacity()
+template< typename T, typename... Options >
+template< bool IsConst >
+typename BucketStorage< T, Options... >::template BasePrefetchIterator< IsConst >&
+	BucketStorage< T, Options... >::BasePrefetchIterator< IsConst >::operator++()
 {
-	auto* m_active_block = m_free_blocks->peek();
-
-	if (m_active_block == nullptr)
-	{
-		m_size++;
-		m_active_block = new Block(m_bucket_capacity);
-		if (m_last_block != nullptr)
-		{
-			m_last_block->m_next = m_active_block;
-			m_active_block->m_prev = m_last_block;
-			m_last_block = m_active_block;
-			m_free_blocks->push(m_active_block);
-		}
-		else
-		{
-			m_last_block = m_active_block;
-			m_free_blocks->push(m_active_block);
-		}
-	}
-	if (m_active_block->m_size == m_bucket_capacity)
-	{
-		m_size++;
-		m_free_blocks->pop();
-		auto* new_block = new Block(m_bucket_capacity);
-		new_block->m_prev = m_active_block;
-		m_active_block->m_next = new_block;
-		m_active_block = new_block;
-		m_free_blocks->push(m_active_block);
-	}
+	if (m_ahead != npos)
+		m_ahead = m_memory->prefetch_next(m_ahead, m_run);
+	m_current = m_memory->get_element(m_current)->get_next();
+	return *this;
 }
 
-template< typename T >
-typename BucketStorage< T >::size_type BucketStorage< T >::PhysicalMemory::size() const noexcept
+template< typename T, typename... Options >
+template< bool IsConst >
+typename BucketStorage< T, Options... >::template BasePrefetchIterator< IsConst >
+	BucketStorage< T, Options... >::BasePrefetchIterator< IsConst >::operator++(int)
 {
-	return m_size;
+	BasePrefetchIterator tmp = *this;
+	++(*this);
+	return tmp;
 }
 
-// !Block
-template< typename T >
-BucketStorage< T >::Block::Block(const size_type m_bucket_capacity) :
-	m_prev(nullptr), m_next(nullptr), m_head(0), m_free_pos(new StackIndexes), m_size(0), m_capacity(m_bucket_capacity)
+template< typename T, typename... Options >
+template< bool IsConst >
+template< bool OtherIsConst >
+bool BucketStorage< T, Options... >::BasePrefetchIterator< IsConst >::operator==(const BaseIterator< OtherIsConst >& other) const
 {
-	m_arr = static_cast< value_type* >(operator new[](m_capacity * sizeof(value_type)));
+	return m_current == other.get_current();
 }
 
-template< typename T >
-BucketStorage< T >::Block::~Block()
+template< typename T, typename... Options >
+template< bool IsConst >
+template< bool OtherIsConst >
+bool BucketStorage< T, Options... >::BasePrefetchIterator< IsConst >::operator!=(const BaseIterator< OtherIsConst >& other) const
 {
-	if (m_arr != nullptr)
-	{
-		operator delete[](m_arr);
-		m_arr = nullptr;
-	}
-	delete m_free_pos;
+	return m_current != other.get_current();
 }
 
-template< typename T >
-typename BucketStorage< T >::value_type* BucketStorage< T >::Block::get_data(size_type pos)
+template< typename T, typename... Options >
+template< bool IsConst >
+template< bool OtherIsConst >
+bool BucketStorage< T, Options... >::BasePrefetchIterator< IsConst >::operator==(const BasePrefetchIterator< OtherIsConst >& other) const
 {
-	return &m_arr[pos];
+	return m_current == other.get_current();
 }
 
-// !Element
-template< typename T >
-BucketStorage< T >::Element::Element(size_type time) :
-	m_block_link(nullptr), m_pos(0), m_next(nullptr), m_prev(nullptr), m_time(time)
+template< typename T, typename... Options >
+template< bool IsConst >
+template< bool OtherIsConst >
+bool BucketStorage< T, Options... >::BasePrefetchIterator< IsConst >::operator!=(const BasePrefetchIterator< OtherIsConst >& other) const
 {
+	return m_current != other.get_current();
 }
 
-template< typename T >
-BucketStorage< T >::Element::~Element()
+template< typename T, typename... Options >
+template< bool IsConst >
+typename BucketStorage< T, Options... >::template BaseIterator< IsConst >
+	BucketStorage< T, Options... >::BasePrefetchIterator< IsConst >::base() const
 {
-	if (m_prev)
-	{
-		m_prev->m_next = m_next;
-	}
-	if (m_next)
-	{
-		m_next->m_prev = m_prev;
-	}
+	return BaseIterator< IsConst >(m_memory, m_current);
 }
 
-template< typename T >
-bool BucketStorage< T >::Element::operator==(const Element& other)
+template< typename T, typename... Options >
+template< bool IsConst >
+typename BucketStorage< T, Options... >::link_type BucketStorage< T, Options... >::BasePrefetchIterator< IsConst >::get_current() const
 {
-	return m_time == other.m_time;
+	return m_current;
 }
 
-template< typename T >
-bool BucketStorage< T >::Element::operator!=(const Element& other)
-{
-	return m_time != other.m_time;
-}
+// !UnorderedIterator
 
-template< typename T >
-bool BucketStorage< T >::Element::operator<=(const Element& other)
+template< typename T, typename... Options >
+template< bool IsConst >
+BucketStorage< T, Options... >::BaseUnorderedIterator< IsConst >::BaseUnorderedIterator(VirtualMemory* memory, link_type current) noexcept :
+	m_memory(memory), m_current(current)
 {
-	return m_time <= other.m_time;
 }
 
-template< typename T >
-typename BucketStorage< T >::Element* BucketStorage< T >::Element::get_next()
+template< typename T, typename... Options >
+template< bool IsConst >
+typename BucketStorage< T, Options... >::template BaseUnorderedIterator< IsConst >::reference
+	BucketStorage< T, Options... >::BaseUnorderedIterator< IsConst >::operator*() const
 {
-	return m_next;
+	if constexpr (!IsConst)
+		m_memory->touch(m_current);
+	return *m_memory->get_data(m_current);
 }
 
-template< typename T >
-typename BucketStorage< T >::size_type BucketStorage< T >::Element::get_time() const
+template< typename T, typename... Options >
+template< bool IsConst >
+typename BucketStorage< T, Options... >::template BaseUnorderedIterator< IsConst >::pointer
+	BucketStorage< T, Options... >::BaseUnorderedIterator< IsConst >::operator->() const
 {
-	return m_time;
+	if constexpr (!IsConst)
+		m_memory->touch(m_current);
+	return m_memory->get_data(m_current);
 }
 
-template< typename T >
-void BucketStorage< T >::Element::set_time(size_type time)
+template< typename T, typename... Options >
+template< bool IsConst >
+typename BucketStorage< T, Options... >::template BaseUnorderedIterator< IsConst >&
+	BucketStorage< T, Options... >::BaseUnorderedIterator< IsConst >::operator++()
 {
-	m_time = time;
+	m_current = m_memory->next_live(m_current + 1);
+	return *this;
 }
 
-template< typename T >
-void BucketStorage< T >::Element::set_pos(const size_type pos)
+template< typename T, typename... Options >
+template< bool IsConst >
+typename BucketStorage< T, Options... >::template BaseUnorderedIterator< IsConst >
+	BucketStorage< T, Options... >::BaseUnorderedIterator< IsConst >::operator++(int)
 {
-	m_pos = pos;
+	BaseUnorderedIterator tmp = *this;
+	++(*this);
+	return tmp;
 }
 
-template< typename T >
-typename BucketStorage< T >::size_type BucketStorage< T >::Element::get_pos() const
+template< typename T, typename... Options >
+template< bool IsConst >
+template< bool OtherIsConst >
+bool BucketStorage< T, Options... >::BaseUnorderedIterator< IsConst >::operator==(const BaseUnorderedIterator< OtherIsConst >& other) const
 {
-	return m_pos;
+	return m_current == other.get_current();
 }
 
-template< typename T >
-void BucketStorage< T >::Element::set_block_link(Block* block_link)
+template< typename T, typename... Options >
+template< bool IsConst >
+template< bool OtherIsConst >
+bool BucketStorage< T, Options... >::BaseUnorderedIterator< IsConst >::operator!=(const BaseUnorderedIterator< OtherIsConst >& other) const
 {
-	m_block_link = block_link;
+	return m_current != other.get_current();
 }
 
-template< typename T >
-typename BucketStorage< T >::Block* BucketStorage< T >::Element::get_block_link()
+template< typename T, typename... Options >
+template< bool IsConst >
+typename BucketStorage< T, Options... >::template BaseIterator< IsConst >
+	BucketStorage< T, Options... >::BaseUnorderedIterator< IsConst >::base() const
 {
-	return m_block_link;
+	return BaseIterator< IsConst >(m_memory, m_current);
 }
 
-template< typename T >
-void BucketStorage< T >::Element::set_next(Element* next)
+template< typename T, typename... Options >
+template< bool IsConst >
+typename BucketStorage< T, Options... >::link_type BucketStorage< T, Options... >::BaseUnorderedIterator< IsConst >::get_current() const
 {
-	m_next = next;
+	return m_current;
 }
 
-template< typename T >
-void BucketStorage< T >::Element::set_prev(Element* prev)
+// !BlockHandoff
+template< typename T, typename... Options >
+BlockHandoff< T, Options... >::BlockHandoff(size_type m_block_capacity, size_type queue_blocks) :
+	m_block_capacity(m_block_capacity == 0 ? 1 : m_block_capacity), m_published(queue_blocks), m_returned(queue_blocks),
+	m_current(nullptr), m_reading(nullptr), m_read_pos(0)
 {
-	m_prev = prev;
 }
 
-template< typename T >
-typename BucketStorage< T >::Element* BucketStorage< T >::Element::get_prev()
+// Values that were pushed but never consumed are destroyed here; both threads must be done with the handoff.
+template< typename T, typename... Options >
+BlockHandoff< T, Options... >::~BlockHandoff()
 {
-	return m_prev;
+	Block* block = m_reading;
+	if (block != nullptr)
+	{
+		destroy_values(block, m_read_pos);
+		Block::destroy(block);
+	}
+	while (m_published.try_pop(block))
+	{
+		destroy_values(block, 0);
+		Block::destroy(block);
+	}
+	for (Block* pending : m_backlog)
+	{
+		destroy_values(pending, 0);
+		Block::destroy(pending);
+	}
+	if (m_current != nullptr)
+	{
+		destroy_values(m_current, 0);
+		Block::destroy(m_current);
+	}
+	while (m_returned.try_pop(block))
+	{
+		Block::destroy(block);
+	}
 }
 
-template< typename T >
-bool BucketStorage< T >::Element::operator<(const Element& other)
+template< typename T, typename... Options >
+void BlockHandoff< T, Options... >::push(const value_type& x)
 {
-	return m_time < other.m_time;
+	push_impl(x);
 }
 
-template< typename T >
-bool BucketStorage< T >::Element::operator>(const Element& other)
+template< typename T, typename... Options >
+void BlockHandoff< T, Options... >::push(value_type&& x)
 {
-	return m_time > other.m_time;
+	push_impl(std::move(x));
 }
 
-template< typename T >
-bool BucketStorage< T >::Element::operator>=(const Element& other)
+// A full current block is published before the next one is taken, so a throwing allocation or constructor leaves
+// the handoff as it was.
+template< typename T, typename... Options >
+template< typename U >
+void BlockHandoff< T, Options... >::push_impl(U&& x)
 {
-	return m_time >= other.m_time;
+	if (m_current != nullptr && m_current->m_head == m_current->m_capacity)
+	{
+		publish(m_current);
+		m_current = nullptr;
+	}
+	if (m_current == nullptr)
+	{
+		Block* block = nullptr;
+		m_current = m_returned.try_pop(block) ? block : Block::create(m_block_capacity);
+	}
+	new (m_current->get_data(m_current->m_head)) value_type(std::forward< U >(x));
+	++m_current->m_head;
+	++m_current->m_size;
 }
 
-// !Iterator
-
-template< typename T >
-template< bool IsConst >
-BucketStorage< T >::BaseIterator< IsConst >::BaseIterator(Element* ptr) : m_current(ptr)
+// Publishes the partly filled current block, so the consumer sees everything pushed so far. Unlike push(), this
+// waits for the consumer when the queue is full and blocks are still held back.
+template< typename T, typename... Options >
+void BlockHandoff< T, Options... >::flush()
 {
+	if (m_current != nullptr && m_current->m_head != 0)
+	{
+		publish(m_current);
+		m_current = nullptr;
+	}
+	while (!m_backlog.empty())
+	{
+		if (m_published.try_push(m_backlog.front()))
+			m_backlog.pop_front();
+		else
+			std::this_thread::yield();
+	}
 }
 
-template< typename T >
-template< bool IsConst >
-typename BucketStorage< T >::template BaseIterator< IsConst >::reference
-	BucketStorage< T >::BaseIterator< IsConst >::operator*() const
+// Keeps publication order: a block waits in the backlog while older blocks still do.
+template< typename T, typename... Options >
+void BlockHandoff< T, Options... >::publish(Block* block)
 {
-	return *m_current->get_block_link()->get_data(m_current->get_pos());
+	while (!m_backlog.empty() && m_published.try_push(m_backlog.front()))
+	{
+		m_backlog.pop_front();
+	}
+	if (!m_backlog.empty() || !m_published.try_push(block))
+	{
+		m_backlog.push_back(block);
+	}
 }
 
-template< typename T >
-template< bool IsConst >
-typename BucketStorage< T >::template BaseIterator< IsConst >::pointer
-	BucketStorage< T >::BaseIterator< IsConst >::operator->() const
+// Calls f(value_type&) for every value of every published block, oldest first, and destroys each value after the
+// call. Returns the number of values visited. If f throws, the value it was given counts as consumed and the next
+// call resumes after it.
+template< typename T, typename... Options >
+template< typename F >
+typename BlockHandoff< T, Options... >::size_type BlockHandoff< T, Options... >::consume(F&& f)
 {
-	return m_current->get_block_link()->get_data(m_current->get_pos());
+	size_type consumed = 0;
+	Block* block = m_reading;
+	if (block == nullptr && !m_published.try_pop(block))
+		return 0;
+	do
+	{
+		m_reading = block;
+		size_type count = block->m_head;
+		while (m_read_pos < count)
+		{
+			value_type* value = block->get_data(m_read_pos++);
+			++consumed;
+			struct Destroy
+			{
+				value_type* value;
+				~Destroy() { value->~value_type(); }
+			} destroy{ value };
+			f(*value);
+		}
+		m_reading = nullptr;
+		m_read_pos = 0;
+		recycle(block);
+	} while (m_published.try_pop(block));
+	return consumed;
 }
 
-template< typename T >
-template< bool IsConst >
-typename BucketStorage< T >::template BaseIterator< IsConst >& BucketStorage< T >::BaseIterator< IsConst >::operator++()
+template< typename T, typename... Options >
+void BlockHandoff< T, Options... >::recycle(Block* block) noexcept
 {
-	m_current = m_current->get_next();
-	return *this;
+	block->m_head = 0;
+	block->m_size = 0;
+	if (!m_returned.try_push(block))
+	{
+		Block::destroy(block);
+	}
 }
 
-template< typename T >
-template< bool IsConst >
-typename BucketStorage< T >::template BaseIterator< IsConst > BucketStorage< T >::BaseIterator< IsConst >::operator++(int)
+template< typename T, typename... Options >
+void BlockHandoff< T, Options... >::destroy_values(Block* block, size_type from) noexcept
 {
-	BaseIterator tmp = *this;
-	++(*this);
-	return tmp;
+	for (size_type pos = from; pos < block->m_head; ++pos)
+	{
+		block->get_data(pos)->~value_type();
+	}
 }
 
-template< typename T >
+// !OrderedIterator
+
+template< typename T, typename... Options >
 template< bool IsConst >
-typename BucketStorage< T >::template BaseIterator< IsConst >& BucketStorage< T >::BaseIterator< IsConst >::operator--()
+BucketStorage< T, Options... >::BaseOrderedIterator< IsConst >::BaseOrderedIterator(VirtualMemory* memory,
+																				   typename Order::Cursor cursor) noexcept :
+	m_memory(memory), m_cursor(cursor)
 {
-	m_current = m_current->get_prev();
-	return *this;
 }
 
-template< typename T >
+template< typename T, typename... Options >
 template< bool IsConst >
-typename BucketStorage< T >::template BaseIterator< IsConst > BucketStorage< T >::BaseIterator< IsConst >::operator--(int)
+typename BucketStorage< T, Options... >::template BaseOrderedIterator< IsConst >::reference
+	BucketStorage< T, Options... >::BaseOrderedIterator< IsConst >::operator*() const
 {
-	BaseIterator tmp = *this;
-	--(*this);
-	return tmp;
+	if constexpr (!IsConst)
+		m_memory->touch(m_cursor.link());
+	return *m_memory->get_data(m_cursor.link());
 }
 
-template< typename T >
+template< typename T, typename... Options >
 template< bool IsConst >
-template< bool OtherIsConst >
-bool BucketStorage< T >::BaseIterator< IsConst >::operator>=(const BaseIterator< OtherIsConst >& other) const
+typename BucketStorage< T, Options... >::template BaseOrderedIterator< IsConst >::pointer
+	BucketStorage< T, Options... >::BaseOrderedIterator< IsConst >::operator->() const
 {
-	return *m_current >= *other.m_current;
+	if constexpr (!IsConst)
+		m_memory->touch(m_cursor.link());
+	return m_memory->get_data(m_cursor.link());
 }
 
-template< typename T >
+template< typename T, typename... Options >
 template< bool IsConst >
-template< bool OtherIsConst >
-bool BucketStorage< T >::BaseIterator< IsConst >::operator<=(const BaseIterator< OtherIsConst >& other) const
+typename BucketStorage< T, Options... >::template BaseOrderedIterator< IsConst >&
+	BucketStorage< T, Options... >::BaseOrderedIterator< IsConst >::operator++()
 {
-	return *m_current <= *other.m_current;
+	m_cursor.advance();
+	return *this;
 }
 
-template< typename T >
+template< typename T, typename... Options >
 template< bool IsConst >
-typename BucketStorage< T >::Element* BucketStorage< T >::BaseIterator< IsConst >::get_current() const
+typename BucketStorage< T, Options... >::template BaseOrderedIterator< IsConst >
+	BucketStorage< T, Options... >::BaseOrderedIterator< IsConst >::operator++(int)
 {
-	return m_current;
+	BaseOrderedIterator tmp = *this;
+	++(*this);
+	return tmp;
 }
 
-template< typename T >
+template< typename T, typename... Options >
 template< bool IsConst >
 template< bool OtherIsConst >
-bool BucketStorage< T >::BaseIterator< IsConst >::operator==(const BaseIterator< OtherIsConst >& other) const
+bool BucketStorage< T, Options... >::BaseOrderedIterator< IsConst >::operator==(const BaseOrderedIterator< OtherIsConst >& other) const
 {
-	return *m_current == *other.get_current();
+	return m_cursor == other.m_cursor;
 }
 
-template< typename T >
+template< typename T, typename... Options >
 template< bool IsConst >
 template< bool OtherIsConst >
-bool BucketStorage< T >::BaseIterator< IsConst >::operator!=(const BaseIterator< OtherIsConst >& other) const
+bool BucketStorage< T, Options... >::BaseOrderedIterator< IsConst >::operator!=(const BaseOrderedIterator< OtherIsConst >& other) const
 {
-	return *m_current != *other.get_current();
+	return !(m_cursor == other.m_cursor);
 }
 
-template< typename T >
+template< typename T, typename... Options >
 template< bool IsConst >
-template< bool OtherIsConst >
-bool BucketStorage< T >::BaseIterator< IsConst >::operator>(const BaseIterator< OtherIsConst >& other) const
+typename BucketStorage< T, Options... >::template BaseIterator< IsConst >
+	BucketStorage< T, Options... >::BaseOrderedIterator< IsConst >::base() const
 {
-	return *m_current > *other.m_current;
+	return BaseIterator< IsConst >(m_memory, get_current());
 }
 
-template< typename T >
+template< typename T, typename... Options >
 template< bool IsConst >
-template< bool OtherIsConst >
-bool BucketStorage< T >::BaseIterator< IsConst >::operator<(const BaseIterator< OtherIsConst >& other) const
+typename BucketStorage< T, Options... >::link_type BucketStorage< T, Options... >::BaseOrderedIterator< IsConst >::get_current() const
 {
-	return *m_current < *other.m_current;
+	return m_cursor.leaf == nullptr ? npos : m_cursor.link();
 }
 
 #endif /* BUCKET_STORAGE_HPP */
@@ -3,8 +3,14 @@
 
 #include "bucket_storage.hpp"
 
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
 #include <ostream>
+#include <stdexcept>
 #include <string>
+#include <string_view>
 
 class NoCopy
 {
@@ -18,6 +24,20 @@ class NoCopy
 	NoCopy &operator=(const NoCopy &) { throw -2; }
 };
 
+// The copy made once copyBudget reaches zero throws; the payload is long enough to live on the heap.
+class FailingCopy
+{
+  public:
+	static inline std::atomic< size_t > copyBudget{ SIZE_MAX };
+	std::string payload;
+	explicit FailingCopy(size_t n) : payload(std::string(32, '#') + std::to_string(n)) {}
+	FailingCopy(const FailingCopy &oth) : payload(oth.payload)
+	{
+		if (copyBudget.fetch_sub(1) == 0)
+			throw std::runtime_error("copy budget exhausted");
+	}
+};
+
 class OpCount
 {
   public:
@@ -58,6 +78,85 @@ class OpCount
 OpCount opCount;
 const OpCount NO_OP = OpCount(0, 0, 0, 0, 0, 0);
 
+// Heap traffic of the current thread through the global operator new and delete, for allocation budgets.
+struct AllocCount
+{
+	size_t allocations = 0;
+	size_t deallocations = 0;
+	size_t bytes = 0;
+	// Allocations past this many throw std::bad_alloc.
+	size_t allocationLimit = SIZE_MAX;
+
+	void clearCounters()
+	{
+		allocations = 0;
+		deallocations = 0;
+		bytes = 0;
+	}
+};
+
+thread_local AllocCount allocCount;
+
+// Runs f() and returns how many allocations it made.
+template< typename F >
+size_t allocationsOf(F &&f)
+{
+	allocCount.clearCounters();
+	f();
+	return allocCount.allocations;
+}
+
+void *countedNew(size_t n, size_t alignment)
+{
+	if (allocCount.allocations >= allocCount.allocationLimit)
+		throw std::bad_alloc();
+	void *p = alignment <= alignof(std::max_align_t) ? std::malloc(n ? n : 1)
+													 : std::aligned_alloc(alignment, (n + alignment - 1) / alignment * alignment);
+	if (p == nullptr)
+		throw std::bad_alloc();
+	++allocCount.allocations;
+	allocCount.bytes += n;
+	return p;
+}
+
+void countedDelete(void *p) noexcept
+{
+	if (p == nullptr)
+		return;
+	++allocCount.deallocations;
+	std::free(p);
+}
+
+void *operator new(size_t n)
+{
+	return countedNew(n, alignof(std::max_align_t));
+}
+
+void *operator new(size_t n, std::align_val_t a)
+{
+	return countedNew(n, static_cast< size_t >(a));
+}
+
+void operator delete(void *p) noexcept
+{
+	countedDelete(p);
+}
+
+void operator delete(void *p, std::align_val_t) noexcept
+{
+	countedDelete(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+	countedDelete(p);
+}
+
+void operator delete(void *p, size_t, std::align_val_t) noexcept
+{
+	countedDelete(p);
+}
+
 class CountedOperationObject
 {
   public:
@@ -79,6 +178,45 @@ class CountedOperationObject
 	bool operator==(const CountedOperationObject &rhs) const { return number == rhs.number; }
 };
 
+class RelocatableObject : public CountedOperationObject
+{
+  public:
+	using CountedOperationObject::CountedOperationObject;
+};
+
+template<>
+struct is_trivially_relocatable< RelocatableObject > : std::true_type
+{
+};
+
+struct Record
+{
+	std::string name;
+	size_t value;
+};
+
+struct RecordName
+{
+	const std::string &operator()(const Record &r) const { return r.name; }
+};
+
+struct StringHash
+{
+	using is_transparent = void;
+	size_t operator()(std::string_view s) const { return std::hash< std::string_view >{}(s); }
+};
+
+struct Quote
+{
+	double price;
+	size_t id;
+};
+
+struct QuotePrice
+{
+	double operator()(const Quote &q) const { return q.price; }
+};
+
 BucketStorage< CountedOperationObject > prepare()
 {
 	size_t n = 1000;
@@ -103,5 +241,16 @@ using bs_sizet_t = BucketStorage< size_t >;
 using bs_string_t = BucketStorage< std::string >;
 using bs_nc_t = BucketStorage< NoCopy >;
 using bs_co_t = BucketStorage< CountedOperationObject >;
+using bs_compact_t = BucketStorage< size_t, compact_links >;
+using bs_counted_t = BucketStorage< CountedOperationObject, with_counters >;
+using bs_mapped_t = BucketStorage< size_t, file_backed >;
+using bs_relocatable_t = BucketStorage< RelocatableObject >;
+using bs_indexed_t = BucketStorage< Record, indexed_by< RecordName, StringHash > >;
+using bs_ordered_t = BucketStorage< Quote, ordered_by< QuotePrice > >;
+using bs_cow_t = BucketStorage< size_t, copy_on_write, with_counters >;
+using bs_inline_t = BucketStorage< size_t, inline_block< 8 >, with_counters >;
+using bs_geometric_t = BucketStorage< size_t, geometric_blocks< 1024 > >;
+using bs_failing_t = BucketStorage< FailingCopy >;
+using bs_string_counted_t = BucketStorage< std::string, with_counters >;
 
 #endif /* HELPERS_HPP */
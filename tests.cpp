@@ -5,9 +5,21 @@
 #include <gtest/gtest.h>
 
 #include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <thread>
 #include <utility>
+#include <vector>
+
+#include <unistd.h>
 
 TEST(traits, default_constructor)
 {
@@ -64,6 +76,9 @@ TEST(traits, iterator)
 
 	static_assert(std::is_same_v< it, std::bidirectional_iterator_tag >);
 	static_assert(std::is_same_v< cit, std::bidirectional_iterator_tag >);
+	static_assert(std::bidirectional_iterator< bs_sizet_t::iterator >);
+	static_assert(std::bidirectional_iterator< bs_sizet_t::const_iterator >);
+	static_assert(std::bidirectional_iterator< bs_cow_t::iterator >);
 }
 
 TEST(traits, typedefs)
@@ -356,6 +371,770 @@ TEST(base, swap)
 	ASSERT_EQ(e.size(), n);
 }
 
+TEST(base, shrink_to_fit_relocates)
+{
+	bs_relocatable_t b;
+	std::vector< bs_relocatable_t::iterator > its;
+	for (size_t i = 0; i < 500; ++i)
+		its.push_back(b.insert(RelocatableObject(i)));
+	for (size_t i = 0; i < 500; i += 2)
+		b.erase(its[i]);
+	std::vector< size_t > expected;
+	for (const RelocatableObject &x : b)
+		expected.push_back(x.number);
+
+	opCount.clearCounters();
+	b.shrink_to_fit();
+	ASSERT_EQ(opCount, NO_OP);
+	ASSERT_EQ(b.capacity(), 256);
+	std::vector< size_t > seen;
+	for (const RelocatableObject &x : b)
+		seen.push_back(x.number);
+	ASSERT_EQ(seen, expected);
+
+	b.clear();
+	ASSERT_EQ(opCount, OpCount(0, 0, 0, 0, 0, expected.size()));
+}
+
+TEST(base, copy_clones_blocks)
+{
+	bs_sizet_t b = bs_sizet_t(16);
+	std::vector< bs_sizet_t::iterator > its;
+	for (size_t i = 0; i < 100; ++i)
+		its.push_back(b.insert(i));
+	for (size_t i = 0; i < 100; i += 3)
+		b.erase(its[i]);
+	for (size_t i = 16; i < 32; ++i)
+		if (i % 3 != 0)
+			b.erase(its[i]);
+
+	bs_sizet_t c = b;
+	ASSERT_TRUE(std::equal(b.begin(), b.end(), c.begin(), c.end()));
+	ASSERT_EQ(c.size(), b.size());
+	ASSERT_EQ(c.capacity(), b.capacity());
+	ASSERT_EQ(c.memory_stats().occupancy_histogram, b.memory_stats().occupancy_histogram);
+
+	for (size_t i = 0; i < 40; ++i)
+	{
+		b.insert(1000 + i);
+		c.insert(1000 + i);
+	}
+	c.erase(c.begin());
+	ASSERT_EQ(*b.begin(), 1);
+	ASSERT_EQ(*c.begin(), 2);
+	ASSERT_TRUE(std::equal(std::next(b.begin()), b.end(), c.begin(), c.end()));
+}
+
+TEST(base, splice)
+{
+	bs_sizet_t a = bs_sizet_t(8);
+	bs_sizet_t b = bs_sizet_t(8);
+	std::vector< bs_sizet_t::iterator > its;
+	for (size_t i = 0; i < 50; ++i)
+		a.insert(i);
+	for (size_t i = 50; i < 100; ++i)
+		its.push_back(b.insert(i));
+	for (size_t i = 0; i < 50; i += 4)
+		b.erase(its[i]);
+	a.erase(a.begin());
+	std::vector< size_t > expected(a.begin(), a.end());
+	expected.insert(expected.end(), b.begin(), b.end());
+	const size_t *kept = &*std::next(b.begin(), 3);
+
+	a.splice(std::move(b));
+	ASSERT_TRUE(b.empty());
+	ASSERT_EQ(b.capacity(), 0);
+	ASSERT_EQ(a.size(), expected.size());
+	ASSERT_TRUE(std::equal(a.begin(), a.end(), expected.begin(), expected.end()));
+	ASSERT_EQ(&*std::next(a.begin(), 49 + 3), kept);
+	ASSERT_TRUE(std::next(a.begin(), 48) < std::next(a.begin(), 49));
+	ASSERT_EQ(std::prev(std::next(a.begin(), 49)), std::next(a.begin(), 48));
+
+	for (size_t i = 0; i < 20; ++i)
+		a.insert(200 + i);
+	a.erase(std::next(a.begin(), 49));
+	expected.erase(expected.begin() + 49);
+	for (size_t i = 0; i < 20; ++i)
+		expected.push_back(200 + i);
+	ASSERT_TRUE(std::equal(a.begin(), a.end(), expected.begin(), expected.end()));
+
+	b.insert(7);
+	bs_sizet_t empty = bs_sizet_t(8);
+	empty.splice(std::move(b));
+	ASSERT_EQ(empty.size(), 1);
+	ASSERT_EQ(*empty.begin(), 7);
+
+	bs_sizet_t other_capacity = bs_sizet_t(16);
+	other_capacity.insert(1);
+	other_capacity.insert(2);
+	empty.splice(std::move(other_capacity));
+	ASSERT_TRUE(other_capacity.empty());
+	ASSERT_EQ(std::vector< size_t >(empty.begin(), empty.end()), std::vector< size_t >({ 7, 1, 2 }));
+}
+
+TEST(base, split)
+{
+	bs_sizet_t b = bs_sizet_t(8);
+	std::vector< bs_sizet_t::iterator > its;
+	for (size_t i = 0; i < 200; ++i)
+		its.push_back(b.insert(i));
+	for (size_t i = 0; i < 200; i += 3)
+		b.erase(its[i]);
+	for (size_t i = 0; i < 30; ++i)
+		b.insert(1000 + i);
+	std::vector< size_t > order(b.begin(), b.end());
+	std::vector< const size_t * > addresses;
+	for (const size_t &x : b)
+		addresses.push_back(&x);
+
+	std::vector< bs_sizet_t > parts = b.split(4);
+	ASSERT_EQ(parts.size(), 4);
+	ASSERT_TRUE(b.empty());
+	ASSERT_EQ(b.capacity(), 0);
+
+	std::vector< size_t > merged;
+	std::vector< const size_t * > merged_addresses;
+	for (bs_sizet_t &part : parts)
+	{
+		ASSERT_GE(part.size(), order.size() / 4 - 8);
+		ASSERT_LE(part.size(), order.size() / 4 + 8);
+		std::vector< size_t > values(part.begin(), part.end());
+		ASSERT_TRUE(std::is_sorted(values.begin(), values.end(), [&](size_t x, size_t y) {
+			return std::find(order.begin(), order.end(), x) < std::find(order.begin(), order.end(), y);
+		}));
+		for (const size_t &x : part)
+			merged_addresses.push_back(&x);
+		merged.insert(merged.end(), values.begin(), values.end());
+	}
+	std::sort(merged.begin(), merged.end());
+	std::sort(order.begin(), order.end());
+	ASSERT_EQ(merged, order);
+	std::sort(merged_addresses.begin(), merged_addresses.end());
+	std::sort(addresses.begin(), addresses.end());
+	ASSERT_EQ(merged_addresses, addresses);
+
+	parts[1].erase(parts[1].begin());
+	parts[1].insert(5000);
+	ASSERT_EQ(*std::prev(parts[1].end()), 5000);
+	parts[0].splice(std::move(parts[1]));
+	ASSERT_EQ(*std::prev(parts[0].end()), 5000);
+
+	bs_sizet_t small = bs_sizet_t(8);
+	small.insert(1);
+	std::vector< bs_sizet_t > many = small.split(3);
+	ASSERT_EQ(many[0].size() + many[1].size() + many[2].size(), 1);
+	ASSERT_THROW(small.split(0), std::invalid_argument);
+}
+
+TEST(base, time_queries)
+{
+	bs_sizet_t b = bs_sizet_t(8);
+	std::vector< bs_sizet_t::iterator > its;
+	for (size_t i = 0; i < 300; ++i)
+		its.push_back(b.insert(i));
+	for (size_t i = 0; i < 300; i += 3)
+		b.erase(its[i]);
+	for (size_t i = 40; i < 120; ++i)
+		if (i % 3 != 0)
+			b.erase(its[i]);
+	for (size_t i = 0; i < 60; ++i)
+		b.insert(1000 + i);
+
+	auto check = [](bs_sizet_t &c)
+	{
+		bs_sizet_t::stamp_type last = std::prev(c.end()).get_time();
+		for (bs_sizet_t::stamp_type t = 0; t <= last + 2; ++t)
+		{
+			bs_sizet_t::iterator expected = c.begin();
+			while (expected != c.end() && expected.get_time() < t)
+				++expected;
+			ASSERT_TRUE(c.lower_bound_time(t) == expected);
+			ASSERT_TRUE(std::as_const(c).lower_bound_time(t) == expected);
+			if (expected != c.end() && expected.get_time() == t)
+				++expected;
+			ASSERT_TRUE(c.upper_bound_time(t) == expected);
+		}
+	};
+	check(b);
+
+	bs_sizet_t::stamp_type resume = std::next(b.begin(), 100).get_time();
+	auto range = b.range_by_time(std::next(b.begin(), 50).get_time(), resume);
+	ASSERT_EQ(std::distance(range.first, range.second), 50);
+	ASSERT_TRUE(b.range_by_time(resume, resume).first == b.range_by_time(resume, resume).second);
+	ASSERT_TRUE(b.upper_bound_time(resume) == std::next(b.begin(), 101));
+
+	std::stringstream stream;
+	b.save(stream);
+	bs_sizet_t loaded;
+	loaded.load(stream);
+
+	// A loaded container knows no block minimum yet. Const queries leave it that way, so several threads may run them
+	// at once.
+	const bs_sizet_t &shared = loaded;
+	std::vector< bs_sizet_t::const_iterator > answers[2];
+	std::thread readers[2];
+	for (size_t r = 0; r < 2; ++r)
+		readers[r] = std::thread(
+			[&, r]
+			{
+				for (bs_sizet_t::stamp_type t = 0; t <= resume + 2; ++t)
+					answers[r].push_back(shared.lower_bound_time(t));
+			});
+	for (std::thread &reader : readers)
+		reader.join();
+	ASSERT_TRUE(answers[0] == answers[1]);
+	check(loaded);
+	for (bs_sizet_t::stamp_type t = 0; t <= resume + 2; ++t)
+		ASSERT_TRUE(answers[0][t] == shared.lower_bound_time(t));
+
+	bs_sizet_t tail = bs_sizet_t(8);
+	for (size_t i = 0; i < 30; ++i)
+		tail.insert(5000 + i);
+	tail.erase(tail.begin());
+	b.splice(std::move(tail));
+	check(b);
+	ASSERT_TRUE(b.lower_bound_time(std::numeric_limits< bs_sizet_t::stamp_type >::max()) == b.end());
+}
+
+TEST(base, bounded_evicts_oldest)
+{
+	using counted_sizet_t = BucketStorage< size_t, with_counters >;
+	counted_sizet_t b(100, evict_oldest, 16);
+	ASSERT_EQ(b.size_limit(), 100);
+	for (size_t i = 0; i < 100; ++i)
+		b.insert(i);
+	counted_sizet_t::HotPathStats before = b.hot_path_stats();
+	for (size_t i = 100; i < 1000; ++i)
+	{
+		ASSERT_EQ(*b.insert(i), i);
+		ASSERT_EQ(b.size(), 100);
+	}
+	counted_sizet_t::HotPathStats after = b.hot_path_stats();
+	ASSERT_EQ(after.block_allocations, before.block_allocations);
+	ASSERT_EQ(after.block_frees, before.block_frees);
+	ASSERT_EQ(b.capacity(), 112);
+
+	std::vector< size_t > expected;
+	for (size_t i = 900; i < 1000; ++i)
+		expected.push_back(i);
+	ASSERT_EQ(std::vector< size_t >(b.begin(), b.end()), expected);
+	ASSERT_TRUE(b.lower_bound_time(0) == b.begin());
+
+	b.insert(*b.begin());
+	ASSERT_EQ(*std::prev(b.end()), 900);
+	ASSERT_EQ(*b.begin(), 901);
+
+	bs_string_t s(3, evict_oldest);
+	for (const char *x : { "a", "b", "c", "d", "e" })
+		s.insert(x);
+	ASSERT_EQ(std::vector< std::string >(s.begin(), s.end()), std::vector< std::string >({ "c", "d", "e" }));
+
+	bs_sizet_t c(50, evict_oldest);
+	bs_sizet_t d;
+	for (size_t i = 0; i < 80; ++i)
+		d.insert(i);
+	c.splice(std::move(d));
+	ASSERT_EQ(c.size(), 50);
+	ASSERT_EQ(*c.begin(), 30);
+	c.shrink_to_fit();
+	ASSERT_EQ(c.size_limit(), 50);
+	ASSERT_THROW(bs_sizet_t(0, evict_oldest), std::invalid_argument);
+}
+
+TEST(base, hash_index)
+{
+	bs_indexed_t b = bs_indexed_t(8);
+	std::vector< bs_indexed_t::iterator > its;
+	for (size_t i = 0; i < 300; ++i)
+		its.push_back(b.insert(Record{ "k" + std::to_string(i), i }));
+	for (size_t i = 0; i < 300; i += 3)
+		b.erase(its[i]);
+	b.insert(Record{ "k1", 1000 });
+
+	auto check = [](const bs_indexed_t &c, size_t first, size_t last)
+	{
+		for (size_t i = first; i < last; ++i)
+		{
+			std::string key = "k" + std::to_string(i);
+			bs_indexed_t::const_iterator it = c.find(std::string_view(key));
+			if (i % 3 == 0)
+			{
+				ASSERT_TRUE(it == c.end());
+			}
+			else
+			{
+				ASSERT_TRUE(it != c.end());
+				ASSERT_EQ(it->value, i);
+				ASSERT_TRUE(c.find(key) == it);
+			}
+		}
+	};
+	check(b, 0, 300);
+	ASSERT_TRUE(b.find("missing") == b.end());
+	ASSERT_GT(b.memory_stats().index_bytes, 0);
+
+	b.erase(b.find("k1"));
+	ASSERT_EQ(b.find("k1")->value, 1000);
+
+	bs_indexed_t copy = b;
+	b.shrink_to_fit();
+	ASSERT_EQ(b.find("k2")->value, 2);
+	ASSERT_EQ(copy.find("k2")->value, 2);
+
+	bs_indexed_t tail = bs_indexed_t(8);
+	tail.insert(Record{ "t", 7 });
+	b.splice(std::move(tail));
+	ASSERT_EQ(b.find("t")->value, 7);
+	ASSERT_TRUE(tail.find("t") == tail.end());
+
+	std::vector< bs_indexed_t > parts = b.split(3);
+	size_t found = 0;
+	for (bs_indexed_t &part : parts)
+		for (const Record &r : part)
+		{
+			ASSERT_EQ(&*part.find(r.name), &r);
+			++found;
+		}
+	ASSERT_EQ(found, copy.size() + 1);
+
+	bs_indexed_t bounded(2, evict_oldest);
+	bounded.insert(Record{ "a", 1 });
+	bounded.insert(Record{ "b", 2 });
+	bounded.insert(Record{ "c", 3 });
+	ASSERT_TRUE(bounded.find("a") == bounded.end());
+	ASSERT_EQ(bounded.find("c")->value, 3);
+	bounded.clear();
+	ASSERT_TRUE(bounded.find("c") == bounded.end());
+}
+
+TEST(base, ordered_index)
+{
+	bs_ordered_t b = bs_ordered_t(8);
+	std::vector< bs_ordered_t::iterator > its;
+	for (size_t i = 0; i < 5000; ++i)
+		its.push_back(b.insert(Quote{ static_cast< double >(i * 7919 % 1000) / 10, i }));
+	for (size_t i = 0; i < 5000; i += 3)
+		b.erase(its[i]);
+
+	auto check = [](const bs_ordered_t &c)
+	{
+		std::vector< double > expected;
+		for (const Quote &q : c)
+			expected.push_back(q.price);
+		std::sort(expected.begin(), expected.end());
+		std::vector< double > seen;
+		for (const Quote &q : c.ordered())
+			seen.push_back(q.price);
+		ASSERT_EQ(seen, expected);
+		for (size_t k = 0; k < expected.size(); k += 97)
+			ASSERT_EQ(c.nth_by_key(k)->price, expected[k]);
+		ASSERT_TRUE(c.nth_by_key(expected.size()) == c.end());
+
+		auto in_range = c.range(20.0, 30.0);
+		size_t count = 0;
+		for (const Quote &q : in_range)
+		{
+			ASSERT_GE(q.price, 20.0);
+			ASSERT_LT(q.price, 30.0);
+			++count;
+		}
+		ASSERT_EQ(count,
+				  static_cast< size_t >(std::lower_bound(expected.begin(), expected.end(), 30.0) -
+										std::lower_bound(expected.begin(), expected.end(), 20.0)));
+		ASSERT_TRUE(c.range(30.0, 20.0).begin() == c.range(30.0, 20.0).end());
+	};
+	check(b);
+	ASSERT_GT(b.memory_stats().index_bytes, 0);
+
+	bs_ordered_t copy = b;
+	check(copy);
+	b.shrink_to_fit();
+	check(b);
+
+	bs_ordered_t tail = bs_ordered_t(8);
+	tail.insert(Quote{ 25.0, 9000 });
+	tail.insert(Quote{ -1.0, 9001 });
+	b.splice(std::move(tail));
+	check(b);
+	ASSERT_EQ(b.nth_by_key(0)->id, 9001);
+	ASSERT_TRUE(tail.ordered().begin() == tail.ordered().end());
+
+	std::vector< bs_ordered_t > parts = b.split(3);
+	size_t total = 0;
+	for (const bs_ordered_t &part : parts)
+	{
+		check(part);
+		total += part.size();
+	}
+	ASSERT_EQ(total, copy.size() + 2);
+
+	while (!copy.empty())
+		copy.erase(copy.nth_by_key(copy.size() / 2));
+	copy.insert(Quote{ 1.0, 1 });
+	check(copy);
+
+	bs_ordered_t bounded(2, evict_oldest);
+	bounded.insert(Quote{ 3.0, 1 });
+	bounded.insert(Quote{ 1.0, 2 });
+	bounded.insert(Quote{ 2.0, 3 });
+	ASSERT_EQ(bounded.nth_by_key(0)->id, 2);
+	ASSERT_EQ(bounded.nth_by_key(1)->id, 3);
+	check(bounded);
+}
+
+TEST(base, copy_on_write)
+{
+	bs_cow_t b = bs_cow_t(8);
+	for (size_t i = 0; i < 100; ++i)
+		b.insert(i);
+	std::vector< size_t > expected(b.begin(), b.end());
+
+	bs_cow_t c = b;
+	ASSERT_EQ(c.hot_path_stats().block_allocations, 0);
+	ASSERT_EQ(std::vector< size_t >(std::as_const(c).begin(), std::as_const(c).end()), expected);
+	ASSERT_EQ(c.lower_bound_time(c.begin().get_time() + 10).get_current(), b.lower_bound_time(b.begin().get_time() + 10).get_current());
+	ASSERT_EQ(c.hot_path_stats().block_allocations, 0);
+
+	b.reset_hot_path_stats();
+	b.insert(100);
+	ASSERT_EQ(b.hot_path_stats().block_allocations, 1);
+	b.erase(b.get_to_distance(b.begin(), 50));
+	*c.begin() = 7;
+	ASSERT_EQ(c.hot_path_stats().block_allocations, 1);
+	ASSERT_EQ(*b.begin(), 0);
+	ASSERT_EQ(c.size(), 100);
+	ASSERT_EQ(b.size(), 100);
+
+	std::vector< size_t > copied(c.begin(), c.end());
+	expected[0] = 7;
+	ASSERT_EQ(copied, expected);
+
+	bs_cow_t d = c;
+	bs_cow_t e = c;
+	bs_cow_t f = c;
+	b.splice(std::move(d));
+	std::vector< bs_cow_t > parts = e.split(3);
+	f.shrink_to_fit();
+	b.clear();
+	ASSERT_EQ(std::vector< size_t >(c.begin(), c.end()), expected);
+	size_t total = 0;
+	for (bs_cow_t &part : parts)
+		total += part.size();
+	ASSERT_EQ(total, 100);
+	ASSERT_EQ(std::vector< size_t >(f.begin(), f.end()), expected);
+
+	bs_cow_t g = c;
+	c = bs_cow_t(8);
+	for (size_t &x : g)
+		++x;
+	ASSERT_EQ(*g.begin(), 8);
+}
+
+TEST(base, snapshot_while_writing)
+{
+	std::unique_ptr< bs_cow_t > b = std::make_unique< bs_cow_t >(8);
+	for (size_t i = 0; i < 1000; ++i)
+		b->insert(i);
+	bs_cow_t::Snapshot snap = b->snapshot();
+
+	bool in_order = true;
+	std::thread reader(
+		[&]
+		{
+			for (size_t round = 0; round < 20; ++round)
+			{
+				size_t expected = 0;
+				for (size_t x : snap)
+					in_order = in_order && x == expected++;
+				in_order = in_order && expected == 1000;
+			}
+		});
+	for (size_t i = 0; i < 5000; ++i)
+	{
+		b->insert(1000 + i);
+		b->erase(b->begin());
+	}
+	reader.join();
+	ASSERT_TRUE(in_order);
+	ASSERT_EQ(*b->begin(), 5000);
+	ASSERT_EQ(b->size(), 1000);
+
+	b.reset();
+	ASSERT_EQ(snap.size(), 1000);
+	ASSERT_EQ(std::accumulate(snap.begin(), snap.end(), size_t(0)), 999 * 1000 / 2);
+	ASSERT_EQ(*snap->lower_bound_time(snap.begin().get_time() + 10), 10);
+}
+
+TEST(base, inline_block)
+{
+	bs_inline_t a;
+	ASSERT_EQ(a.capacity(), 0);
+	for (size_t i = 0; i < 8; ++i)
+		a.insert(i);
+	a.erase(a.begin());
+	a.insert(8);
+	ASSERT_EQ(a.hot_path_stats().block_allocations, 0);
+
+	bs_inline_t b(std::move(a));
+	bs_inline_t c;
+	c.insert(100);
+	c.swap(b);
+	ASSERT_EQ(std::vector< size_t >(c.begin(), c.end()), std::vector< size_t >({ 1, 2, 3, 4, 5, 6, 7, 8 }));
+	ASSERT_EQ(std::vector< size_t >(b.begin(), b.end()), std::vector< size_t >({ 100 }));
+	ASSERT_EQ(c.hot_path_stats().block_allocations, 0);
+
+	for (size_t i = 9; i < 40; ++i)
+		c.insert(i);
+	bs_inline_t d = c;
+	c.splice(std::move(b));
+	std::vector< bs_inline_t > parts = d.split(3);
+	d = std::move(parts[1]);
+	d.splice(std::move(parts[0]));
+	d.splice(std::move(parts[2]));
+	while (c.size() > 5)
+		c.erase(c.begin());
+	c.shrink_to_fit();
+	ASSERT_EQ(std::vector< size_t >(c.begin(), c.end()), std::vector< size_t >({ 36, 37, 38, 39, 100 }));
+	ASSERT_EQ(d.size(), 39);
+	size_t sum = 0;
+	for (size_t x : d)
+		sum += x;
+	ASSERT_EQ(sum, 39 * 40 / 2);
+
+	std::vector< bs_inline_t > many(100);
+	for (size_t i = 0; i < many.size(); ++i)
+		many[i].insert(i);
+	many.resize(1000);
+	for (size_t i = 0; i < 100; ++i)
+		ASSERT_EQ(*many[i].begin(), i);
+}
+
+TEST(base, geometric_blocks)
+{
+	bs_geometric_t b(8);
+	std::vector< bs_geometric_t::iterator > its;
+	for (size_t i = 0; i < 1000; ++i)
+		its.push_back(b.insert(i));
+	ASSERT_EQ(b.capacity(), 1024);
+	ASSERT_EQ(b.memory_stats().blocks, 8);
+	for (size_t i = 1000; i < 5000; ++i)
+		its.push_back(b.insert(i));
+	ASSERT_EQ(b.capacity(), 5120);
+	ASSERT_EQ(b.memory_stats().slot_bytes, 5120 * sizeof(size_t));
+
+	std::vector< size_t > expected;
+	for (size_t i = 0; i < its.size(); ++i)
+	{
+		if (i % 3 == 0)
+			b.erase(its[i]);
+		else
+			expected.push_back(i);
+	}
+	ASSERT_EQ(std::vector< size_t >(b.begin(), b.end()), expected);
+	ASSERT_EQ(*b.lower_bound_time(b.begin().get_time() + 3000), 3001);
+
+	bs_geometric_t c = b;
+	ASSERT_EQ(c.capacity(), b.capacity());
+	c.shrink_to_fit();
+	ASSERT_EQ(std::vector< size_t >(c.begin(), c.end()), expected);
+	ASSERT_LT(c.capacity(), 2 * c.size());
+
+	std::vector< bs_geometric_t > parts = c.split(3);
+	c = std::move(parts[0]);
+	c.splice(std::move(parts[1]));
+	c.splice(std::move(parts[2]));
+	ASSERT_EQ(std::vector< size_t >(c.begin(), c.end()), expected);
+
+	while (!b.empty())
+		b.erase(b.begin());
+	ASSERT_EQ(b.capacity(), 0);
+	b.insert(1);
+	ASSERT_EQ(b.capacity(), 8);
+}
+
+TEST(base, trim)
+{
+	bs_sizet_t b = bs_sizet_t(8);
+	std::vector< bs_sizet_t::iterator > its;
+	for (size_t i = 0; i < 800; ++i)
+		its.push_back(b.insert(i));
+	std::vector< size_t > expected;
+	for (size_t i = 0; i < 800; ++i)
+	{
+		if (i < 400 && i % 8 != 0)
+			b.erase(its[i]);
+		else
+			expected.push_back(i);
+	}
+	auto total = [](const bs_sizet_t::MemoryStats &stats) { return stats.slot_bytes + stats.metadata_bytes; };
+	// Queries every kept stamp, which also caches the block bounds that the next trim() has to keep right.
+	auto check_times = [&b]
+	{
+		std::vector< bs_sizet_t::iterator > order;
+		for (bs_sizet_t::iterator it = b.begin(); it != b.end(); ++it)
+			order.push_back(it);
+		for (size_t k = 0; k < order.size(); ++k)
+		{
+			bs_sizet_t::stamp_type t = order[k].get_time();
+			ASSERT_TRUE(b.lower_bound_time(t) == order[k]);
+			ASSERT_TRUE(std::as_const(b).lower_bound_time(t) == order[k]);
+			ASSERT_TRUE(b.upper_bound_time(t) == (k + 1 < order.size() ? order[k + 1] : b.end()));
+			auto range = b.range_by_time(order[k / 2].get_time(), t);
+			ASSERT_TRUE(range.first == order[k / 2] && range.second == order[k]);
+		}
+	};
+	check_times();
+
+	bs_sizet_t::MemoryStats before = b.memory_stats();
+	ASSERT_EQ(before.blocks, 100);
+	b.trim(std::numeric_limits< size_t >::max(), std::chrono::nanoseconds(0));
+	ASSERT_EQ(b.memory_stats().blocks, 100);
+
+	before = b.memory_stats();
+	size_t freed = b.trim(1);
+	bs_sizet_t::MemoryStats after = b.memory_stats();
+	ASSERT_EQ(after.blocks, 99);
+	ASSERT_EQ(total(before) - total(after), freed);
+	check_times();
+
+	before = after;
+	freed = b.trim(std::numeric_limits< size_t >::max());
+	after = b.memory_stats();
+	ASSERT_EQ(after.blocks, 57);
+	ASSERT_EQ(total(before) - total(after), freed);
+	ASSERT_EQ(std::vector< size_t >(b.begin(), b.end()), expected);
+	for (size_t i = 400; i < 800; ++i)
+		ASSERT_EQ(*its[i], i);
+	ASSERT_EQ(*b.lower_bound_time(its[400].get_time()), 400);
+	check_times();
+	ASSERT_EQ(b.trim(std::numeric_limits< size_t >::max()), 0);
+
+	// Elements erased at random and then trimmed land in blocks whose bounds were cached by earlier queries.
+	std::mt19937 rng(47);
+	for (size_t round = 0; round < 4; ++round)
+	{
+		for (size_t i = 0; i < 400; ++i)
+			b.insert(1000 * (round + 1) + i);
+		std::vector< bs_sizet_t::iterator > live;
+		for (bs_sizet_t::iterator it = b.begin(); it != b.end(); ++it)
+			live.push_back(it);
+		std::shuffle(live.begin(), live.end(), rng);
+		for (size_t i = 0; i < live.size() / 2; ++i)
+			b.erase(live[i]);
+		check_times();
+		b.trim(std::numeric_limits< size_t >::max());
+		check_times();
+	}
+
+	bs_indexed_t c = bs_indexed_t(8);
+	std::vector< bs_indexed_t::iterator > records;
+	for (size_t i = 0; i < 200; ++i)
+		records.push_back(c.insert(Record{ "k" + std::to_string(i), i }));
+	for (size_t i = 0; i < 100; ++i)
+		if (i % 8 != 0)
+			c.erase(records[i]);
+	ASSERT_GT(c.trim(std::numeric_limits< size_t >::max()), 0);
+	for (size_t i = 0; i < 200; ++i)
+	{
+		if (i < 100 && i % 8 != 0)
+			ASSERT_EQ(c.find("k" + std::to_string(i)), c.end());
+		else
+			ASSERT_EQ(c.find("k" + std::to_string(i))->value, i);
+	}
+}
+
+TEST(parallel, copy_and_clear)
+{
+	// Block capacity 4 spreads 20000 values over enough blocks for four slices of details::parallel_grain.
+	bs_sizet_t b(4);
+	std::vector< bs_sizet_t::iterator > its;
+	for (size_t i = 0; i < 20000; ++i)
+		its.push_back(b.insert(i));
+	for (size_t i = 0; i < its.size(); i += 3)
+		b.erase(its[i]);
+	for (size_t i = 0; i < 1000; ++i)
+		b.insert(100000 + i);
+
+	bs_sizet_t copy(b, parallel_t(4));
+	ASSERT_EQ(copy.size(), b.size());
+	ASSERT_EQ(copy.capacity(), b.capacity());
+	ASSERT_TRUE(std::equal(b.begin(), b.end(), copy.begin(), copy.end()));
+	ASSERT_EQ(std::prev(copy.end()).get_time(), std::prev(b.end()).get_time());
+	copy.insert(7);
+	ASSERT_EQ(*std::prev(copy.end()), 7u);
+
+	bs_string_counted_t strings(4);
+	for (size_t i = 0; i < 20000; ++i)
+		strings.insert(std::string(40, 'a') + std::to_string(i));
+	strings.reset_hot_path_stats();
+	bs_string_counted_t string_copy(strings, parallel_t(4));
+	ASSERT_EQ(string_copy.hot_path_stats().constructions, strings.size());
+	ASSERT_TRUE(std::equal(strings.begin(), strings.end(), string_copy.begin(), string_copy.end()));
+	string_copy.clear(parallel_t(4));
+	ASSERT_TRUE(string_copy.empty());
+	ASSERT_EQ(string_copy.hot_path_stats().destructions, strings.size());
+	ASSERT_EQ(string_copy.memory_stats().blocks, 0u);
+	string_copy.insert("again");
+	ASSERT_EQ(*string_copy.begin(), "again");
+
+	bs_failing_t failing(4);
+	for (size_t i = 0; i < 20000; ++i)
+		failing.insert(FailingCopy(i));
+	FailingCopy::copyBudget = 15000;
+	ASSERT_THROW(bs_failing_t(failing, parallel_t(4)), std::runtime_error);
+	FailingCopy::copyBudget = SIZE_MAX;
+}
+
+TEST(parallel, shrink_to_fit)
+{
+	auto check = [](auto b)
+	{
+		using storage = decltype(b);
+		std::vector< typename storage::iterator > its;
+		for (size_t i = 0; i < 30000; ++i)
+			its.push_back(b.insert(i));
+		for (size_t i = 0; i < its.size(); ++i)
+			if (i % 5 != 0)
+				b.erase(its[i]);
+		for (size_t i = 0; i < 100; ++i)
+			b.insert(100000 + i);
+		std::vector< size_t > values(b.begin(), b.end());
+		std::vector< typename storage::stamp_type > times;
+		for (auto it = b.begin(); it != b.end(); ++it)
+			times.push_back(it.get_time());
+
+		b.shrink_to_fit(parallel_t(4));
+		ASSERT_EQ(b.size(), values.size());
+		ASSERT_LE(b.capacity(), values.size() + 1024);
+		ASSERT_TRUE(std::equal(values.begin(), values.end(), b.begin(), b.end()));
+		ASSERT_TRUE(std::equal(values.rbegin(), values.rend(), std::make_reverse_iterator(b.end()), std::make_reverse_iterator(b.begin())));
+		size_t i = 0;
+		for (auto it = b.begin(); it != b.end(); ++it, ++i)
+			ASSERT_EQ(it.get_time(), times[i]);
+		ASSERT_EQ(*b.lower_bound_time(times[times.size() / 2]), values[values.size() / 2]);
+
+		b.erase(b.begin());
+		b.insert(7);
+		ASSERT_EQ(*std::prev(b.end()), 7u);
+		ASSERT_EQ(static_cast< size_t >(std::distance(b.begin(), b.end())), values.size());
+	};
+	check(bs_sizet_t(4));
+	check(bs_compact_t(4));
+	check(bs_geometric_t(4));
+	check(BucketStorage< size_t, inline_block< 4 > >());
+
+	bs_ordered_t ordered(4);
+	std::vector< bs_ordered_t::iterator > quotes;
+	for (size_t i = 0; i < 20000; ++i)
+		quotes.push_back(ordered.insert(Quote{ static_cast< double >(20000 - i), i }));
+	for (size_t i = 0; i < quotes.size(); i += 2)
+		ordered.erase(quotes[i]);
+	ordered.shrink_to_fit(parallel_t(4));
+	ASSERT_EQ(ordered.size(), 10000u);
+	ASSERT_EQ(ordered.nth_by_key(0)->id, 19999u);
+	ASSERT_EQ(ordered.nth_by_key(9999)->id, 1u);
+}
+
 TEST(coperators, simple_five_rule_count)
 {
 	bs_co_t b = prepare();
@@ -445,6 +1224,671 @@ TEST(iterators, member_of_pointer)
 	}
 }
 
+template< typename Storage >
+void check_advance_by()
+{
+	Storage b(4);
+	std::vector< typename Storage::iterator > its;
+	for (size_t i = 0; i < 64; ++i)
+		its.push_back(b.insert(i));
+	for (size_t i = 0; i < 64; i += 3)
+		b.erase(its[i]);
+	for (size_t i = 0; i < 16; ++i)
+		b.insert(100 + i);
+	std::vector< size_t > expected(std::as_const(b).begin(), std::as_const(b).end());
+	const auto n = static_cast< std::ptrdiff_t >(expected.size());
+
+	for (std::ptrdiff_t from = 0; from <= n; from += 5)
+		for (std::ptrdiff_t to = 0; to <= n; to += 7)
+		{
+			typename Storage::iterator it = std::next(b.begin(), from);
+			it.advance_by(to - from);
+			ASSERT_EQ(it, std::next(b.begin(), to));
+			if (to < n)
+			{
+				ASSERT_EQ(*it, expected[to]);
+				ASSERT_EQ(it.get_time(), std::next(b.begin(), to).get_time());
+			}
+		}
+
+	typename Storage::const_iterator it = std::as_const(b).end();
+	it.advance_by(-n);
+	ASSERT_EQ(it, b.cbegin());
+	ASSERT_EQ(std::distance(b.begin(), b.end()), n);
+	ASSERT_EQ(*b.get_to_distance(b.begin(), n - 1), expected.back());
+	ASSERT_TRUE(typename Storage::iterator() == typename Storage::iterator());
+}
+
+TEST(iterators, advance_by)
+{
+	check_advance_by< bs_sizet_t >();
+	check_advance_by< bs_compact_t >();
+	check_advance_by< bs_geometric_t >();
+	check_advance_by< BucketStorage< size_t, copy_on_write > >();
+
+	bs_cow_t a;
+	for (size_t i = 0; i < 10; ++i)
+		a.insert(i);
+	bs_cow_t b = a;
+	bs_cow_t::const_iterator reader = std::as_const(b).begin();
+	*std::next(b.begin(), 1) = 42;
+	ASSERT_EQ(*reader.advance_by(1), 42u);
+	ASSERT_EQ(*std::next(a.cbegin(), 1), 1u);
+}
+
+TEST(iterators, moved_from)
+{
+	bs_sizet_t a;
+	for (size_t i = 0; i < 10; ++i)
+		a.insert(i);
+	bs_sizet_t b = std::move(a);
+	ASSERT_TRUE(a.cbegin() == a.cend());
+	size_t visited = 0;
+	for (bs_sizet_t::const_iterator it = a.cbegin(); it != a.cend(); ++it)
+		++visited;
+	ASSERT_EQ(visited, 0);
+	ASSERT_EQ(b.size(), 10);
+}
+
+TEST(base, erase_last_then_insert)
+{
+	bs_sizet_t b = bs_sizet_t();
+	b.erase(b.insert(1));
+	ASSERT_TRUE(b.empty());
+	ASSERT_EQ(b.capacity(), 0);
+
+	b.insert(2);
+	b.insert(3);
+	b.erase(--b.end());
+	b.insert(4);
+	ASSERT_EQ(b.size(), 2);
+	ASSERT_EQ(*b.begin(), 2);
+	ASSERT_EQ(*++b.begin(), 4);
+}
+
+TEST(compact, insert_erase_order)
+{
+	constexpr size_t n = 1000;
+	static_assert(std::is_same_v< bs_compact_t::link_type, uint32_t >);
+
+	bs_compact_t b = bs_compact_t(16);
+	for (size_t i = 0; i < n; ++i)
+		b.insert(i);
+	ASSERT_EQ(b.size(), n);
+	ASSERT_EQ(b.capacity(), (n + 15) & -16);
+
+	for (bs_compact_t::iterator it = b.begin(); it != b.end();)
+		it = *it % 3 == 0 ? b.erase(it) : ++it;
+	for (size_t i = 0; i < n; i += 3)
+		b.insert(n + i);
+
+	size_t prev = 0;
+	size_t count = 0;
+	for (size_t x : b)
+	{
+		if (x < n)
+		{
+			ASSERT_NE(x % 3, 0);
+		}
+		ASSERT_TRUE(count == 0 || x > prev);
+		prev = x;
+		count++;
+	}
+	ASSERT_EQ(count, n);
+	ASSERT_EQ(b.capacity(), (n + 15) & -16);
+
+	bs_compact_t c = b;
+	ASSERT_TRUE(std::equal(b.begin(), b.end(), c.begin()));
+	c.clear();
+	ASSERT_EQ(c.begin(), c.end());
+	ASSERT_EQ(c.capacity(), 0);
+}
+
+TEST(stats, memory_stats)
+{
+	bs_sizet_t b = bs_sizet_t(8);
+	bs_sizet_t::MemoryStats stats = b.memory_stats();
+	ASSERT_EQ(stats.blocks, 0);
+	ASSERT_EQ(stats.slot_bytes, 0);
+	ASSERT_EQ(stats.fragmentation, 0.0);
+
+	std::vector< bs_sizet_t::iterator > its;
+	for (size_t i = 0; i < 32; ++i)
+		its.push_back(b.insert(i));
+	stats = b.memory_stats();
+	ASSERT_EQ(stats.blocks, 4);
+	ASSERT_EQ(stats.slot_bytes, 32 * sizeof(size_t));
+	ASSERT_EQ(stats.occupancy_histogram.back(), 4);
+	ASSERT_EQ(stats.partially_free_blocks, 0);
+	ASSERT_EQ(stats.fragmentation, 0.0);
+
+	b.erase(its[0]);
+	for (size_t i = 8; i < 12; ++i)
+		b.erase(its[i]);
+	for (size_t i = 16; i < 24; ++i)
+		b.erase(its[i]);
+	stats = b.memory_stats();
+	ASSERT_EQ(stats.blocks, 3);
+	ASSERT_EQ(stats.partially_free_blocks, 2);
+	ASSERT_EQ(stats.occupancy_histogram.back(), 1);
+	ASSERT_EQ(stats.occupancy_histogram[7], 1);
+	ASSERT_EQ(stats.occupancy_histogram[4], 1);
+	ASSERT_GT(stats.free_block_bytes, 0);
+	ASSERT_GE(stats.metadata_bytes, stats.element_bytes + stats.block_header_bytes);
+	ASSERT_DOUBLE_EQ(stats.fragmentation, 5.0 / 24.0);
+
+	b.clear();
+	stats = b.memory_stats();
+	ASSERT_EQ(stats.blocks, 0);
+	ASSERT_EQ(stats.partially_free_blocks, 0);
+	ASSERT_EQ(stats.free_block_bytes, 0);
+}
+
+TEST(stats, hot_path_counters)
+{
+	ASSERT_EQ(bs_sizet_t().hot_path_stats(), bs_sizet_t::HotPathStats());
+
+	bs_counted_t b = bs_counted_t(4);
+	std::vector< bs_counted_t::iterator > its;
+	for (size_t i = 0; i < 8; ++i)
+		its.push_back(b.insert(CountedOperationObject(i)));
+
+	bs_counted_t::HotPathStats stats = b.hot_path_stats();
+	ASSERT_EQ(stats.block_allocations, 2);
+	ASSERT_EQ(stats.head_bumps, 8);
+	ASSERT_EQ(stats.free_slot_reuses, 0);
+	ASSERT_EQ(stats.constructions, 8);
+	ASSERT_EQ(stats.free_block_hits, 6);
+
+	b.reset_hot_path_stats();
+	b.erase(its[1]);
+	b.insert(CountedOperationObject(8));
+	for (size_t i = 4; i < 8; ++i)
+		b.erase(its[i]);
+
+	stats = b.hot_path_stats();
+	ASSERT_EQ(stats.free_slot_reuses, 1);
+	ASSERT_EQ(stats.head_bumps, 0);
+	ASSERT_EQ(stats.constructions, 1);
+	ASSERT_EQ(stats.destructions, 5);
+	ASSERT_EQ(stats.block_frees, 1);
+	ASSERT_EQ(stats.block_allocations, 0);
+
+	b.clear();
+	ASSERT_EQ(b.hot_path_stats().destructions, 9);
+	ASSERT_EQ(b.hot_path_stats().block_frees, 2);
+}
+
+TEST(stats, free_block_list)
+{
+	bs_counted_t b = bs_counted_t(4);
+	std::vector< bs_counted_t::iterator > its;
+	for (size_t i = 0; i < 64; ++i)
+		its.push_back(b.insert(CountedOperationObject(i)));
+	ASSERT_EQ(b.memory_stats().free_block_bytes, 0);
+
+	b.erase(its[0]);
+	its[0] = b.end();
+	size_t entry_bytes = b.memory_stats().free_block_bytes;
+	ASSERT_GT(entry_bytes, 0);
+
+	b.reset_hot_path_stats();
+	size_t inserts = 0;
+	for (size_t round = 1; round < 2000; ++round)
+	{
+		size_t victim = round * 37 % its.size();
+		if (its[victim] != b.end())
+		{
+			b.erase(its[victim]);
+			its[victim] = b.end();
+		}
+		if (round % 3 != 0)
+		{
+			size_t slot = (victim + 11) % its.size();
+			if (its[slot] != b.end())
+				b.erase(its[slot]);
+			its[slot] = b.insert(CountedOperationObject(round));
+			++inserts;
+		}
+		bs_counted_t::MemoryStats stats = b.memory_stats();
+		ASSERT_EQ(stats.free_block_bytes, stats.partially_free_blocks * entry_bytes);
+	}
+	bs_counted_t::HotPathStats stats = b.hot_path_stats();
+	ASSERT_EQ(stats.free_block_hits + stats.block_allocations, inserts);
+}
+
+TEST(allocations, insert_erase_budget)
+{
+	ASSERT_LE(allocationsOf([] { bs_sizet_t(8); }), 3);
+	ASSERT_EQ(allocationsOf([] { bs_inline_t(); }), 0);
+
+	bs_sizet_t b = bs_sizet_t(8);
+	std::vector< bs_sizet_t::iterator > its;
+	its.reserve(8000);
+	size_t opened = 0;
+	size_t opening_allocations = 0;
+	for (size_t i = 0; i < 8000; ++i)
+	{
+		size_t capacity = b.capacity();
+		size_t allocations = allocationsOf([&] { its.push_back(b.insert(i)); });
+		if (b.capacity() == capacity)
+		{
+			ASSERT_EQ(allocations, 0);
+		}
+		else
+		{
+			ASSERT_GE(allocations, 1);
+			++opened;
+			opening_allocations += allocations;
+		}
+	}
+	// One block per opening insert, plus the block table and its free-block links when they double.
+	ASSERT_LE(opening_allocations, opened + 2 * (std::bit_width(opened) + 1));
+
+	for (size_t i = 0; i < 8000; i += 2)
+	{
+		ASSERT_EQ(allocationsOf([&] { b.erase(its[i]); }), 0);
+	}
+	for (size_t i = 1; i < 4000; i += 2)
+	{
+		ASSERT_EQ(allocationsOf([&] { b.erase(its[i]); }), 0);
+	}
+	ASSERT_EQ(allocCount.deallocations, 1);
+
+	for (size_t i = 0; i < 4000; ++i)
+	{
+		size_t capacity = b.capacity();
+		size_t allocations = allocationsOf([&] { b.insert(i); });
+		ASSERT_EQ(allocations, b.capacity() == capacity ? 0 : 1);
+	}
+
+	ASSERT_EQ(allocationsOf(
+				  [&]
+				  {
+					  size_t sum = 0;
+					  for (size_t x : b)
+						  sum += x;
+					  b.for_each_unordered([&](size_t x) { sum += x; });
+					  b.lower_bound_time(its[5000].get_time());
+					  b.memory_stats();
+				  }),
+			  0);
+	size_t blocks = b.memory_stats().blocks;
+	ASSERT_LE(allocationsOf([&] { bs_sizet_t copy = b; }), blocks + 5);
+	ASSERT_EQ(allocationsOf([&] { b.clear(); }), 0);
+
+	// Values with destructors take the same allocation-free path through clear() and the destructor.
+	auto counted = std::make_unique< bs_counted_t >(8);
+	for (size_t i = 0; i < 1000; ++i)
+		counted->insert(CountedOperationObject(i));
+	ASSERT_EQ(allocationsOf([&] { counted->clear(); }), 0);
+	ASSERT_EQ(counted->hot_path_stats().destructions, 1000);
+	for (size_t i = 0; i < 1000; ++i)
+		counted->insert(CountedOperationObject(i));
+	ASSERT_EQ(allocationsOf([&] { counted.reset(); }), 0);
+}
+
+// Fails the copy constructor at every allocation in turn and checks that each failed copy frees what it allocated.
+template< typename Storage, typename Make >
+void check_copy_out_of_memory(Make make)
+{
+	Storage b = Storage(8);
+	for (size_t i = 0; i < 500; ++i)
+		b.insert(make(i));
+	for (size_t limit = 0;; ++limit)
+	{
+		allocCount.clearCounters();
+		allocCount.allocationLimit = limit;
+		bool failed = false;
+		try
+		{
+			Storage copy = b;
+		} catch (const std::bad_alloc &)
+		{
+			failed = true;
+		}
+		allocCount.allocationLimit = SIZE_MAX;
+		ASSERT_EQ(allocCount.allocations, allocCount.deallocations) << "limit " << limit;
+		if (!failed)
+			break;
+	}
+}
+
+TEST(allocations, copy_out_of_memory)
+{
+	check_copy_out_of_memory< bs_sizet_t >([](size_t i) { return i; });
+	check_copy_out_of_memory< bs_cow_t >([](size_t i) { return i; });
+	check_copy_out_of_memory< bs_ordered_t >([](size_t i) { return Quote{ static_cast< double >(i % 37), i }; });
+	check_copy_out_of_memory< bs_string_t >([](size_t i) { return std::string(40, static_cast< char >('a' + i % 26)); });
+	check_copy_out_of_memory< bs_indexed_t >([](size_t i) { return Record{ std::to_string(i), i }; });
+}
+
+TEST(snapshot, save_load_stream)
+{
+	bs_sizet_t b = bs_sizet_t(16);
+	std::vector< bs_sizet_t::iterator > its;
+	for (size_t i = 0; i < 1000; ++i)
+		its.push_back(b.insert(i));
+	for (size_t i = 0; i < 1000; i += 7)
+		b.erase(its[i]);
+	for (size_t i = 0; i < 100; ++i)
+		b.insert(5000 + i);
+
+	std::stringstream stream;
+	b.save(stream);
+
+	bs_sizet_t c;
+	c.insert(42);
+	c.load(stream);
+	ASSERT_EQ(c.size(), b.size());
+	ASSERT_EQ(c.capacity(), b.capacity());
+	ASSERT_TRUE(std::equal(b.begin(), b.end(), c.begin(), c.end()));
+	ASSERT_EQ(b.memory_stats().occupancy_histogram, c.memory_stats().occupancy_histogram);
+
+	for (size_t i = 0; i < 200; ++i)
+		c.insert(9000 + i);
+	c.erase(c.begin());
+	ASSERT_EQ(c.size(), b.size() + 199);
+	ASSERT_EQ(*--c.end(), 9199);
+}
+
+TEST(snapshot, save_load_fd)
+{
+	bs_compact_t b = bs_compact_t();
+	for (size_t i = 0; i < 300; ++i)
+		b.insert(i * i);
+
+	std::FILE *file = std::tmpfile();
+	ASSERT_NE(file, nullptr);
+	b.save(fileno(file));
+	std::rewind(file);
+
+	bs_compact_t c;
+	c.load(fileno(file));
+	std::fclose(file);
+	ASSERT_TRUE(std::equal(b.begin(), b.end(), c.begin(), c.end()));
+
+	// Whatever follows a snapshot is still there to read after load(), from a file as well as from a pipe.
+	auto check_trailer = [&](int write_fd, int read_fd, auto rewind)
+	{
+		const char trailer[] = "trailer";
+		b.save(write_fd);
+		b.save(write_fd);
+		ASSERT_EQ(::write(write_fd, trailer, sizeof(trailer)), static_cast< ssize_t >(sizeof(trailer)));
+		rewind();
+		bs_compact_t first;
+		first.load(read_fd);
+		bs_compact_t second;
+		second.load(read_fd);
+		ASSERT_TRUE(std::equal(b.begin(), b.end(), second.begin(), second.end()));
+		char tail[sizeof(trailer)] = {};
+		ASSERT_EQ(::read(read_fd, tail, sizeof(tail)), static_cast< ssize_t >(sizeof(tail)));
+		ASSERT_STREQ(tail, trailer);
+	};
+	file = std::tmpfile();
+	ASSERT_NE(file, nullptr);
+	check_trailer(fileno(file), fileno(file), [&] { std::rewind(file); });
+	std::fclose(file);
+
+	int fds[2];
+	ASSERT_EQ(::pipe(fds), 0);
+	check_trailer(fds[1], fds[0], [] {});
+	::close(fds[0]);
+	::close(fds[1]);
+}
+
+TEST(snapshot, rejects_bad_input)
+{
+	bs_sizet_t b = bs_sizet_t();
+	for (size_t i = 0; i < 100; ++i)
+		b.insert(i);
+	std::stringstream stream;
+	b.save(stream);
+	std::string bytes = stream.str();
+
+	std::string corrupted = bytes;
+	corrupted[corrupted.size() - 3] ^= 1;
+	std::stringstream corrupted_stream(corrupted);
+	bs_sizet_t c;
+	c.insert(7);
+	ASSERT_THROW(c.load(corrupted_stream), std::runtime_error);
+	ASSERT_EQ(c.size(), 1);
+	ASSERT_EQ(*c.begin(), 7);
+
+	using details::SnapshotHeader;
+	std::string bad_start = bytes;
+	bad_start[offsetof(SnapshotHeader, start)] ^= 1;
+	std::stringstream bad_start_stream(bad_start);
+	ASSERT_THROW(c.load(bad_start_stream), std::runtime_error);
+	ASSERT_EQ(c.size(), 1);
+
+	// A header that points past the loaded blocks is rejected even when its checksum matches.
+	auto resign = [&](SnapshotHeader header)
+	{
+		header.checksum = 0;
+		details::ChecksumSink checksum;
+		checksum.write(&header, sizeof(header));
+		checksum.write(bytes.data() + sizeof(header), bytes.size() - sizeof(header));
+		header.checksum = checksum.digest();
+		std::string signed_bytes = bytes;
+		std::memcpy(signed_bytes.data(), &header, sizeof(header));
+		return signed_bytes;
+	};
+	SnapshotHeader header;
+	std::memcpy(&header, bytes.data(), sizeof(header));
+	std::stringstream resigned(resign(header));
+	ASSERT_NO_THROW(c.load(resigned));
+	ASSERT_EQ(c.size(), 100);
+	c.clear();
+	c.insert(7);
+	for (uint64_t start : { header.start + 1000, header.start + (uint64_t(1) << 40), uint64_t(-1) })
+	{
+		SnapshotHeader forged = header;
+		forged.start = start;
+		std::stringstream forged_stream(resign(forged));
+		ASSERT_THROW(c.load(forged_stream), std::runtime_error);
+		ASSERT_EQ(c.size(), 1);
+	}
+	SnapshotHeader forged = header;
+	forged.end = header.start;
+	forged.size = 0;
+	std::stringstream forged_empty(resign(forged));
+	ASSERT_THROW(c.load(forged_empty), std::runtime_error);
+
+	std::stringstream truncated(bytes.substr(0, bytes.size() / 2));
+	ASSERT_THROW(c.load(truncated), std::runtime_error);
+
+	std::stringstream other_type(bytes);
+	BucketStorage< uint32_t > d;
+	ASSERT_THROW(d.load(other_type), std::runtime_error);
+}
+
+TEST(mapped, reopen)
+{
+	std::string path = ::testing::TempDir() + "bucket_storage_mapped_reopen.bin";
+	std::remove(path.c_str());
+	std::vector< size_t > expected;
+	{
+		bs_mapped_t b(path.c_str(), 16);
+		std::vector< bs_mapped_t::iterator > its;
+		for (size_t i = 0; i < 1000; ++i)
+			its.push_back(b.insert(i));
+		for (size_t i = 0; i < 1000; i += 3)
+			b.erase(its[i]);
+		for (size_t i = 16; i < 32; ++i)
+			if (i % 3 != 0)
+				b.erase(its[i]);
+		*b.begin() = 77;
+		b.flush();
+		expected.assign(b.begin(), b.end());
+	}
+	{
+		bs_mapped_t b(path.c_str(), 16);
+		ASSERT_EQ(b.size(), expected.size());
+		ASSERT_TRUE(std::equal(b.begin(), b.end(), expected.begin(), expected.end()));
+		ASSERT_EQ(*b.begin(), 77);
+
+		size_t blocks = b.memory_stats().blocks;
+		for (size_t i = 0; i < 300; ++i)
+		{
+			b.insert(5000 + i);
+			expected.push_back(5000 + i);
+		}
+		ASSERT_EQ(b.memory_stats().blocks, blocks);
+		b.erase(b.begin());
+		expected.erase(expected.begin());
+	}
+	{
+		bs_mapped_t b(path.c_str(), 16);
+		ASSERT_TRUE(std::equal(b.begin(), b.end(), expected.begin(), expected.end()));
+		ASSERT_EQ(*--b.end(), 5299);
+		b.clear();
+	}
+	{
+		bs_mapped_t b(path.c_str(), 16);
+		ASSERT_TRUE(b.empty());
+		b.insert(1);
+		ASSERT_EQ(b.capacity(), 16);
+	}
+	std::remove(path.c_str());
+}
+
+TEST(mapped, rejects_mismatch)
+{
+	std::string path = ::testing::TempDir() + "bucket_storage_mapped_mismatch.bin";
+	std::remove(path.c_str());
+	{
+		bs_mapped_t b(path.c_str(), 16);
+		b.insert(1);
+	}
+	ASSERT_THROW(bs_mapped_t(path.c_str(), 32), std::runtime_error);
+	ASSERT_THROW((BucketStorage< uint32_t, file_backed >(path.c_str(), 16)), std::runtime_error);
+	ASSERT_EQ(bs_mapped_t(path.c_str(), 16).size(), 1);
+	std::remove(path.c_str());
+}
+
+TEST(prefetch, matches_iteration)
+{
+	bs_sizet_t b = bs_sizet_t(8);
+	std::vector< bs_sizet_t::iterator > its;
+	for (size_t i = 0; i < 200; ++i)
+		its.push_back(b.insert(i));
+	for (size_t i = 0; i < 200; i += 3)
+		b.erase(its[i]);
+	for (size_t i = 0; i < 50; ++i)
+		b.insert(1000 + i);
+	std::vector< size_t > expected(b.begin(), b.end());
+
+	for (size_t distance : { 0, 1, 8, 1000 })
+	{
+		std::vector< size_t > seen;
+		for (size_t x : b.prefetched(distance))
+			seen.push_back(x);
+		ASSERT_EQ(seen, expected);
+
+		seen.clear();
+		std::as_const(b).for_each([&](const size_t &x) { seen.push_back(x); }, distance);
+		ASSERT_EQ(seen, expected);
+	}
+
+	b.for_each([](size_t &x) { x *= 2; });
+	bs_sizet_t::prefetch_iterator it = b.prefetched().begin();
+	for (size_t x : expected)
+		ASSERT_EQ(*it++, 2 * x);
+	ASSERT_TRUE(it == b.end());
+	ASSERT_TRUE(it.base() == b.end());
+
+	bs_sizet_t empty;
+	ASSERT_TRUE(empty.prefetched().begin() == empty.end());
+	empty.for_each([](size_t &) { FAIL(); });
+}
+
+TEST(unordered, visits_every_live_value)
+{
+	bs_sizet_t b = bs_sizet_t(8);
+	std::vector< bs_sizet_t::iterator > its;
+	for (size_t i = 0; i < 300; ++i)
+		its.push_back(b.insert(i));
+	for (size_t i = 0; i < 300; i += 3)
+		b.erase(its[i]);
+	for (size_t i = 64; i < 128; ++i)
+		if (i % 3 != 0)
+			b.erase(its[i]);
+	for (size_t i = 0; i < 20; ++i)
+		b.insert(1000 + i);
+	std::vector< size_t > expected(b.begin(), b.end());
+	std::sort(expected.begin(), expected.end());
+
+	std::vector< size_t > seen(std::as_const(b).unordered_begin(), std::as_const(b).unordered_end());
+	std::sort(seen.begin(), seen.end());
+	ASSERT_EQ(seen, expected);
+
+	seen.clear();
+	std::as_const(b).for_each_unordered([&](const size_t &x) { seen.push_back(x); });
+	std::sort(seen.begin(), seen.end());
+	ASSERT_EQ(seen, expected);
+
+	b.for_each_unordered([](size_t &x) { x += 1; });
+	for (bs_sizet_t::unordered_iterator it = b.unordered_begin(); it != b.unordered_end(); ++it)
+		*it *= 2;
+	std::vector< size_t > ordered(b.begin(), b.end());
+	std::sort(ordered.begin(), ordered.end());
+	for (size_t i = 0; i < expected.size(); ++i)
+		ASSERT_EQ(ordered[i], 2 * (expected[i] + 1));
+	ASSERT_EQ(*b.unordered_begin().base(), *b.unordered_begin());
+
+	bs_sizet_t empty;
+	ASSERT_TRUE(empty.unordered_begin() == empty.unordered_end());
+	empty.for_each_unordered([](size_t &) { FAIL(); });
+}
+
+TEST(handoff, keeps_order_across_threads)
+{
+	constexpr size_t n = 200000;
+	BlockHandoff< size_t > handoff(16, 4);
+	std::thread producer(
+		[&]
+		{
+			for (size_t i = 0; i < n; ++i)
+				handoff.push(i);
+			handoff.flush();
+		});
+	size_t expected = 0;
+	bool in_order = true;
+	while (expected < n)
+		if (handoff.consume([&](size_t &x) { in_order = in_order && x == expected++; }) == 0)
+			std::this_thread::yield();
+	producer.join();
+	ASSERT_TRUE(in_order);
+	ASSERT_EQ(handoff.consume([](size_t &) {}), 0);
+}
+
+TEST(handoff, destroys_unconsumed_values)
+{
+	auto shared = std::make_shared< int >(7);
+	{
+		BlockHandoff< std::shared_ptr< int > > handoff(4);
+		for (size_t i = 0; i < 10; ++i)
+			handoff.push(shared);
+		handoff.flush();
+		ASSERT_EQ(shared.use_count(), 11);
+
+		size_t calls = 0;
+		ASSERT_THROW(handoff.consume(
+						 [&](std::shared_ptr< int > &)
+						 {
+							 if (++calls == 2)
+								 throw std::runtime_error("stop");
+						 }),
+					 std::runtime_error);
+		ASSERT_EQ(shared.use_count(), 9);
+		ASSERT_EQ(handoff.consume([](std::shared_ptr< int > &p) { ASSERT_EQ(*p, 7); }), 8);
+		handoff.push(shared);
+		handoff.push(shared);
+	}
+	ASSERT_EQ(shared.use_count(), 1);
+}
+
 int main(int argc, char **argv)
 {
 	::testing::InitGoogleTest();